@@ -0,0 +1,175 @@
+// Compares buffered copies with --direct-io copies of large files.
+//
+//   copy_benchmark <scratch dir> [file sizes in MiB...]
+//
+// For each size, a source file is written to the scratch directory and
+// copied both ways. Every run starts with the source out of the page cache
+// and ends with fsync, so both pay for reading from and writing to the
+// device; the table also shows how much of the copy is left in the page
+// cache afterwards, which is what direct I/O is about.
+#include "src/CopyEngine/CopyEngine.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+constexpr std::uintmax_t kMiB = 1024 * 1024;
+
+bool writeSource(const fs::path &path, std::uintmax_t size) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  std::vector<char> block(kMiB);
+  unsigned state = 12345;
+  for (char &c : block) {
+    state = state * 1103515245 + 12345;
+    c = static_cast<char>(state >> 16);
+  }
+  bool ok = true;
+  for (std::uintmax_t written = 0; ok && written < size; written += kMiB) {
+    block[0] = static_cast<char>(written / kMiB);
+    ok = ::write(fd, block.data(), block.size()) ==
+         static_cast<ssize_t>(block.size());
+  }
+  ok = ok && ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+void evict(const fs::path &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+#ifdef POSIX_FADV_DONTNEED
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    ::close(fd);
+  }
+}
+
+// MiB of path held in the page cache.
+double cachedMiB(const fs::path &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  std::error_code ec;
+  std::uintmax_t size = fs::file_size(path, ec);
+  double cached = 0;
+  if (!ec && size > 0) {
+    void *map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+      std::vector<unsigned char> resident((size + page - 1) / page);
+      if (::mincore(map, size, resident.data()) == 0) {
+        for (unsigned char pageState : resident) {
+          cached += (pageState & 1) != 0 ? page : 0;
+        }
+      }
+      ::munmap(map, size);
+    }
+  }
+  ::close(fd);
+  return cached / kMiB;
+}
+
+struct Run {
+  double seconds = 0;
+  double sourceCached = 0;
+  double targetCached = 0;
+  bool direct = false;
+};
+
+bool copyOnce(const fs::path &source, const fs::path &target, bool directIo,
+              Run &run) {
+  evict(source);
+  fs::remove(target);
+  auto started = std::chrono::steady_clock::now();
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (in < 0 || out < 0) {
+    return false;
+  }
+  CopyEngine::Options options;
+  options.directIo = directIo;
+  std::error_code ec;
+  CopyEngine::Result result = CopyEngine(options).copy(
+      in, out, fs::file_size(source), [](long long) {}, ec);
+  bool ok = !ec && ::fsync(out) == 0;
+  ::close(in);
+  ::close(out);
+  run.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - started)
+                    .count();
+  run.sourceCached = cachedMiB(source);
+  run.targetCached = cachedMiB(target);
+  run.direct = result.method == CopyEngine::Method::Direct;
+  return ok;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <scratch dir> [file sizes in MiB...]\n",
+                 argv[0]);
+    return 1;
+  }
+  fs::path dir = argv[1];
+  std::vector<std::uintmax_t> sizes;
+  for (int i = 2; i < argc; ++i) {
+    sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+  }
+  if (sizes.empty()) {
+    sizes = {64, 256, 1024};
+  }
+  const std::uintmax_t threshold = CopyEngine::Options().directIoThreshold;
+
+  std::printf("%10s  %-8s  %9s  %9s  %14s  %14s\n", "size MiB", "mode",
+              "seconds", "MiB/s", "source cached", "target cached");
+  fs::path source = dir / "ekatra-bench-source";
+  fs::path target = dir / "ekatra-bench-target";
+  for (std::uintmax_t size : sizes) {
+    if (size * kMiB < threshold) {
+      std::printf("%10ju  below the direct I/O threshold, skipped\n", size);
+      continue;
+    }
+    if (!writeSource(source, size * kMiB)) {
+      std::perror("writing the source file");
+      return 1;
+    }
+    for (bool directIo : {false, true}) {
+      Run run;
+      if (!copyOnce(source, target, directIo, run)) {
+        std::perror("copying");
+        return 1;
+      }
+      const char *mode = !directIo ? "buffered"
+                         : run.direct ? "direct"
+                                      : "direct*";
+      std::printf("%10ju  %-8s  %9.2f  %9.1f  %14.1f  %14.1f\n", size, mode,
+                  run.seconds, static_cast<double>(size) / run.seconds,
+                  run.sourceCached, run.targetCached);
+    }
+  }
+  std::printf("(direct* = the filesystem refused O_DIRECT; copied buffered)\n");
+  std::error_code ec;
+  fs::remove(source, ec);
+  fs::remove(target, ec);
+  return 0;
+}
+#else
+int main() {
+  std::fprintf(stderr, "copy_benchmark needs a POSIX system.\n");
+  return 1;
+}
+#endif
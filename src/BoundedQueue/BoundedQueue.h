@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// A blocking multi-producer/multi-consumer queue with a fixed capacity.
+// Producers block while the queue is full, which throttles a fast producer
+// (the scanner) to the speed of its consumers (the copy loop).
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : m_capacity(capacity) {}
+
+  // Blocks until there is room. Returns false, dropping item, once the queue
+  // has been closed.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notFull.wait(lock,
+                   [this] { return m_closed || m_items.size() < m_capacity; });
+    if (m_closed) {
+      return false;
+    }
+    m_items.push_back(std::move(item));
+    m_notEmpty.notify_one();
+    return true;
+  }
+
+  // Blocks until an item is available. Returns false once the queue is closed
+  // and drained.
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_notEmpty.wait(lock, [this] { return m_closed || !m_items.empty(); });
+    if (m_items.empty()) {
+      return false;
+    }
+    item = std::move(m_items.front());
+    m_items.pop_front();
+    m_notFull.notify_one();
+    return true;
+  }
+
+  // Wakes every waiter. Items already queued can still be popped.
+  void close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_notEmpty.notify_all();
+    m_notFull.notify_all();
+  }
+
+private:
+  const size_t m_capacity;
+  std::deque<T> m_items;
+  std::mutex m_mutex;
+  std::condition_variable m_notEmpty;
+  std::condition_variable m_notFull;
+  bool m_closed = false;
+};
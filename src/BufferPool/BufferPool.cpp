@@ -0,0 +1,257 @@
+#include "BufferPool.h"
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+// Buffers from this size up are worth backing with huge pages.
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+size_t roundUpToClass(size_t size) {
+  size_t result = BufferPool::kMinBufferSize;
+  while (result < size && result < BufferPool::kMaxBufferSize) {
+    result *= 2;
+  }
+  return result;
+}
+} // namespace
+
+BufferPool::Lease::~Lease() { reset(); }
+
+BufferPool::Lease::Lease(Lease &&other) noexcept
+    : m_pool(other.m_pool), m_data(other.m_data), m_size(other.m_size) {
+  other.m_pool = nullptr;
+  other.m_data = nullptr;
+  other.m_size = 0;
+}
+
+BufferPool::Lease &BufferPool::Lease::operator=(Lease &&other) noexcept {
+  if (this != &other) {
+    reset();
+    std::swap(m_pool, other.m_pool);
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+  }
+  return *this;
+}
+
+void BufferPool::Lease::reset() {
+  if (m_data != nullptr) {
+    m_pool->release(m_data, m_size);
+  }
+  m_pool = nullptr;
+  m_data = nullptr;
+  m_size = 0;
+}
+
+BufferPool::BufferPool(size_t budget, bool hugePages)
+    : m_free(classIndex(kMaxBufferSize) + 1), m_budget(budget),
+      m_hugePages(hugePages) {}
+
+BufferPool::~BufferPool() {
+  for (size_t i = 0; i < m_free.size(); ++i) {
+    for (char *data : m_free[i]) {
+      deallocate(data, kMinBufferSize << i);
+    }
+  }
+}
+
+BufferPool &BufferPool::shared() {
+  static BufferPool pool;
+  return pool;
+}
+
+void BufferPool::configure(size_t budget, bool hugePages) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_budget = budget;
+  m_hugePages = hugePages;
+  evictFor(0);
+  m_returned.notify_all();
+}
+
+size_t BufferPool::budget() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_budget;
+}
+
+size_t BufferPool::allocated() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_allocated;
+}
+
+size_t BufferPool::classIndex(size_t size) {
+  size_t index = 0;
+  while ((kMinBufferSize << index) < size) {
+    ++index;
+  }
+  return index;
+}
+
+char *BufferPool::allocate(size_t size) {
+#ifdef _WIN32
+  void *data = _aligned_malloc(size, 4096);
+  if (data == nullptr) {
+    throw std::bad_alloc();
+  }
+  return static_cast<char *>(data);
+#else
+  void *data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (m_hugePages && size >= kHugePageSize) {
+    // Only succeeds when the administrator reserved huge pages.
+    data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (data == MAP_FAILED) {
+    data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (m_hugePages && size >= kHugePageSize) {
+      ::madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  return static_cast<char *>(data);
+#endif
+}
+
+void BufferPool::deallocate(char *data, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  _aligned_free(data);
+#else
+  ::munmap(data, size);
+#endif
+}
+
+void BufferPool::evictFor(size_t extra) {
+  // Largest idle buffers first: fewest calls to free the most memory.
+  for (size_t i = m_free.size(); i-- > 0 && m_allocated + extra > m_budget;) {
+    while (!m_free[i].empty() && m_allocated + extra > m_budget) {
+      deallocate(m_free[i].back(), kMinBufferSize << i);
+      m_free[i].pop_back();
+      m_allocated -= kMinBufferSize << i;
+    }
+  }
+}
+
+char *BufferPool::take(size_t size) {
+  std::vector<char *> &idle = m_free[classIndex(size)];
+  if (!idle.empty()) {
+    char *data = idle.back();
+    idle.pop_back();
+    m_leased += size;
+    return data;
+  }
+  if (m_leased + size > m_budget) {
+    return nullptr;
+  }
+  evictFor(size);
+  char *data = allocate(size);
+  m_allocated += size;
+  m_leased += size;
+  return data;
+}
+
+BufferPool::Lease BufferPool::acquire(size_t size) {
+  size = roundUpToClass(size);
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    for (size_t candidate = size; candidate >= kMinBufferSize;
+         candidate /= 2) {
+      if (char *data = take(candidate)) {
+        return Lease(this, data, candidate);
+      }
+    }
+    if (m_leased == 0) {
+      // The budget is below one buffer; serve it anyway rather than wait
+      // for a return that will never come.
+      evictFor(m_budget);
+      char *data = allocate(kMinBufferSize);
+      m_allocated += kMinBufferSize;
+      m_leased += kMinBufferSize;
+      return Lease(this, data, kMinBufferSize);
+    }
+    m_returned.wait(lock);
+  }
+}
+
+BufferPool::Lease BufferPool::tryAcquire(size_t size) {
+  size = roundUpToClass(size);
+  std::lock_guard<std::mutex> lock(m_mutex);
+  char *data = take(size);
+  return data != nullptr ? Lease(this, data, size) : Lease();
+}
+
+void BufferPool::release(char *data, size_t size) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_leased -= size;
+  if (m_allocated > m_budget) {
+    // The budget was lowered while this was out.
+    deallocate(data, size);
+    m_allocated -= size;
+  } else {
+    m_free[classIndex(size)].push_back(data);
+  }
+  m_returned.notify_all();
+}
+
+ChunkSizer::ChunkSizer(BufferPool &pool, std::uintmax_t fileSize,
+                       size_t capacity)
+    : m_pool(pool), m_limit(capacity) {
+  if (fileSize > 0 && fileSize < m_limit) {
+    // A chunk larger than the file buys nothing.
+    m_limit = std::max<size_t>(roundUpToClass(static_cast<size_t>(fileSize)),
+                               BufferPool::kMinBufferSize);
+    m_limit = std::min(m_limit, capacity);
+  }
+  m_size = std::min(pool.preferredChunkSize(), m_limit);
+  m_settled = m_size >= m_limit;
+}
+
+ChunkSizer::~ChunkSizer() {
+  if (m_measured) {
+    m_pool.reportChunkSize(m_size);
+  }
+}
+
+void ChunkSizer::record(size_t bytes,
+                        std::chrono::steady_clock::duration elapsed) {
+  if (m_settled) {
+    return;
+  }
+  m_bytes += static_cast<double>(bytes);
+  m_seconds += std::chrono::duration<double>(elapsed).count();
+  if (++m_samples < kSamples || m_seconds <= 0) {
+    return;
+  }
+
+  double throughput = m_bytes / m_seconds;
+  m_measured = true;
+  m_samples = 0;
+  m_bytes = 0;
+  m_seconds = 0;
+  if (m_previous > 0 && throughput < m_previous * 1.1) {
+    // Doubling did not pay off; the previous size was as good.
+    if (throughput < m_previous) {
+      m_size /= 2;
+    }
+    m_settled = true;
+    return;
+  }
+  m_previous = throughput;
+  if (m_size * 2 > m_limit) {
+    m_settled = true;
+    return;
+  }
+  m_size *= 2;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Page-aligned I/O buffers shared by every copy in the process.
+//
+// Copies borrow a buffer for as long as they run and hand it back, so
+// buffers are reused across files, threads and backends instead of being
+// allocated per copy. Everything allocated counts against one memory
+// budget: when it is used up, borrowers get smaller buffers, and only when
+// not even the smallest fits do they wait for one to come back. Total I/O
+// memory therefore stays bounded however many jobs run.
+class BufferPool {
+public:
+  static constexpr size_t kMinBufferSize = 64 * 1024;
+  static constexpr size_t kMaxBufferSize = 16 * 1024 * 1024;
+  static constexpr size_t kDefaultBudget = 256 * 1024 * 1024;
+
+  // A borrowed buffer; returned to the pool when destroyed.
+  class Lease {
+  public:
+    Lease() = default;
+    ~Lease();
+
+    Lease(Lease &&other) noexcept;
+    Lease &operator=(Lease &&other) noexcept;
+
+    char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    explicit operator bool() const { return m_data != nullptr; }
+
+  private:
+    friend class BufferPool;
+    Lease(BufferPool *pool, char *data, size_t size)
+        : m_pool(pool), m_data(data), m_size(size) {}
+    void reset();
+
+    BufferPool *m_pool = nullptr;
+    char *m_data = nullptr;
+    size_t m_size = 0;
+  };
+
+  explicit BufferPool(size_t budget = kDefaultBudget, bool hugePages = false);
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // The pool all copies share.
+  static BufferPool &shared();
+
+  // hugePages backs buffers of 2 MiB and up with huge pages where the
+  // system offers them (hugetlbfs, else transparent huge pages).
+  void configure(size_t budget, bool hugePages);
+
+  // Borrows a buffer of size bytes, rounded up to a power of two within
+  // [kMinBufferSize, kMaxBufferSize]. When the budget is short the buffer
+  // may be smaller, down to kMinBufferSize; blocks only while even that
+  // does not fit. A borrower that holds nothing else is always served.
+  Lease acquire(size_t size);
+
+  // Like acquire(), but returns an empty lease instead of shrinking or
+  // blocking.
+  Lease tryAcquire(size_t size);
+
+  size_t budget() const;
+  // Bytes allocated, leased or cached.
+  size_t allocated() const;
+
+  // The chunk size recent copies found fastest; where the next copy starts.
+  size_t preferredChunkSize() const { return m_preferredChunk.load(); }
+  void reportChunkSize(size_t size) { m_preferredChunk.store(size); }
+
+private:
+  static size_t classIndex(size_t size);
+  char *allocate(size_t size);
+  void deallocate(char *data, size_t size);
+  // Takes a cached buffer or allocates one of exactly size within the
+  // budget. Called with the lock held.
+  char *take(size_t size);
+  // Frees cached buffers until allocated + extra fits the budget.
+  void evictFor(size_t extra);
+  void release(char *data, size_t size);
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_returned;
+  // Idle buffers by size class (kMinBufferSize << index).
+  std::vector<std::vector<char *>> m_free;
+  size_t m_budget;
+  bool m_hugePages;
+  size_t m_allocated = 0;
+  size_t m_leased = 0;
+  std::atomic<size_t> m_preferredChunk{1024 * 1024};
+};
+
+// Picks the read size of one copy. It starts from the pool's preferred size
+// (no larger than the file or the buffer) and keeps doubling while each
+// step makes the copy more than 10% faster. Once it settles, the size is
+// reported back to the pool as the start for the next copies.
+class ChunkSizer {
+public:
+  ChunkSizer(BufferPool &pool, std::uintmax_t fileSize, size_t capacity);
+  ~ChunkSizer();
+
+  ChunkSizer(const ChunkSizer &) = delete;
+  ChunkSizer &operator=(const ChunkSizer &) = delete;
+
+  size_t size() const { return m_size; }
+
+  // One chunk of bytes took elapsed (read and write).
+  void record(size_t bytes, std::chrono::steady_clock::duration elapsed);
+
+  // Chunks averaged before a size is judged.
+  static constexpr unsigned kSamples = 4;
+
+private:
+  BufferPool &m_pool;
+  size_t m_size;
+  size_t m_limit;
+  bool m_settled = false;
+  bool m_measured = false;
+  unsigned m_samples = 0;
+  double m_bytes = 0;
+  double m_seconds = 0;
+  // Throughput of the previous size, bytes per second.
+  double m_previous = 0;
+};
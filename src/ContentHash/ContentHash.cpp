@@ -0,0 +1,361 @@
+#include "ContentHash.h"
+#include "src/BufferPool/BufferPool.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) &&                               \
+    (defined(__x86_64__) || defined(__i386__))
+#define EKATRA_HASH_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr std::uint64_t kPrime32_1 = 0x9E3779B1U;
+constexpr std::uint64_t kPrime32_2 = 0x85EBCA77U;
+constexpr std::uint64_t kPrime32_3 = 0xC2B2AE3DU;
+constexpr std::uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+constexpr std::uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr std::uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+constexpr std::uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr std::uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+constexpr size_t kSecretSize = 192;
+// Where the secret for the scramble after each block starts.
+constexpr size_t kScrambleOffset = kSecretSize - ContentHash::kStripeSize;
+// Secret of the zero-padded last stripe, away from the stripe offsets.
+constexpr size_t kLastStripeOffset = kSecretSize - ContentHash::kStripeSize - 7;
+
+// Fixed pseudo-random bytes (splitmix64 of a constant seed).
+const unsigned char *secret() {
+  static const std::array<unsigned char, kSecretSize> bytes = [] {
+    std::array<unsigned char, kSecretSize> result{};
+    std::uint64_t state = kPrime64_5;
+    for (size_t i = 0; i < kSecretSize; i += 8) {
+      std::uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      z ^= z >> 31;
+      for (size_t b = 0; b < 8; ++b) {
+        result[i + b] = static_cast<unsigned char>(z >> (8 * b));
+      }
+    }
+    return result;
+  }();
+  return bytes.data();
+}
+
+std::uint64_t readLE64(const unsigned char *p) {
+  std::uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+void accumulateStripe(std::uint64_t *acc, const unsigned char *data,
+                      const unsigned char *key) {
+  for (size_t i = 0; i < 8; ++i) {
+    std::uint64_t value = readLE64(data + 8 * i);
+    std::uint64_t keyed = value ^ readLE64(key + 8 * i);
+    acc[i ^ 1] += value;
+    acc[i] += (keyed & 0xFFFFFFFFU) * (keyed >> 32);
+  }
+}
+
+void blocksScalar(std::uint64_t *acc, const unsigned char *data,
+                  size_t blocks, const unsigned char *key) {
+  for (size_t b = 0; b < blocks; ++b, data += ContentHash::kBlockSize) {
+    for (size_t s = 0; s < ContentHash::kStripesPerBlock; ++s) {
+      accumulateStripe(acc, data + s * ContentHash::kStripeSize, key + 8 * s);
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      std::uint64_t value = acc[i];
+      value ^= value >> 47;
+      value ^= readLE64(key + kScrambleOffset + 8 * i);
+      acc[i] = value * kPrime32_1;
+    }
+  }
+}
+
+#ifdef EKATRA_HASH_X86
+// One 32-byte half of a stripe into four lanes.
+__attribute__((target("avx2"))) inline __m256i
+accumulateAvx2(__m256i lanes, const unsigned char *data,
+               const unsigned char *key) {
+  __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+  __m256i keyed = _mm256_xor_si256(
+      value, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key)));
+  __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+  // Each lane also takes its neighbour's input, as acc[i ^ 1] above.
+  __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+  return _mm256_add_epi64(lanes, _mm256_add_epi64(product, swapped));
+}
+
+__attribute__((target("avx2"))) inline __m256i
+scrambleAvx2(__m256i lanes, const unsigned char *key) {
+  const __m256i prime = _mm256_set1_epi32(static_cast<int>(kPrime32_1));
+  lanes = _mm256_xor_si256(lanes, _mm256_srli_epi64(lanes, 47));
+  lanes = _mm256_xor_si256(
+      lanes, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key)));
+  // 64-bit multiply by a 32-bit prime from two 32x32 products.
+  __m256i low = _mm256_mul_epu32(lanes, prime);
+  __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(lanes, 32), prime);
+  return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+}
+
+__attribute__((target("avx2"))) void
+blocksAvx2(std::uint64_t *acc, const unsigned char *data, size_t blocks,
+           const unsigned char *key) {
+  __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc));
+  __m256i high =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc + 4));
+  for (size_t b = 0; b < blocks; ++b, data += ContentHash::kBlockSize) {
+    for (size_t s = 0; s < ContentHash::kStripesPerBlock; ++s) {
+      const unsigned char *stripe = data + s * ContentHash::kStripeSize;
+      low = accumulateAvx2(low, stripe, key + 8 * s);
+      high = accumulateAvx2(high, stripe + 32, key + 8 * s + 32);
+    }
+    low = scrambleAvx2(low, key + kScrambleOffset);
+    high = scrambleAvx2(high, key + kScrambleOffset + 32);
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc), low);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + 4), high);
+}
+
+__attribute__((target("avx512f"))) void
+blocksAvx512(std::uint64_t *acc, const unsigned char *data, size_t blocks,
+             const unsigned char *key) {
+  __m512i lanes = _mm512_loadu_si512(acc);
+  const __m512i prime = _mm512_set1_epi32(static_cast<int>(kPrime32_1));
+  for (size_t b = 0; b < blocks; ++b, data += ContentHash::kBlockSize) {
+    for (size_t s = 0; s < ContentHash::kStripesPerBlock; ++s) {
+      __m512i value = _mm512_loadu_si512(data + s * ContentHash::kStripeSize);
+      __m512i keyed =
+          _mm512_xor_si512(value, _mm512_loadu_si512(key + 8 * s));
+      __m512i product = _mm512_mul_epu32(keyed, _mm512_srli_epi64(keyed, 32));
+      __m512i swapped = _mm512_shuffle_epi32(value, _MM_PERM_BADC);
+      lanes = _mm512_add_epi64(lanes, _mm512_add_epi64(product, swapped));
+    }
+    lanes = _mm512_xor_si512(lanes, _mm512_srli_epi64(lanes, 47));
+    lanes = _mm512_xor_si512(lanes,
+                             _mm512_loadu_si512(key + kScrambleOffset));
+    __m512i low = _mm512_mul_epu32(lanes, prime);
+    __m512i high = _mm512_mul_epu32(_mm512_srli_epi64(lanes, 32), prime);
+    lanes = _mm512_add_epi64(low, _mm512_slli_epi64(high, 32));
+  }
+  _mm512_storeu_si512(acc, lanes);
+}
+#endif
+
+// Low and high halves of the 128-bit product, added.
+std::uint64_t multiplyFold(std::uint64_t a, std::uint64_t b) {
+  std::uint64_t aLow = a & 0xFFFFFFFFU, aHigh = a >> 32;
+  std::uint64_t bLow = b & 0xFFFFFFFFU, bHigh = b >> 32;
+  std::uint64_t lowLow = aLow * bLow;
+  std::uint64_t highLow = aHigh * bLow;
+  std::uint64_t lowHigh = aLow * bHigh;
+  std::uint64_t highHigh = aHigh * bHigh;
+  std::uint64_t cross = (lowLow >> 32) + (highLow & 0xFFFFFFFFU) + lowHigh;
+  std::uint64_t high = highHigh + (highLow >> 32) + (cross >> 32);
+  std::uint64_t low = (cross << 32) | (lowLow & 0xFFFFFFFFU);
+  return low ^ high;
+}
+} // namespace
+
+ContentHash::ContentHash(Backend backend)
+    : m_blocks(blocksScalar), m_backend(Backend::Scalar),
+      m_acc{kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3,
+            kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1} {
+#ifdef EKATRA_HASH_X86
+  if (supported(backend)) {
+    m_backend = backend;
+    if (backend == Backend::Avx2) {
+      m_blocks = blocksAvx2;
+    } else if (backend == Backend::Avx512) {
+      m_blocks = blocksAvx512;
+    }
+  }
+#else
+  (void)backend;
+#endif
+}
+
+bool ContentHash::supported(Backend backend) {
+  switch (backend) {
+  case Backend::Scalar:
+    return true;
+#ifdef EKATRA_HASH_X86
+  case Backend::Avx2:
+    return __builtin_cpu_supports("avx2");
+  case Backend::Avx512:
+    return __builtin_cpu_supports("avx512f");
+#endif
+  default:
+    return false;
+  }
+}
+
+ContentHash::Backend ContentHash::fastest() {
+  static const Backend best = supported(Backend::Avx512) ? Backend::Avx512
+                              : supported(Backend::Avx2) ? Backend::Avx2
+                                                         : Backend::Scalar;
+  return best;
+}
+
+void ContentHash::update(const void *data, size_t size) {
+  const unsigned char *input = static_cast<const unsigned char *>(data);
+  m_length += size;
+  if (m_buffered > 0) {
+    size_t take = std::min(size, kBlockSize - m_buffered);
+    std::memcpy(m_buffer + m_buffered, input, take);
+    m_buffered += take;
+    input += take;
+    size -= take;
+    if (m_buffered < kBlockSize) {
+      return;
+    }
+    m_blocks(m_acc, m_buffer, 1, secret());
+    m_buffered = 0;
+  }
+  // Whole blocks straight from the caller's buffer; keep the rest.
+  size_t blocks = size / kBlockSize;
+  if (blocks > 0) {
+    m_blocks(m_acc, input, blocks, secret());
+    input += blocks * kBlockSize;
+    size -= blocks * kBlockSize;
+  }
+  std::memcpy(m_buffer, input, size);
+  m_buffered = size;
+}
+
+std::uint64_t ContentHash::digest() const {
+  const unsigned char *key = secret();
+  std::uint64_t acc[8];
+  std::memcpy(acc, m_acc, sizeof(acc));
+  size_t stripes = m_buffered / kStripeSize;
+  for (size_t s = 0; s < stripes; ++s) {
+    accumulateStripe(acc, m_buffer + s * kStripeSize, key + 8 * s);
+  }
+  size_t rest = m_buffered % kStripeSize;
+  if (rest > 0) {
+    // Padding is told apart from real zeros by the length below.
+    unsigned char last[kStripeSize] = {};
+    std::memcpy(last, m_buffer + stripes * kStripeSize, rest);
+    accumulateStripe(acc, last, key + kLastStripeOffset);
+  }
+
+  std::uint64_t result = m_length * kPrime64_1;
+  for (size_t i = 0; i < 4; ++i) {
+    result += multiplyFold(acc[2 * i] ^ readLE64(key + 11 + 16 * i),
+                           acc[2 * i + 1] ^ readLE64(key + 19 + 16 * i));
+  }
+  result ^= result >> 37;
+  result *= 0x165667919E3779F9ULL;
+  result ^= result >> 32;
+  return result;
+}
+
+std::string ContentHash::toHex(std::uint64_t hash) {
+  static const char digits[] = "0123456789abcdef";
+  std::string text(16, '0');
+  for (size_t i = 16; i-- > 0; hash >>= 4) {
+    text[i] = digits[hash & 0xF];
+  }
+  return text;
+}
+
+bool ContentHash::fromHex(const std::string &text, std::uint64_t &hash) {
+  if (text.size() != 16) {
+    return false;
+  }
+  hash = 0;
+  for (char c : text) {
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                       : -1;
+    if (digit < 0) {
+      return false;
+    }
+    hash = (hash << 4) | static_cast<std::uint64_t>(digit);
+  }
+  return true;
+}
+
+#ifndef _WIN32
+std::uint64_t
+ContentHash::hashDescriptor(int fd, std::uintmax_t &size,
+                            const std::function<void(long long)> &onProgress,
+                            std::error_code &ec) {
+  ContentHash hash;
+  BufferPool::Lease buffer =
+      BufferPool::shared().acquire(BufferPool::kMaxBufferSize);
+  size = 0;
+  while (true) {
+    ssize_t n = ::pread(fd, buffer.data(), buffer.size(),
+                        static_cast<off_t>(size));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      ec = std::error_code(errno, std::generic_category());
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    hash.update(buffer.data(), static_cast<size_t>(n));
+    size += static_cast<std::uintmax_t>(n);
+    onProgress(static_cast<long long>(size));
+  }
+  return hash.digest();
+}
+#endif
+
+std::uint64_t
+ContentHash::hashFile(const fs::path &path, std::uintmax_t &size,
+                      const std::function<void(long long)> &onProgress,
+                      std::error_code &ec) {
+  size = 0;
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    ec = std::error_code(errno, std::generic_category());
+    return 0;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  std::uint64_t result = hashDescriptor(fd, size, onProgress, ec);
+  ::close(fd);
+  return result;
+#else
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return 0;
+  }
+  ContentHash hash;
+  BufferPool::Lease buffer =
+      BufferPool::shared().acquire(BufferPool::kMaxBufferSize);
+  while (in.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) ||
+         in.gcount() > 0) {
+    hash.update(buffer.data(), static_cast<size_t>(in.gcount()));
+    size += static_cast<std::uintmax_t>(in.gcount());
+    onProgress(static_cast<long long>(size));
+  }
+  if (in.bad()) {
+    ec = std::make_error_code(std::errc::io_error);
+  }
+  return hash.digest();
+#endif
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+
+namespace fs = std::filesystem;
+
+// A fast 64-bit non-cryptographic hash of file contents, computed while the
+// bytes stream through a copy so checking the result needs no second read
+// of the source.
+//
+// The bulk loop is XXH3's: eight 64-bit lanes, each 64-byte stripe mixed
+// with a secret by one 32x32->64 multiply per lane, and a scramble after
+// every 1 KiB block. It is picked at runtime for the CPU (AVX-512, AVX2 or
+// plain C++), and all three give the same hashes. The tail and the final
+// mix are simpler than XXH3's, so the values do not match xxhsum; they only
+// need to match each other.
+class ContentHash {
+public:
+  enum class Backend { Scalar, Avx2, Avx512 };
+
+  static constexpr size_t kStripeSize = 64;
+  static constexpr size_t kStripesPerBlock = 16;
+  static constexpr size_t kBlockSize = kStripeSize * kStripesPerBlock;
+
+  // Uses the fastest backend the CPU supports.
+  ContentHash() : ContentHash(fastest()) {}
+  // backend must be supported().
+  explicit ContentHash(Backend backend);
+
+  static bool supported(Backend backend);
+  static Backend fastest();
+  Backend backend() const { return m_backend; }
+
+  void update(const void *data, size_t size);
+  // Hash of everything passed to update() so far.
+  std::uint64_t digest() const;
+
+  static std::string toHex(std::uint64_t hash);
+  static bool fromHex(const std::string &text, std::uint64_t &hash);
+
+  // Reads path to its end with a buffer from BufferPool; size is set to the
+  // bytes read. onProgress gets the bytes read so far.
+  static std::uint64_t
+  hashFile(const fs::path &path, std::uintmax_t &size,
+           const std::function<void(long long)> &onProgress,
+           std::error_code &ec);
+#ifndef _WIN32
+  // Like hashFile(), from offset 0 of an open file; leaves its offset alone.
+  static std::uint64_t
+  hashDescriptor(int fd, std::uintmax_t &size,
+                 const std::function<void(long long)> &onProgress,
+                 std::error_code &ec);
+#endif
+
+  // Mixes blocks whole blocks of data into acc.
+  using BlockFunction = void (*)(std::uint64_t *acc, const unsigned char *data,
+                                 size_t blocks, const unsigned char *secret);
+
+private:
+  BlockFunction m_blocks;
+  Backend m_backend;
+  std::uint64_t m_acc[8];
+  // Input that does not fill a block yet.
+  unsigned char m_buffer[kBlockSize];
+  size_t m_buffered = 0;
+  std::uint64_t m_length = 0;
+};
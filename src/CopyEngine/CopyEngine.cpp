@@ -0,0 +1,849 @@
+#include "CopyEngine.h"
+#include "src/BufferPool/BufferPool.h"
+#include "src/ContentHash/ContentHash.h"
+#include "src/ThreadPool/ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+namespace {
+#ifndef _WIN32
+std::error_code lastError() {
+  return std::error_code(errno, std::generic_category());
+}
+
+// Borrows a buffer for copying up to size bytes, at most chunkSize.
+BufferPool::Lease borrowBuffer(std::uintmax_t size, size_t chunkSize) {
+  return BufferPool::shared().acquire(static_cast<size_t>(
+      std::min<std::uintmax_t>(chunkSize, std::max<std::uintmax_t>(size, 1))));
+}
+
+// O_DIRECT refuses offsets, lengths and buffers that are not aligned to
+// the device's blocks with EINVAL. Drops it from fd so the retry goes
+// through the page cache; false if fd was not in direct mode.
+bool leaveDirectMode(int fd) {
+#ifdef O_DIRECT
+  int flags = ::fcntl(fd, F_GETFL);
+  if (flags < 0 || (flags & O_DIRECT) == 0) {
+    return false;
+  }
+  return ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
+// Writes all of data at offset. Returns false with errno set on failure.
+bool writeAll(int out, const char *data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = ::pwrite(out, data, size, offset);
+    if (n < 0 &&
+        (errno == EINTR || (errno == EINVAL && leaveDirectMode(out)))) {
+      continue;
+    }
+    if (n <= 0) {
+      errno = n == 0 ? EIO : errno;
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+    offset += n;
+  }
+  return true;
+}
+
+void dropCached(int fd, std::uintmax_t offset, std::uintmax_t length) {
+#ifdef POSIX_FADV_DONTNEED
+  ::posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(length),
+                  POSIX_FADV_DONTNEED);
+#else
+  (void)fd;
+  (void)offset;
+  (void)length;
+#endif
+}
+
+// Drops the pages a copy is done with, a window at a time, so a large copy
+// does not push everything else out of the page cache. Source pages go
+// right away; target pages only once written back, so on Linux each
+// window's writeback is started as soon as it is copied and waited for one
+// window later. A window of 0 keeps everything.
+class DropBehind {
+public:
+  DropBehind(int in, std::uintmax_t inStart, int out, std::uintmax_t outStart,
+             std::uintmax_t window)
+      : m_in(in), m_out(out), m_inStart(inStart), m_outStart(outStart),
+        m_window(window) {}
+
+  // copied bytes past the start are done.
+  void advance(std::uintmax_t copied) {
+    if (m_window == 0 || copied - m_done < m_window) {
+      return;
+    }
+    dropCached(m_in, m_inStart + m_done, copied - m_done);
+#ifdef __linux__
+    ::sync_file_range(m_out, static_cast<off_t>(m_outStart + m_done),
+                      static_cast<off_t>(copied - m_done),
+                      SYNC_FILE_RANGE_WRITE);
+    if (m_done > m_written) {
+      ::sync_file_range(m_out, static_cast<off_t>(m_outStart + m_written),
+                        static_cast<off_t>(m_done - m_written),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+      dropCached(m_out, m_outStart + m_written, m_done - m_written);
+    }
+    m_written = m_done;
+#endif
+    m_done = copied;
+  }
+
+private:
+  int m_in;
+  int m_out;
+  std::uintmax_t m_inStart;
+  std::uintmax_t m_outStart;
+  std::uintmax_t m_window;
+  // Bytes whose source pages were dropped, and whose target pages were.
+  std::uintmax_t m_done = 0;
+  std::uintmax_t m_written = 0;
+};
+
+// Feeds bytes zeros to hash: a hole reads back as zeros.
+void hashZeros(ContentHash &hash, std::uintmax_t bytes) {
+  static const char zeros[64 * 1024] = {};
+  while (bytes > 0) {
+    size_t n =
+        static_cast<size_t>(std::min<std::uintmax_t>(bytes, sizeof(zeros)));
+    hash.update(zeros, n);
+    bytes -= n;
+  }
+}
+
+// Copies [start, end) with pread/pwrite; end may lie past the end of file.
+// sizeHint (the bytes expected) sizes the buffer. onChunk gets the bytes of
+// each chunk and returns false to stop; hash, if given, gets the bytes
+// themselves. Returns false with ec set on error.
+bool copyRange(int in, int out, std::uintmax_t start, std::uintmax_t end,
+               std::uintmax_t sizeHint, size_t chunkSize,
+               std::uintmax_t dropBehindWindow, ContentHash *hash,
+               const std::function<bool(size_t)> &onChunk,
+               std::error_code &ec) {
+  BufferPool::Lease buffer = borrowBuffer(sizeHint, chunkSize);
+  ChunkSizer sizer(BufferPool::shared(), sizeHint, buffer.size());
+  DropBehind dropBehind(in, start, out, start, dropBehindWindow);
+  for (std::uintmax_t offset = start; offset < end;) {
+    auto started = std::chrono::steady_clock::now();
+    size_t want = static_cast<size_t>(
+        std::min<std::uintmax_t>(sizer.size(), end - offset));
+    ssize_t n = ::pread(in, buffer.data(), want, static_cast<off_t>(offset));
+    if (n < 0 &&
+        (errno == EINTR || (errno == EINVAL && leaveDirectMode(in)))) {
+      continue;
+    }
+    if (n < 0) {
+      ec = lastError();
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    if (!writeAll(out, buffer.data(), static_cast<size_t>(n),
+                  static_cast<off_t>(offset))) {
+      ec = lastError();
+      return false;
+    }
+    if (hash != nullptr) {
+      hash->update(buffer.data(), static_cast<size_t>(n));
+    }
+    sizer.record(static_cast<size_t>(n),
+                 std::chrono::steady_clock::now() - started);
+    offset += static_cast<std::uintmax_t>(n);
+    dropBehind.advance(offset - start);
+    if (!onChunk(static_cast<size_t>(n))) {
+      break;
+    }
+  }
+  return true;
+}
+#endif
+
+#ifdef __linux__
+// Errors that mean "this tier cannot copy between these two files", as
+// opposed to a real I/O error: try the next tier instead.
+bool tierUnsupported(int error) {
+  return error == ENOSYS || error == EXDEV || error == EINVAL ||
+         error == EOPNOTSUPP || error == ENOTSUP || error == EBADF;
+}
+
+// The subset that is about the filesystems rather than the particular
+// files (EINVAL also covers an O_APPEND target, say).
+bool filesystemRefused(int error) {
+  return error == ENOSYS || error == EXDEV || error == EOPNOTSUPP ||
+         error == ENOTSUP;
+}
+
+CopyEngine::Method nextTier(CopyEngine::Method method) {
+  switch (method) {
+  case CopyEngine::Method::CopyFileRange:
+    return CopyEngine::Method::Sendfile;
+  case CopyEngine::Method::Sendfile:
+    return CopyEngine::Method::Splice;
+  default:
+    return CopyEngine::Method::ReadWrite;
+  }
+}
+
+// The first tier worth trying between a source and a target filesystem
+// (by st_dev), learned from the copies so far. Shared by every copy in the
+// process.
+class TierMemory {
+public:
+  using Filesystems = std::pair<std::uintmax_t, std::uintmax_t>;
+
+  static TierMemory &shared() {
+    static TierMemory memory;
+    return memory;
+  }
+
+  static bool filesystemsOf(int in, int out, Filesystems &filesystems) {
+    struct stat inStat;
+    struct stat outStat;
+    if (::fstat(in, &inStat) != 0 || ::fstat(out, &outStat) != 0) {
+      return false;
+    }
+    filesystems = {static_cast<std::uintmax_t>(inStat.st_dev),
+                   static_cast<std::uintmax_t>(outStat.st_dev)};
+    return true;
+  }
+
+  CopyEngine::Method firstTier(const Filesystems &filesystems) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_firstTier.find(filesystems);
+    return found == m_firstTier.end() ? CopyEngine::Method::CopyFileRange
+                                      : found->second;
+  }
+
+  // method was refused between these filesystems; skip it from now on.
+  void refused(const Filesystems &filesystems, CopyEngine::Method method) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    CopyEngine::Method &first =
+        m_firstTier.emplace(filesystems, CopyEngine::Method::CopyFileRange)
+            .first->second;
+    first = std::max(first, nextTier(method));
+  }
+
+private:
+  std::mutex m_mutex;
+  std::map<Filesystems, CopyEngine::Method> m_firstTier;
+};
+
+// A pipe for the splice tier, enlarged to kPipeSize where allowed. Kept
+// per thread and reused for later files, as long as no failure left bytes
+// in it.
+class SplicePipe {
+public:
+  SplicePipe() {
+    if (::pipe2(m_fds, O_CLOEXEC) != 0) {
+      m_fds[0] = m_fds[1] = -1;
+      return;
+    }
+    int size = ::fcntl(m_fds[1], F_SETPIPE_SZ,
+                       static_cast<int>(CopyEngine::kPipeSize));
+    if (size < 0) {
+      // Above pipe-max-size; keep what the pipe has.
+      size = ::fcntl(m_fds[1], F_GETPIPE_SZ);
+    }
+    m_capacity = size > 0 ? static_cast<size_t>(size) : 64 * 1024;
+  }
+
+  ~SplicePipe() {
+    for (int fd : m_fds) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  SplicePipe(const SplicePipe &) = delete;
+  SplicePipe &operator=(const SplicePipe &) = delete;
+
+  bool valid() const { return m_fds[0] >= 0; }
+  // False once a failed transfer() left bytes behind in the pipe.
+  bool empty() const { return m_empty; }
+
+  // Moves up to size bytes from in to out at their file offsets, like
+  // sendfile. Returns the bytes moved, 0 at the end of in, or -1 with errno
+  // set. When out refuses splicing, the bytes already in the pipe are still
+  // written to it with write(), and refusal is set to the error.
+  ssize_t transfer(int in, int out, size_t size, int &refusal) {
+    ssize_t got = ::splice(in, nullptr, m_fds[1], nullptr,
+                           std::min(size, m_capacity),
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (got <= 0) {
+      return got;
+    }
+    m_empty = false;
+    size_t left = static_cast<size_t>(got);
+    while (left > 0) {
+      ssize_t n = ::splice(m_fds[0], nullptr, out, nullptr, left,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && tierUnsupported(errno)) {
+        refusal = errno;
+        if (!drainTo(out, left)) {
+          return -1;
+        }
+        m_empty = true;
+        return got;
+      }
+      if (n <= 0) {
+        errno = n == 0 ? EIO : errno;
+        return -1;
+      }
+      left -= static_cast<size_t>(n);
+    }
+    m_empty = true;
+    return got;
+  }
+
+private:
+  // Writes the next left bytes of the pipe to out, through a buffer from
+  // BufferPool.
+  bool drainTo(int out, size_t left) {
+    BufferPool::Lease lease = BufferPool::shared().acquire(left);
+    char *buffer = lease.data();
+    while (left > 0) {
+      ssize_t n = ::read(m_fds[0], buffer, std::min(left, lease.size()));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        errno = n == 0 ? EIO : errno;
+        return false;
+      }
+      for (ssize_t written = 0; written < n;) {
+        ssize_t w = ::write(out, buffer + written, n - written);
+        if (w < 0 && errno == EINTR) {
+          continue;
+        }
+        if (w < 0) {
+          return false;
+        }
+        written += w;
+      }
+      left -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  int m_fds[2];
+  size_t m_capacity = 0;
+  bool m_empty = true;
+};
+#endif
+} // namespace
+
+CopyEngine::Result CopyEngine::copy(int in, int out,
+                                    std::uintmax_t expectedSize,
+                                    const Progress &onProgress,
+                                    std::error_code &ec) const {
+  Result result;
+#ifdef _WIN32
+  (void)in;
+  (void)out;
+  (void)expectedSize;
+  (void)onProgress;
+  ec = std::make_error_code(std::errc::function_not_supported);
+  return result;
+#else
+  if (m_options.reflink != Reflink::Never) {
+    std::error_code cloneError;
+    if (clone(in, out, result.bytes, cloneError)) {
+      result.method = Method::Reflink;
+      if (m_options.hash) {
+        std::uintmax_t hashed = 0;
+        result.hash = ContentHash::hashDescriptor(
+            in, hashed, [](long long) {}, ec);
+      }
+      onProgress(static_cast<long long>(result.bytes));
+      return result;
+    }
+    if (m_options.reflink == Reflink::Always) {
+      ec = cloneError;
+      result.method = Method::Reflink;
+      return result;
+    }
+  }
+
+  bool atStart =
+      ::lseek(in, 0, SEEK_CUR) == 0 && ::lseek(out, 0, SEEK_CUR) == 0;
+  adviseSequential(in);
+  if (atStart && isSparse(in)) {
+    if (copySparse(in, out, expectedSize, result, onProgress, ec)) {
+      return result;
+    }
+    // No extent list here; copy it whole.
+    ::lseek(in, 0, SEEK_SET);
+    ::lseek(out, 0, SEEK_SET);
+  }
+
+  // Reserving the whole file up front lets the filesystem lay it out in a
+  // few extents instead of growing it a chunk at a time.
+  bool preallocated = m_options.preallocate && atStart &&
+                      expectedSize >= kPreallocateThreshold &&
+                      preallocate(out, expectedSize);
+  result = copyData(in, out, expectedSize, atStart, onProgress, ec);
+  if (preallocated && result.bytes < expectedSize) {
+    // The file shrank since the scan; give back the blocks past its end.
+    if (::ftruncate(out, static_cast<off_t>(result.bytes)) != 0 && !ec) {
+      ec = lastError();
+    }
+  }
+  return result;
+#endif
+}
+
+CopyEngine::Result CopyEngine::copyData(int in, int out,
+                                        std::uintmax_t expectedSize,
+                                        bool atStart,
+                                        const Progress &onProgress,
+                                        std::error_code &ec) const {
+  Result result;
+#ifdef _WIN32
+  (void)in;
+  (void)out;
+  (void)expectedSize;
+  (void)atStart;
+  (void)onProgress;
+  ec = std::make_error_code(std::errc::function_not_supported);
+  return result;
+#else
+  bool direct = atStart && useDirectIo(in, out, expectedSize);
+  ContentHash hash;
+  ContentHash *hasher = m_options.hash ? &hash : nullptr;
+
+  if (m_options.pool != nullptr && hasher == nullptr &&
+      expectedSize >= m_options.parallelThreshold && atStart) {
+    result.bytes = copyRanges(in, out, expectedSize, onProgress, ec);
+    if (ec) {
+      result.method = direct ? Method::Direct : Method::ReadWrite;
+      return result;
+    }
+    // The tiers below copy whatever was appended since the scan.
+    ::lseek(in, static_cast<off_t>(result.bytes), SEEK_SET);
+    ::lseek(out, static_cast<off_t>(result.bytes), SEEK_SET);
+  }
+
+  if (direct) {
+    // The kernel tiers would go through the cache; carry on with
+    // pread/pwrite to the real end of file.
+    result.method = Method::Direct;
+    std::uintmax_t left =
+        expectedSize > result.bytes ? expectedSize - result.bytes : 0;
+    // Nothing in the cache to drop.
+    copyRange(in, out, result.bytes, std::numeric_limits<off_t>::max(), left,
+              m_options.chunkSize, 0, hasher,
+              [&](size_t bytes) {
+                result.bytes += bytes;
+                onProgress(static_cast<long long>(result.bytes));
+                return true;
+              },
+              ec);
+    if (hasher != nullptr) {
+      result.hash = hasher->digest();
+    }
+    onProgress(static_cast<long long>(result.bytes)); // Final update
+    return result;
+  }
+
+  // The tiers below move both file offsets along with the bytes copied.
+  const std::uintmax_t copiedBefore = result.bytes;
+  off_t inOffset = ::lseek(in, 0, SEEK_CUR);
+  off_t outOffset = ::lseek(out, 0, SEEK_CUR);
+  DropBehind dropBehind(in, static_cast<std::uintmax_t>(inOffset), out,
+                        static_cast<std::uintmax_t>(outOffset),
+                        inOffset < 0 || outOffset < 0
+                            ? 0
+                            : m_options.dropBehindWindow);
+
+  // The kernel tiers would keep the bytes from the hash.
+  Method method =
+      hasher != nullptr ? Method::ReadWrite : m_options.firstMethod;
+#ifdef __linux__
+  // Kernel-side tiers. All advance the file offsets of in and out, so the
+  // next tier simply carries on.
+  if (method == Method::Reflink) {
+    method = Method::CopyFileRange;
+  }
+  TierMemory::Filesystems filesystems;
+  bool knownFilesystems =
+      method != Method::ReadWrite &&
+      TierMemory::filesystemsOf(in, out, filesystems);
+  if (knownFilesystems) {
+    // Skip what already failed between these two filesystems.
+    method = std::max(method, TierMemory::shared().firstTier(filesystems));
+  }
+  // Created on first use, so the other tiers never pay for it.
+  thread_local std::unique_ptr<SplicePipe> pipe;
+  while (method != Method::ReadWrite) {
+    int refusal = 0;
+    ssize_t copied = -1;
+    if (method == Method::CopyFileRange) {
+      copied =
+          ::copy_file_range(in, nullptr, out, nullptr, m_options.chunkSize, 0);
+    } else if (method == Method::Sendfile) {
+      copied = ::sendfile(out, in, nullptr, m_options.chunkSize);
+    } else {
+      if (!pipe || !pipe->valid()) {
+        pipe = std::make_unique<SplicePipe>();
+      }
+      if (!pipe->valid()) {
+        // Out of descriptors (EMFILE, ENFILE): says nothing about the
+        // filesystems, so only this file goes without splice.
+        method = Method::ReadWrite;
+        continue;
+      }
+      copied = pipe->transfer(in, out, m_options.chunkSize, refusal);
+      if (copied < 0 && !pipe->empty()) {
+        // Those bytes must not end up in the next file.
+        int error = errno;
+        pipe.reset();
+        errno = error;
+      }
+    }
+    if (copied < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (tierUnsupported(errno)) {
+        if (knownFilesystems && filesystemRefused(errno)) {
+          TierMemory::shared().refused(filesystems, method);
+        }
+        method = nextTier(method);
+        continue;
+      }
+      ec = lastError();
+      result.method = method;
+      return result;
+    }
+    if (copied == 0) {
+      if (result.bytes >= expectedSize) {
+        result.method = method;
+        onProgress(static_cast<long long>(result.bytes)); // Final update
+        return result;
+      }
+      // Some filesystems (procfs, sysfs, some FUSE mounts) report 0 instead
+      // of refusing; read/write finds the real end of file.
+      method = Method::ReadWrite;
+      break;
+    }
+    result.bytes += static_cast<std::uintmax_t>(copied);
+    dropBehind.advance(result.bytes - copiedBefore);
+    onProgress(static_cast<long long>(result.bytes));
+    if (refusal != 0) {
+      // The target takes no spliced pages; the rest goes through read/write.
+      if (knownFilesystems && filesystemRefused(refusal)) {
+        TierMemory::shared().refused(filesystems, method);
+      }
+      method = Method::ReadWrite;
+    }
+  }
+#endif
+
+  result.method = Method::ReadWrite;
+  std::uintmax_t left =
+      expectedSize > result.bytes ? expectedSize - result.bytes : 0;
+  BufferPool::Lease buffer = borrowBuffer(left, m_options.chunkSize);
+  ChunkSizer sizer(BufferPool::shared(), left, buffer.size());
+  while (true) {
+    auto started = std::chrono::steady_clock::now();
+    ssize_t bytesRead = ::read(in, buffer.data(), sizer.size());
+    if (bytesRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytesRead < 0) {
+      ec = lastError();
+      return result;
+    }
+    if (bytesRead == 0) {
+      break;
+    }
+    for (ssize_t written = 0; written < bytesRead;) {
+      ssize_t n = ::write(out, buffer.data() + written, bytesRead - written);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        ec = lastError();
+        return result;
+      }
+      written += n;
+    }
+    if (hasher != nullptr) {
+      hasher->update(buffer.data(), static_cast<size_t>(bytesRead));
+    }
+    sizer.record(static_cast<size_t>(bytesRead),
+                 std::chrono::steady_clock::now() - started);
+    result.bytes += static_cast<std::uintmax_t>(bytesRead);
+    dropBehind.advance(result.bytes - copiedBefore);
+    onProgress(static_cast<long long>(result.bytes));
+  }
+  if (hasher != nullptr) {
+    result.hash = hasher->digest();
+  }
+  onProgress(static_cast<long long>(result.bytes)); // Final update
+  return result;
+#endif
+}
+
+bool CopyEngine::copySparse(int in, int out, std::uintmax_t expectedSize,
+                            Result &result, const Progress &onProgress,
+                            std::error_code &ec) const {
+#ifdef SEEK_DATA
+  bool direct = useDirectIo(in, out, expectedSize);
+  ContentHash hash;
+  ContentHash *hasher = m_options.hash ? &hash : nullptr;
+  result = Result();
+  result.method = direct ? Method::Direct : Method::ReadWrite;
+  auto onChunk = [&](size_t bytes) {
+    result.bytes += bytes;
+    onProgress(static_cast<long long>(result.bytes));
+    return true;
+  };
+  while (true) {
+    off_t data = ::lseek(in, static_cast<off_t>(result.bytes), SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+      // Only a hole is left.
+      break;
+    }
+    if (data < 0 && result.bytes == 0 &&
+        (errno == EINVAL || errno == ENOTSUP || errno == EOPNOTSUPP)) {
+      return false;
+    }
+    off_t hole = data < 0 ? data : ::lseek(in, data, SEEK_HOLE);
+    if (hole < 0) {
+      ec = lastError();
+      return true;
+    }
+    // A hole advances the bar like copied bytes; out keeps it as a hole
+    // because nothing is written there.
+    if (hasher != nullptr) {
+      hashZeros(*hasher, static_cast<std::uintmax_t>(data) - result.bytes);
+    }
+    result.bytes = static_cast<std::uintmax_t>(data);
+    std::uintmax_t end = static_cast<std::uintmax_t>(hole);
+    if (!copyRange(in, out, result.bytes, end, end - result.bytes,
+                   m_options.chunkSize, direct ? 0 : m_options.dropBehindWindow,
+                   hasher, onChunk, ec)) {
+      return true;
+    }
+    if (result.bytes < end) {
+      // The file was cut short while copying.
+      break;
+    }
+  }
+
+  // Recreate a hole at the end, or the whole file if it has no data.
+  struct stat st;
+  if (::fstat(in, &st) != 0) {
+    ec = lastError();
+    return true;
+  }
+  if (hasher != nullptr &&
+      static_cast<std::uintmax_t>(st.st_size) > result.bytes) {
+    hashZeros(*hasher,
+              static_cast<std::uintmax_t>(st.st_size) - result.bytes);
+  }
+  result.bytes =
+      std::max(result.bytes, static_cast<std::uintmax_t>(st.st_size));
+  if (hasher != nullptr) {
+    result.hash = hasher->digest();
+  }
+  if (::ftruncate(out, static_cast<off_t>(result.bytes)) != 0) {
+    ec = lastError();
+  }
+  onProgress(static_cast<long long>(result.bytes)); // Final update
+  return true;
+#else
+  (void)in;
+  (void)out;
+  (void)expectedSize;
+  (void)result;
+  (void)onProgress;
+  (void)ec;
+  return false;
+#endif
+}
+
+bool CopyEngine::useDirectIo(int in, int out,
+                             std::uintmax_t expectedSize) const {
+  if (!m_options.directIo || expectedSize < m_options.directIoThreshold) {
+    return false;
+  }
+  if (enterDirectMode(in) && enterDirectMode(out)) {
+    return true;
+  }
+  // The filesystem of one side refuses it; copy through the cache.
+#ifndef _WIN32
+  leaveDirectMode(in);
+#endif
+  return false;
+}
+
+std::uintmax_t CopyEngine::copyRanges(int in, int out, std::uintmax_t size,
+                                      const Progress &onProgress,
+                                      std::error_code &ec) const {
+#ifndef _WIN32
+  std::mutex mutex;
+  std::uintmax_t copied = 0;
+  std::error_code firstError;
+  std::atomic<bool> stop{false};
+  auto fail = [&](std::error_code error) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!firstError) {
+      firstError = error;
+    }
+    stop = true;
+  };
+
+  ThreadPool::TaskGroup group(*m_options.pool);
+  const std::uintmax_t rangeSize = std::max<std::uintmax_t>(
+      m_options.rangeSize, BufferPool::kMinBufferSize);
+  for (std::uintmax_t start = 0; start < size; start += rangeSize) {
+    std::uintmax_t end = std::min(size, start + rangeSize);
+    group.submit([&, start, end] {
+      if (stop) {
+        return;
+      }
+      auto onChunk = [&](size_t bytes) {
+        // Under the lock, so the combined count only ever grows.
+        std::lock_guard<std::mutex> lock(mutex);
+        copied += bytes;
+        onProgress(static_cast<long long>(copied));
+        return !stop;
+      };
+      // Ends early in a file that shrank; later ranges find nothing either.
+      std::error_code error;
+      if (!copyRange(in, out, start, end, end - start, m_options.chunkSize,
+                     m_options.dropBehindWindow, nullptr, onChunk, error)) {
+        fail(error);
+      }
+    });
+  }
+  group.wait();
+  ec = firstError;
+  return copied;
+#else
+  (void)in;
+  (void)out;
+  (void)size;
+  (void)onProgress;
+  ec = std::make_error_code(std::errc::function_not_supported);
+  return 0;
+#endif
+}
+
+bool CopyEngine::isSparse(int fd) {
+#ifdef _WIN32
+  (void)fd;
+  return false;
+#else
+  // Allocated blocks are counted in 512-byte units.
+  struct stat st;
+  return ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+         static_cast<std::uintmax_t>(st.st_blocks) * 512 <
+             static_cast<std::uintmax_t>(st.st_size);
+#endif
+}
+
+bool CopyEngine::preallocate(int fd, std::uintmax_t size) {
+#if defined(__linux__)
+  // KEEP_SIZE: the file only grows as data arrives, so a copy cut short
+  // never shows a tail of zeros.
+  return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) ==
+         0;
+#elif defined(F_PREALLOCATE)
+  fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0,
+                    static_cast<off_t>(size), 0};
+  if (::fcntl(fd, F_PREALLOCATE, &store) == 0) {
+    return true;
+  }
+  store.fst_flags = F_ALLOCATEALL;
+  return ::fcntl(fd, F_PREALLOCATE, &store) == 0;
+#else
+  // posix_fallocate would write zeros where the filesystem cannot
+  // reserve, doubling the writes.
+  (void)fd;
+  (void)size;
+  return false;
+#endif
+}
+
+void CopyEngine::adviseSequential(int fd) {
+#ifdef POSIX_FADV_SEQUENTIAL
+  // Doubles the readahead window on Linux.
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+  (void)fd;
+#endif
+}
+
+bool CopyEngine::enterDirectMode(int fd) {
+#if defined(O_DIRECT)
+  int flags = ::fcntl(fd, F_GETFL);
+  return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+#elif defined(F_NOCACHE)
+  return ::fcntl(fd, F_NOCACHE, 1) == 0;
+#else
+  (void)fd;
+  return false;
+#endif
+}
+
+bool CopyEngine::clone(int in, int out, std::uintmax_t &bytes,
+                       std::error_code &ec) {
+#ifdef __linux__
+  // FICLONE always clones the whole file.
+  struct stat st;
+  if (::lseek(in, 0, SEEK_CUR) != 0 || ::lseek(out, 0, SEEK_CUR) != 0) {
+    ec = std::make_error_code(std::errc::invalid_argument);
+    return false;
+  }
+  if (::ioctl(out, FICLONE, in) != 0 || ::fstat(in, &st) != 0) {
+    ec = lastError();
+    return false;
+  }
+  // Leave the offsets where a copy would have left them.
+  ::lseek(in, st.st_size, SEEK_SET);
+  ::lseek(out, st.st_size, SEEK_SET);
+  bytes = static_cast<std::uintmax_t>(st.st_size);
+  return true;
+#else
+  (void)in;
+  (void)out;
+  (void)bytes;
+  ec = std::make_error_code(std::errc::operation_not_supported);
+  return false;
+#endif
+}
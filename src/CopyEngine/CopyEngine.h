@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <system_error>
+
+class ThreadPool;
+
+// Copies file contents between two open descriptors using the cheapest
+// mechanism the kernel offers.
+//
+// Tiers are tried in order, each continuing from where the previous one
+// stopped:
+//   reflink          FICLONE: the target shares the source's extents
+//                    (btrfs, XFS); instant and takes no extra space. Only
+//                    when enabled in Options.
+//   copy_file_range  no user-space copy; may even be offloaded by the
+//                    filesystem or the server (NFS, SMB)
+//   sendfile         no user-space copy; works between most filesystems
+//   splice           source to a pipe to the target, moving page
+//                    references rather than bytes; for FUSE and older NFS
+//                    mounts that refuse the two above
+//   read/write       always works, with a buffer from BufferPool
+// A tier that the kernel or filesystem refuses is skipped for the rest of
+// the file, and for later files between the same two filesystems, so a
+// mount that refuses copy_file_range costs one failed call per run rather
+// than one per file.
+//
+// Files above parallelThreshold are first split into ranges that the
+// workers of a pool copy at the same time with pread/pwrite, so one
+// worker's read overlaps another's write; the tiers then only pick up
+// whatever the file grew by since the scan. Other POSIX systems only get
+// read/write; Windows has no descriptors and keeps MergeManager's stream
+// copy.
+//
+// Sparse sources (fewer blocks allocated than their size says) are copied
+// extent by extent: SEEK_DATA/SEEK_HOLE find the data, only that is copied,
+// and the holes stay holes in the target. Progress still counts the holes,
+// so it reaches the file's logical size.
+//
+// The target is reserved at its final size before the first write, so it
+// ends up in a few large extents, and the pages of both files are dropped
+// from the page cache a window behind the copy.
+//
+// With directIo, files of at least directIoThreshold bypass the page cache
+// instead: both descriptors are switched to O_DIRECT (F_NOCACHE on macOS)
+// and copied with pread/pwrite through the pool's page-aligned buffers, so
+// a large copy neither evicts everything else from memory nor leaves
+// gigabytes of dirty pages behind. Where a filesystem refuses O_DIRECT the
+// file is copied through the cache as usual; an unaligned tail is written
+// after dropping O_DIRECT for the rest of the file.
+//
+// With hash, the bytes are run through ContentHash as they pass through
+// the buffer, for a manifest that can be checked later without reading the
+// source again. The kernel tiers and the parallel ranges never show the
+// bytes to the process, so a hashed copy goes through read/write in order;
+// a reflink is hashed by reading the source once it is cloned.
+class CopyEngine {
+public:
+  enum class Method {
+    Reflink,
+    CopyFileRange,
+    Sendfile,
+    Splice,
+    ReadWrite,
+    Direct
+  };
+
+  enum class Reflink {
+    // Try a reflink, copy normally if the filesystem cannot.
+    Auto,
+    // Reflink or fail; never duplicate the data.
+    Always,
+    Never,
+  };
+
+  // Most bytes moved per syscall; progress is reported after each chunk.
+  // The read/write tier borrows its buffer from BufferPool and lets
+  // ChunkSizer pick the size below this.
+  static constexpr size_t kDefaultChunkSize = 8 * 1024 * 1024;
+  // Range one worker copies in a parallel copy.
+  static constexpr std::uintmax_t kDefaultRangeSize = 64 * 1024 * 1024;
+  // Smaller files are left to the filesystem's delayed allocation.
+  static constexpr std::uintmax_t kPreallocateThreshold = 1024 * 1024;
+  static constexpr std::uintmax_t kDefaultDropBehindWindow = 32 * 1024 * 1024;
+  // What the splice tier asks the pipe to hold (F_SETPIPE_SZ), so one
+  // round trip moves this much instead of the default 64 KiB. Unprivileged
+  // processes may go up to /proc/sys/fs/pipe-max-size, 1 MiB by default.
+  static constexpr size_t kPipeSize = 1024 * 1024;
+
+  struct Options {
+    Reflink reflink = Reflink::Never;
+    // Skips the copying tiers before this one.
+    Method firstMethod = Method::CopyFileRange;
+    size_t chunkSize = kDefaultChunkSize;
+    // Workers for parallel copies; nullptr copies sequentially.
+    ThreadPool *pool = nullptr;
+    std::uintmax_t parallelThreshold = 1024ull * 1024 * 1024;
+    std::uintmax_t rangeSize = kDefaultRangeSize;
+    // Bypass the page cache for files of at least directIoThreshold; below
+    // it, the per-request cost of O_DIRECT outweighs what it saves.
+    bool directIo = false;
+    std::uintmax_t directIoThreshold = 4 * 1024 * 1024;
+    // Reserve the target's final size before writing (fallocate).
+    bool preallocate = true;
+    // Drop the pages of both files from the page cache this far behind the
+    // copy; 0 keeps them.
+    std::uintmax_t dropBehindWindow = kDefaultDropBehindWindow;
+    // Hash the bytes copied into Result::hash.
+    bool hash = false;
+  };
+
+  struct Result {
+    // The last tier used.
+    Method method = Method::ReadWrite;
+    std::uintmax_t bytes = 0;
+    // ContentHash of the bytes copied, with Options::hash; holes count as
+    // zeros.
+    std::uint64_t hash = 0;
+  };
+
+  using Progress = std::function<void(long long bytesCopied)>;
+
+  CopyEngine() = default;
+  explicit CopyEngine(Options options) : m_options(options) {}
+
+  // Copies from the current offset of in to the end of file into out. A
+  // reflink always clones the whole file, so it is only attempted while
+  // both files are at offset 0.
+  // expectedSize is what the scan saw; the copy still runs to the real end
+  // of file. On failure ec is set and the result says how far it got.
+  Result copy(int in, int out, std::uintmax_t expectedSize,
+              const Progress &onProgress, std::error_code &ec) const;
+
+  // Makes out share in's data (FICLONE) and leaves both offsets at the end.
+  // Both files must still be at offset 0. Returns false with ec set when
+  // the filesystem cannot do it.
+  static bool clone(int in, int out, std::uintmax_t &bytes,
+                    std::error_code &ec);
+
+  // Whether fd has fewer blocks allocated than its size needs: holes (or
+  // compression).
+  static bool isSparse(int fd);
+
+  // Reserves size bytes for fd without changing its size. Returns false
+  // where the filesystem cannot.
+  static bool preallocate(int fd, std::uintmax_t size);
+
+  // Tells the kernel fd is read front to back, for a larger readahead.
+  static void adviseSequential(int fd);
+
+  // Switches fd to uncached I/O. Returns false where the filesystem or
+  // the system does not offer it.
+  static bool enterDirectMode(int fd);
+
+private:
+  // copy() past the reflink attempt. atStart: both files are at offset 0.
+  Result copyData(int in, int out, std::uintmax_t expectedSize, bool atStart,
+                  const Progress &onProgress, std::error_code &ec) const;
+
+  // Copies the data extents of in to the same offsets of out, leaving the
+  // holes unwritten. Both files must be at offset 0. Returns false, having
+  // copied nothing, when the filesystem cannot list the extents.
+  bool copySparse(int in, int out, std::uintmax_t expectedSize,
+                  Result &result, const Progress &onProgress,
+                  std::error_code &ec) const;
+
+  // Switches both files to direct I/O if enabled for a file of this size
+  // and both filesystems allow it.
+  bool useDirectIo(int in, int out, std::uintmax_t expectedSize) const;
+
+  // Copies [0, size) in ranges on the pool. Returns the bytes copied; stops
+  // early at the end of a file that shrank.
+  std::uintmax_t copyRanges(int in, int out, std::uintmax_t size,
+                            const Progress &onProgress,
+                            std::error_code &ec) const;
+
+  Options m_options;
+};
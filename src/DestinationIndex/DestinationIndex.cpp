@@ -0,0 +1,54 @@
+#include "DestinationIndex.h"
+#include <algorithm>
+#include <cctype>
+
+bool DestinationIndex::claim(const fs::path &directory,
+                             const fs::path &fileName) {
+  return folder(directory).insert(key(fileName)).second;
+}
+
+fs::path DestinationIndex::claimUnique(const fs::path &directory,
+                                       const fs::path &fileName) {
+  Folder &names = folder(directory);
+  if (names.insert(key(fileName)).second) {
+    return directory / fileName;
+  }
+
+  const std::string stem = fileName.stem().string();
+  const std::string extension = fileName.extension().string();
+  int counter = 1;
+  while (true) {
+    fs::path candidate = stem + "_" + std::to_string(counter++) + extension;
+    if (names.insert(key(candidate)).second) {
+      return directory / candidate;
+    }
+  }
+}
+
+DestinationIndex::Folder &DestinationIndex::folder(const fs::path &directory) {
+  auto it = m_folders.find(directory.native());
+  if (it != m_folders.end()) {
+    return it->second;
+  }
+
+  Folder &names = m_folders[directory.native()];
+  // A folder we just created is empty; only pre-existing folders need
+  // listing.
+  if (!fs::create_directories(directory)) {
+    for (const auto &entry : fs::directory_iterator(directory)) {
+      names.insert(key(entry.path().filename()));
+    }
+  }
+  return names;
+}
+
+std::string DestinationIndex::key(const fs::path &name) {
+  std::string result = name.string();
+#if defined(_WIN32) || defined(__APPLE__)
+  // The default filesystems here are case-insensitive, so 'REPORT.PDF' and
+  // 'report.pdf' must count as the same name.
+  std::transform(result.begin(), result.end(), result.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+#endif
+  return result;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+// Remembers which names are taken in each destination folder.
+//
+// A folder is created and listed once, the first time a file is planned
+// into it. After that, duplicate checks and renaming are answered from
+// memory instead of one fs::exists per candidate name.
+class DestinationIndex {
+public:
+  // Claims directory/fileName if that name is free and returns true.
+  // Returns false when the name already exists on disk or was claimed
+  // earlier in this run.
+  bool claim(const fs::path &directory, const fs::path &fileName);
+
+  // Claims and returns the first free path among directory/fileName,
+  // directory/stem_1.ext, directory/stem_2.ext, ...
+  fs::path claimUnique(const fs::path &directory, const fs::path &fileName);
+
+private:
+  using Folder = std::unordered_set<std::string>;
+
+  Folder &folder(const fs::path &directory);
+  static std::string key(const fs::path &name);
+
+  std::unordered_map<fs::path::string_type, Folder> m_folders;
+};
@@ -0,0 +1,236 @@
+#include "DeviceScheduler.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+#ifdef __linux__
+// The sysfs folder of block device id.
+std::string blockDevicePath(dev_t id) {
+  return "/sys/dev/block/" + std::to_string(major(id)) + ":" +
+         std::to_string(minor(id));
+}
+
+// The rotational flag of the block device whose sysfs folder is path, or
+// -1 when it has none. A partition has no queue of its own and shares its
+// disk's, one level up.
+int rotationalFlag(const std::string &path) {
+  for (const char *queue : {"/queue/rotational", "/../queue/rotational"}) {
+    std::ifstream flag(path + queue);
+    int value = 0;
+    if (flag >> value) {
+      return value != 0 ? 1 : 0;
+    }
+  }
+  return -1;
+}
+
+// The block device the filesystem with anonymous id was mounted from,
+// from /proc/self/mountinfo; 0 when its source is not a block device.
+dev_t mountedFrom(dev_t id) {
+  std::string wanted =
+      std::to_string(major(id)) + ":" + std::to_string(minor(id));
+  std::ifstream mountinfo("/proc/self/mountinfo");
+  std::string line;
+  while (std::getline(mountinfo, line)) {
+    std::istringstream fields(line);
+    std::string mountId, parentId, majorMinor;
+    fields >> mountId >> parentId >> majorMinor;
+    size_t separator = line.find(" - ");
+    if (majorMinor != wanted || separator == std::string::npos) {
+      continue;
+    }
+    // After the optional fields: filesystem type, then source.
+    std::istringstream tail(line.substr(separator + 3));
+    std::string type, source;
+    tail >> type >> source;
+    struct stat st;
+    if (::stat(source.c_str(), &st) == 0 && S_ISBLK(st.st_mode)) {
+      return st.st_rdev;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+// When the block device at path is part of a btrfs filesystem, whether any
+// of that filesystem's devices spins: one slow member holds up the rest.
+std::optional<bool> btrfsMembersRotational(const std::string &path) {
+  std::error_code ec;
+  fs::path name = fs::canonical(path, ec).filename();
+  if (ec) {
+    return std::nullopt;
+  }
+  for (const auto &filesystem : fs::directory_iterator("/sys/fs/btrfs", ec)) {
+    fs::path devices = filesystem.path() / "devices";
+    if (!fs::exists(devices / name, ec)) {
+      continue;
+    }
+    bool rotational = false;
+    for (const auto &member : fs::directory_iterator(devices, ec)) {
+      rotational = rotational || rotationalFlag(member.path().string()) == 1;
+    }
+    return rotational;
+  }
+  return std::nullopt;
+}
+#endif
+} // namespace
+
+DeviceScheduler::DeviceScheduler(ThreadPool &pool, size_t maxQueued)
+    : m_maxQueued(std::max<size_t>(1, maxQueued)), m_group(pool) {}
+
+DeviceScheduler::~DeviceScheduler() {
+  // Queued tasks are dropped; running ones finish in m_group's destructor.
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto &device : m_devices) {
+    m_queued -= device.second.queue.size();
+    device.second.queue.clear();
+  }
+}
+
+bool DeviceScheduler::isRotational(std::uint64_t device) {
+#ifdef __linux__
+  dev_t id = static_cast<dev_t>(device);
+  if (major(id) != 0) {
+    return rotationalFlag(blockDevicePath(id)) == 1;
+  }
+  // Anonymous: btrfs, and filesystems backed by no disk (tmpfs, NFS,
+  // FUSE, overlayfs). btrfs still names the disk it was mounted from.
+  dev_t disk = mountedFrom(id);
+  if (disk == 0) {
+    return false;
+  }
+  std::string path = blockDevicePath(disk);
+  if (std::optional<bool> members = btrfsMembersRotational(path)) {
+    return *members;
+  }
+  return rotationalFlag(path) == 1;
+#else
+  (void)device;
+  return false;
+#endif
+}
+
+bool DeviceScheduler::rotational(std::uint64_t device) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return deviceFor(device).rotational;
+}
+
+void DeviceScheduler::setLimit(std::uint64_t device, unsigned limit) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  deviceFor(device).limit = std::max(1u, limit);
+}
+
+void DeviceScheduler::submit(std::uint64_t source, std::uint64_t destination,
+                             Task task) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_roomFreed.wait(lock, [this] { return m_queued < m_maxQueued; });
+  deviceFor(destination);
+  deviceFor(source).queue.push_back(Job{destination, std::move(task)});
+  ++m_queued;
+  dispatch();
+}
+
+void DeviceScheduler::wait() {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this] { return m_queued == 0 && m_running == 0; });
+  }
+  m_group.wait();
+}
+
+unsigned DeviceScheduler::peakConcurrency(std::uint64_t device) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto found = m_devices.find(device);
+  return found == m_devices.end() ? 0 : found->second.peak;
+}
+
+DeviceScheduler::Device &DeviceScheduler::deviceFor(std::uint64_t device) {
+  auto found = m_devices.find(device);
+  if (found == m_devices.end()) {
+    // Reads one small sysfs file, once per device.
+    Device state;
+    state.rotational = isRotational(device);
+    state.limit = state.rotational ? kRotationalLimit : kSolidStateLimit;
+    found = m_devices.emplace(device, std::move(state)).first;
+  }
+  return found->second;
+}
+
+void DeviceScheduler::dispatch() {
+  if (m_queued == 0 || m_devices.empty()) {
+    return;
+  }
+  bool started = true;
+  while (started && m_queued > 0) {
+    started = false;
+    // One task per queue and round, beginning after the queue that went
+    // first last time.
+    auto first = m_devices.upper_bound(m_nextSource);
+    for (size_t i = 0; i < m_devices.size(); ++i, ++first) {
+      if (first == m_devices.end()) {
+        first = m_devices.begin();
+      }
+      Device &source = first->second;
+      if (source.queue.empty() || source.active >= source.limit) {
+        continue;
+      }
+      std::uint64_t destinationId = source.queue.front().destination;
+      Device &destination = m_devices.at(destinationId);
+      // Both ends on one device count once.
+      if (&destination != &source &&
+          destination.active >= destination.limit) {
+        continue;
+      }
+
+      Job job = std::move(source.queue.front());
+      source.queue.pop_front();
+      --m_queued;
+      ++m_running;
+      source.peak = std::max(source.peak, ++source.active);
+      if (&destination != &source) {
+        destination.peak = std::max(destination.peak, ++destination.active);
+      }
+      m_nextSource = first->first;
+      started = true;
+
+      std::uint64_t sourceId = first->first;
+      m_group.submit([this, sourceId, job = std::move(job)] {
+        // Frees the devices even when the task throws.
+        struct Release {
+          DeviceScheduler &scheduler;
+          std::uint64_t source;
+          std::uint64_t destination;
+          ~Release() { scheduler.finished(source, destination); }
+        } release{*this, sourceId, job.destination};
+        job.task();
+      });
+    }
+  }
+  m_roomFreed.notify_all();
+}
+
+void DeviceScheduler::finished(std::uint64_t source,
+                               std::uint64_t destination) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  --m_devices.at(source).active;
+  if (destination != source) {
+    --m_devices.at(destination).active;
+  }
+  --m_running;
+  dispatch();
+  if (m_queued == 0 && m_running == 0) {
+    m_idle.notify_all();
+  }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "src/ThreadPool/ThreadPool.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+
+// Runs transfers on a thread pool with a queue per source device and a cap
+// on how many transfers use each device at once.
+//
+// Every task reads from one device and writes to another (both st_dev). A
+// spinning disk gets a cap of kRotationalLimit, so it streams one file at a
+// time instead of seeking between several; SSDs and everything else (network
+// and virtual filesystems included) get kSolidStateLimit. A task starts once
+// both of its devices have room. The source queues are served in turn, so
+// while one disk works through its files the others keep going with theirs
+// rather than waiting behind them in scan order. Within a queue tasks start
+// in the order they were submitted.
+class DeviceScheduler {
+public:
+  using Task = std::function<void()>;
+
+  static constexpr unsigned kRotationalLimit = 1;
+  static constexpr unsigned kSolidStateLimit = 8;
+
+  // Tasks run on pool; submit() blocks while maxQueued tasks wait to start.
+  DeviceScheduler(ThreadPool &pool, size_t maxQueued);
+  ~DeviceScheduler();
+
+  DeviceScheduler(const DeviceScheduler &) = delete;
+  DeviceScheduler &operator=(const DeviceScheduler &) = delete;
+
+  // Whether device is a spinning disk, from the rotational flag of its
+  // block device in sysfs (the whole disk's, for a partition). btrfs
+  // reports an anonymous device; it is traced through mountinfo to the
+  // disk it was mounted from, and counts as spinning when any disk of the
+  // filesystem does. False where that is unknown: other systems, network
+  // and virtual filesystems.
+  static bool isRotational(std::uint64_t device);
+
+  // Whether device was found to be a spinning disk; detects it on first use.
+  bool rotational(std::uint64_t device);
+
+  // Overrides the cap of device; call before its first task.
+  void setLimit(std::uint64_t device, unsigned limit);
+
+  // Queues task, which reads from source and writes to destination.
+  void submit(std::uint64_t source, std::uint64_t destination, Task task);
+
+  // Waits for every task submitted so far and rethrows the first exception
+  // one of them threw.
+  void wait();
+
+  // Most tasks that used device at the same time so far.
+  unsigned peakConcurrency(std::uint64_t device) const;
+
+private:
+  struct Job {
+    std::uint64_t destination;
+    Task task;
+  };
+
+  struct Device {
+    bool rotational = false;
+    unsigned limit = kSolidStateLimit;
+    unsigned active = 0;
+    unsigned peak = 0;
+    // Tasks reading from this device that have not started.
+    std::deque<Job> queue;
+  };
+
+  // The state of device, detected on first use. Called with the lock held.
+  Device &deviceFor(std::uint64_t device);
+  // Starts every queued task whose devices have room, taking the queues in
+  // turn. Called with the lock held.
+  void dispatch();
+  void finished(std::uint64_t source, std::uint64_t destination);
+
+  size_t m_maxQueued;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_roomFreed;
+  std::condition_variable m_idle;
+  std::map<std::uint64_t, Device> m_devices;
+  // Source queue dispatch() looks at first, so no device is always last.
+  std::uint64_t m_nextSource = 0;
+  size_t m_queued = 0;
+  size_t m_running = 0;
+  // Last: its destructor waits for the tasks that use the above.
+  ThreadPool::TaskGroup m_group;
+};
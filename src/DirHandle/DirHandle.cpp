@@ -0,0 +1,213 @@
+#include "DirHandle.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+
+namespace {
+#ifndef _WIN32
+std::error_code lastError() {
+  return std::error_code(errno, std::generic_category());
+}
+
+bool flush(int fd) {
+#ifdef F_FULLFSYNC
+  // fsync on macOS leaves the data in the drive's cache.
+  if (::fcntl(fd, F_FULLFSYNC) == 0) {
+    return true;
+  }
+#endif
+  return ::fsync(fd) == 0;
+}
+#endif
+} // namespace
+
+DirHandle::~DirHandle() {
+#ifndef _WIN32
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+#endif
+}
+
+std::shared_ptr<DirHandle> DirHandle::open(const fs::path &directory) {
+#ifndef _WIN32
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw fs::filesystem_error("cannot open directory", directory,
+                               lastError());
+  }
+  return std::shared_ptr<DirHandle>(new DirHandle(fd, directory));
+#else
+  if (!fs::is_directory(directory)) {
+    throw fs::filesystem_error(
+        "cannot open directory", directory,
+        std::make_error_code(std::errc::not_a_directory));
+  }
+  return std::shared_ptr<DirHandle>(new DirHandle(-1, directory));
+#endif
+}
+
+std::shared_ptr<DirHandle> DirHandle::openChild(const std::string &name,
+                                                bool create) const {
+  fs::path childPath = m_path / name;
+#ifndef _WIN32
+  if (create && ::mkdirat(m_fd, name.c_str(), 0777) != 0 && errno != EEXIST) {
+    throw fs::filesystem_error("cannot create directory", childPath,
+                               lastError());
+  }
+  int fd =
+      ::openat(m_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw fs::filesystem_error("cannot open directory", childPath,
+                               lastError());
+  }
+  return std::shared_ptr<DirHandle>(new DirHandle(fd, std::move(childPath)));
+#else
+  if (create) {
+    fs::create_directory(childPath);
+  }
+  return open(childPath);
+#endif
+}
+
+#ifndef _WIN32
+std::shared_ptr<DirHandle> DirHandle::adopt(int fd, fs::path directory) {
+  return std::shared_ptr<DirHandle>(new DirHandle(fd, std::move(directory)));
+}
+
+int DirHandle::openFile(const std::string &name, int flags,
+                        std::error_code &ec, unsigned mode) const {
+  int fd = ::openat(m_fd, name.c_str(), flags | O_CLOEXEC, mode);
+  if (fd < 0) {
+    ec = lastError();
+  }
+  return fd;
+}
+
+bool DirHandle::stat(const std::string &name, struct stat &st,
+                     std::error_code &ec) const {
+  if (::fstatat(m_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    ec = lastError();
+    return false;
+  }
+  return true;
+}
+#endif
+
+void DirHandle::rename(const std::string &name, const DirHandle &target,
+                       const std::string &targetName,
+                       std::error_code &ec) const {
+#ifndef _WIN32
+  if (::renameat(m_fd, name.c_str(), target.m_fd, targetName.c_str()) != 0) {
+    ec = lastError();
+  }
+#else
+  fs::rename(pathOf(name), target.pathOf(targetName), ec);
+#endif
+}
+
+void DirHandle::link(const std::string &name, const DirHandle &target,
+                     const std::string &targetName,
+                     std::error_code &ec) const {
+#ifndef _WIN32
+  if (::linkat(m_fd, name.c_str(), target.m_fd, targetName.c_str(), 0) != 0) {
+    ec = lastError();
+  }
+#else
+  fs::create_hard_link(pathOf(name), target.pathOf(targetName), ec);
+#endif
+}
+
+void DirHandle::remove(const std::string &name, std::error_code &ec) const {
+#ifndef _WIN32
+  if (::unlinkat(m_fd, name.c_str(), 0) != 0) {
+    ec = lastError();
+  }
+#else
+  fs::remove(pathOf(name), ec);
+#endif
+}
+
+void DirHandle::syncFile(const std::string &name, std::error_code &ec) const {
+#ifndef _WIN32
+  UniqueFd file(openFile(name, O_RDONLY, ec));
+  if (file.valid() && !flush(file.get())) {
+    ec = lastError();
+  }
+#else
+  // Windows only flushes through a handle opened for writing.
+  HANDLE file = ::CreateFileW(pathOf(name).c_str(), GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    ec = std::error_code(static_cast<int>(::GetLastError()),
+                         std::system_category());
+    return;
+  }
+  if (!::FlushFileBuffers(file)) {
+    ec = std::error_code(static_cast<int>(::GetLastError()),
+                         std::system_category());
+  }
+  ::CloseHandle(file);
+#endif
+}
+
+void DirHandle::sync(std::error_code &ec) const {
+#ifndef _WIN32
+  if (!flush(m_fd)) {
+    ec = lastError();
+  }
+#else
+  (void)ec;
+#endif
+}
+
+#ifndef _WIN32
+void UniqueFd::reset(int fd) {
+  if (m_fd >= 0) {
+    ::close(m_fd);
+  }
+  m_fd = fd;
+}
+#endif
+
+std::shared_ptr<DirHandle> DirHandleCache::get(const fs::path &directory,
+                                               bool create) {
+  fs::path normalized = directory.lexically_normal();
+  if (normalized.has_relative_path() && normalized.filename().empty()) {
+    // 'a/b/' names the same folder as 'a/b'.
+    normalized = normalized.parent_path();
+  }
+
+  auto found = m_entries.find(normalized.native());
+  if (found != m_entries.end()) {
+    m_order.splice(m_order.begin(), m_order, found->second);
+    return found->second->second;
+  }
+
+  std::shared_ptr<DirHandle> handle;
+  fs::path parent = normalized.parent_path();
+  std::string name = normalized.filename().string();
+  if (parent.empty() || parent == normalized || name.empty() ||
+      name == "..") {
+    if (create) {
+      fs::create_directories(normalized);
+    }
+    handle = DirHandle::open(normalized);
+  } else {
+    handle = get(parent, create)->openChild(name, create);
+  }
+
+  m_order.emplace_front(normalized.native(), handle);
+  m_entries[normalized.native()] = m_order.begin();
+  while (m_order.size() > m_capacity) {
+    m_entries.erase(m_order.back().first);
+    m_order.pop_back();
+  }
+  return handle;
+}
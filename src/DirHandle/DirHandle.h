@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace fs = std::filesystem;
+
+// An open directory that file operations are made relative to.
+//
+// Passing a full path to every syscall makes the kernel walk all of its
+// components again each time. With a directory descriptor, openat, fstatat,
+// renameat and friends only resolve the final name. On Windows there are no
+// directory descriptors; there the handle keeps the path and every
+// operation falls back to the full path.
+class DirHandle {
+public:
+  ~DirHandle();
+
+  DirHandle(const DirHandle &) = delete;
+  DirHandle &operator=(const DirHandle &) = delete;
+
+  // Opens directory. Throws fs::filesystem_error on failure.
+  static std::shared_ptr<DirHandle> open(const fs::path &directory);
+
+  // Opens the subdirectory name of this directory; with create it is made
+  // first if missing. Throws fs::filesystem_error on failure.
+  std::shared_ptr<DirHandle> openChild(const std::string &name,
+                                       bool create) const;
+
+  const fs::path &path() const { return m_path; }
+  fs::path pathOf(const std::string &name) const { return m_path / name; }
+
+#ifndef _WIN32
+  // Takes ownership of an already open directory descriptor.
+  static std::shared_ptr<DirHandle> adopt(int fd, fs::path directory);
+
+  int fd() const { return m_fd; }
+
+  // openat(2) relative to this directory. Returns the new descriptor, or -1
+  // with ec set.
+  int openFile(const std::string &name, int flags, std::error_code &ec,
+               unsigned mode = 0) const;
+
+  // fstatat(2) without following a final symbolic link.
+  bool stat(const std::string &name, struct stat &st,
+            std::error_code &ec) const;
+#endif
+
+  // Renames name in this directory to targetName in target.
+  void rename(const std::string &name, const DirHandle &target,
+              const std::string &targetName, std::error_code &ec) const;
+
+  // Creates targetName in target as a hard link to name in this directory.
+  void link(const std::string &name, const DirHandle &target,
+            const std::string &targetName, std::error_code &ec) const;
+
+  // Removes the file name from this directory.
+  void remove(const std::string &name, std::error_code &ec) const;
+
+  // Flushes the file name to stable storage (fsync; F_FULLFSYNC on macOS).
+  void syncFile(const std::string &name, std::error_code &ec) const;
+
+  // Flushes this directory's entries, so names created, renamed or removed
+  // in it survive a crash. Does nothing on Windows.
+  void sync(std::error_code &ec) const;
+
+private:
+  DirHandle(int fd, fs::path path) : m_fd(fd), m_path(std::move(path)) {}
+
+  int m_fd = -1;
+  fs::path m_path;
+};
+
+#ifndef _WIN32
+// Owns a file descriptor and closes it when it goes out of scope.
+class UniqueFd {
+public:
+  explicit UniqueFd(int fd = -1) : m_fd(fd) {}
+  ~UniqueFd() { reset(); }
+
+  UniqueFd(UniqueFd &&other) noexcept : m_fd(other.release()) {}
+  UniqueFd &operator=(UniqueFd &&other) noexcept {
+    if (this != &other) {
+      reset(other.release());
+    }
+    return *this;
+  }
+
+  int get() const { return m_fd; }
+  bool valid() const { return m_fd >= 0; }
+  int release() {
+    int fd = m_fd;
+    m_fd = -1;
+    return fd;
+  }
+  void reset(int fd = -1);
+
+private:
+  int m_fd;
+};
+#endif
+
+// Keeps the most recently used directories open, so consecutive files in
+// the same folder share one handle. A folder that is not cached is opened
+// relative to its (cached) parent, so each path component is resolved once.
+class DirHandleCache {
+public:
+  // Handles kept open at most; bounded to stay far below the fd limit.
+  static constexpr size_t kDefaultCapacity = 64;
+
+  explicit DirHandleCache(size_t capacity = kDefaultCapacity)
+      : m_capacity(capacity) {}
+
+  // Handle of directory; missing folders are created when create is set.
+  // Throws fs::filesystem_error when the folder cannot be opened.
+  std::shared_ptr<DirHandle> get(const fs::path &directory, bool create);
+
+private:
+  using Entry = std::pair<fs::path::string_type, std::shared_ptr<DirHandle>>;
+
+  size_t m_capacity;
+  // Most recently used first.
+  std::list<Entry> m_order;
+  std::unordered_map<fs::path::string_type, std::list<Entry>::iterator>
+      m_entries;
+};
@@ -0,0 +1,640 @@
+#include "DirectoryScanner.h"
+#include "src/IoUring/IoUring.h"
+#include <algorithm>
+#include <map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace {
+std::int64_t modificationTime(const struct stat &st) {
+#ifdef __APPLE__
+  const struct timespec &ts = st.st_mtimespec;
+#else
+  const struct timespec &ts = st.st_mtim;
+#endif
+  return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+std::int64_t changeTime(const struct stat &st) {
+#ifdef __APPLE__
+  const struct timespec &ts = st.st_ctimespec;
+#else
+  const struct timespec &ts = st.st_ctim;
+#endif
+  return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool stampDirectory(const DirHandle *parent, const fs::path &directory,
+                    ScanIndex::Stamp &stamp) {
+  struct stat st;
+  int result = parent != nullptr
+                   ? ::fstatat(parent->fd(), directory.filename().c_str(), &st,
+                               0)
+                   : ::stat(directory.c_str(), &st);
+  if (result != 0) {
+    return false;
+  }
+  stamp.device = static_cast<std::uint64_t>(st.st_dev);
+  stamp.inode = static_cast<std::uint64_t>(st.st_ino);
+  stamp.mtime = modificationTime(st);
+  stamp.ctime = changeTime(st);
+  return true;
+}
+
+void copyStat(const struct stat &st, FileRecord &record) {
+  record.size = static_cast<std::uintmax_t>(st.st_size);
+  record.mtime = modificationTime(st);
+  record.device = static_cast<std::uint64_t>(st.st_dev);
+  record.inode = static_cast<std::uint64_t>(st.st_ino);
+  record.mode = static_cast<std::uint32_t>(st.st_mode);
+}
+} // namespace
+#endif
+
+#ifdef __linux__
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace {
+// Record layout returned by getdents64(2); glibc only exposes the syscall.
+struct LinuxDirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Large enough that most directories are read in one or two syscalls.
+constexpr size_t kDirentBufferSize = 256 * 1024;
+
+// Directory handles that may be held open for subdirectory tasks at once,
+// well below the usual limit of 1024 descriptors. Past it, subdirectories
+// are opened by full path.
+constexpr size_t kMaxSharedHandles = 256;
+
+// Submission queue size of the per-thread statx ring. Directories with more
+// entries are stat'ed in several rounds.
+constexpr unsigned kStatRingEntries = 256;
+
+constexpr unsigned kStatxMask =
+    STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME;
+
+// One io_uring per scanner thread, together with the buffers its requests
+// point into. The ring is declared last so it is torn down first.
+struct StatRing {
+  std::vector<std::string> names;
+  std::vector<struct statx> results;
+  bool broken = false;
+  IoUring ring{kStatRingEntries};
+};
+
+StatRing *workerStatRing() {
+  if (!IoUring::supports(IORING_OP_STATX)) {
+    return nullptr;
+  }
+  thread_local StatRing statRing;
+  if (!statRing.ring.valid() || statRing.broken) {
+    return nullptr;
+  }
+  return &statRing;
+}
+
+unsigned char typeFromMode(std::uint32_t mode) {
+  return S_ISDIR(mode) ? DT_DIR : S_ISREG(mode) ? DT_REG : DT_UNKNOWN;
+}
+
+void copyStatx(const struct statx &stx, FileRecord &record) {
+  record.size = static_cast<std::uintmax_t>(stx.stx_size);
+  record.mtime = static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 +
+                 stx.stx_mtime.tv_nsec;
+  // Encoded like st_dev, so records from both paths compare equal.
+  record.device = static_cast<std::uint64_t>(
+      makedev(stx.stx_dev_major, stx.stx_dev_minor));
+  record.inode = static_cast<std::uint64_t>(stx.stx_ino);
+  record.mode = static_cast<std::uint32_t>(stx.stx_mode);
+}
+
+// Stats every name in statRing.names relative to dirfd, keeping up to a
+// ring's worth of requests in flight, and hands each result to onResult as
+// its completion arrives, by index into names. Names that cannot be stat'ed are dropped. If the
+// ring fails, it is retired and the remaining names are stat'ed one by one.
+void statBatched(
+    StatRing &statRing, int dirfd,
+    const std::function<void(size_t, const FileRecord &)> &onResult) {
+  const std::vector<std::string> &names = statRing.names;
+  statRing.results.resize(names.size());
+  std::vector<bool> done(names.size(), false);
+
+  auto deliver = [&onResult](size_t index, const struct statx &stx) {
+    FileRecord record;
+    copyStatx(stx, record);
+    onResult(index, record);
+  };
+
+  size_t next = 0;
+  size_t inFlight = 0;
+  while (next < names.size() || inFlight > 0) {
+    while (next < names.size() &&
+           statRing.ring.prepareStatx(
+               dirfd, names[next].c_str(),
+               AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT, kStatxMask,
+               &statRing.results[next], next)) {
+      ++next;
+      ++inFlight;
+    }
+    if (!statRing.ring.submit(1)) {
+      statRing.broken = true;
+      break;
+    }
+    std::uint64_t index;
+    int result;
+    while (statRing.ring.popCompletion(index, result)) {
+      --inFlight;
+      done[index] = true;
+      if (result == 0) {
+        deliver(index, statRing.results[index]);
+      }
+    }
+  }
+
+  if (statRing.broken) {
+    // Requests still in flight may write into statRing's buffers later, so
+    // the fallback uses its own.
+    for (size_t i = 0; i < names.size(); ++i) {
+      struct statx stx;
+      if (!done[i] && ::statx(dirfd, names[i].c_str(),
+                              AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT,
+                              kStatxMask, &stx) == 0) {
+        deliver(i, stx);
+      }
+    }
+  }
+}
+} // namespace
+#endif
+
+void DirectoryScanner::scan(const std::vector<fs::path> &roots,
+                            FileList &files) {
+  ThreadPool pool(m_options.threads);
+  std::vector<FileList> parts(pool.size());
+
+  // Each worker packs finished directories into its own list, so no locking
+  // is needed and full paths only exist for one directory at a time.
+  run(pool, roots, [&pool, &parts](DirectoryBatch &&batch) {
+    std::sort(batch.files.begin(), batch.files.end(),
+              [](const FileRecord &a, const FileRecord &b) {
+                return a.path.native() < b.path.native();
+              });
+    FileList &part = parts[pool.currentWorkerIndex()];
+    part.addDirectory(batch.directory,
+                      static_cast<std::uint32_t>(batch.rootIndex));
+    for (const auto &file : batch.files) {
+      part.addFile(file.path.filename().string(), file);
+    }
+    return true;
+  });
+
+  struct DirectoryRef {
+    const FileList *part;
+    std::uint32_t id;
+  };
+  std::vector<DirectoryRef> directories;
+  size_t fileCount = 0;
+  size_t arenaBytes = 0;
+  for (const auto &part : parts) {
+    for (std::uint32_t id = 0; id < part.directoryCount(); ++id) {
+      directories.push_back(DirectoryRef{&part, id});
+    }
+    fileCount += part.size();
+    arenaBytes += part.arenaSize();
+  }
+  std::sort(directories.begin(), directories.end(),
+            [](const DirectoryRef &a, const DirectoryRef &b) {
+              std::uint32_t sourceA = a.part->directorySource(a.id);
+              std::uint32_t sourceB = b.part->directorySource(b.id);
+              if (sourceA != sourceB) {
+                return sourceA < sourceB;
+              }
+              return a.part->directoryPath(a.id) < b.part->directoryPath(b.id);
+            });
+
+  files.reserve(files.directoryCount() + directories.size(),
+                files.size() + fileCount, files.arenaSize() + arenaBytes);
+  for (const auto &directory : directories) {
+    files.appendDirectory(*directory.part, directory.id);
+  }
+}
+
+void DirectoryScanner::scan(const std::vector<fs::path> &roots,
+                            const BatchSink &sink) {
+  ThreadPool pool(m_options.threads);
+  run(pool, roots,
+      [&sink](DirectoryBatch &&batch) { return sink(std::move(batch.files)); });
+}
+
+void DirectoryScanner::run(ThreadPool &pool,
+                           const std::vector<fs::path> &roots,
+                           const std::function<bool(DirectoryBatch &&)> &emit) {
+  ThreadPool::TaskGroup group(pool);
+  Walk walk{group, emit, std::vector<RootState>(roots.size())};
+
+  // Roots on the same device are chained so they are walked one after the
+  // other; each chain head starts now, so different devices run in parallel.
+  std::map<std::string, size_t> lastOnDevice;
+  std::vector<size_t> chainHeads;
+  for (size_t i = 0; i < roots.size(); ++i) {
+    walk.roots[i].path = roots[i];
+    auto inserted = lastOnDevice.emplace(deviceKey(roots[i]), i);
+    if (inserted.second) {
+      chainHeads.push_back(i);
+    } else {
+      walk.roots[inserted.first->second].nextOnDevice = i;
+      inserted.first->second = i;
+    }
+  }
+  for (size_t head : chainHeads) {
+    submitDirectory(walk, head, roots[head]);
+  }
+  group.wait();
+}
+
+void DirectoryScanner::submitDirectory(
+    Walk &walk, size_t rootIndex, fs::path directory,
+    std::shared_ptr<const DirHandle> parent) {
+  walk.roots[rootIndex].pending.fetch_add(1, std::memory_order_relaxed);
+  walk.group.submit([this, &walk, rootIndex, path = std::move(directory),
+                     parent = std::move(parent)]() mutable {
+    try {
+      // The handle is moved into the walk so it is released as soon as the
+      // directory is open, not when the task object is destroyed.
+      walkDirectory(walk, rootIndex, path, std::move(parent));
+    } catch (...) {
+      // Still hand the device on, so the group can drain.
+      finishDirectory(walk, rootIndex);
+      throw;
+    }
+    finishDirectory(walk, rootIndex);
+  });
+}
+
+void DirectoryScanner::finishDirectory(Walk &walk, size_t rootIndex) {
+  RootState &root = walk.roots[rootIndex];
+  if (root.pending.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+      root.nextOnDevice != kNoRoot) {
+    submitDirectory(walk, root.nextOnDevice,
+                    walk.roots[root.nextOnDevice].path);
+  }
+}
+
+std::string DirectoryScanner::deviceKey(const fs::path &root) {
+#ifdef _WIN32
+  std::error_code ec;
+  return fs::absolute(root, ec).root_name().string();
+#else
+  struct stat st;
+  if (::stat(root.c_str(), &st) != 0) {
+    // Unreadable roots fail on their own when walked.
+    return "?" + root.string();
+  }
+  return std::to_string(static_cast<std::uint64_t>(st.st_dev));
+#endif
+}
+
+bool DirectoryScanner::batchedStatAvailable() {
+#ifdef __linux__
+  return IoUring::supports(IORING_OP_STATX);
+#else
+  return false;
+#endif
+}
+
+std::uint64_t DirectoryScanner::filterKey() const {
+  std::uint64_t patterns =
+      m_options.exclude != nullptr ? m_options.exclude->fingerprint() : 0;
+  return (patterns << 2) | (m_options.includeHidden ? 1u : 0u) |
+         (m_options.collectMetadata ? 2u : 0u);
+}
+
+bool DirectoryScanner::isExcluded(const DirectoryBatch &batch,
+                                  const char *name, bool isDirectory) {
+  if (m_options.exclude == nullptr) {
+    return false;
+  }
+  std::string relativePath;
+  if (m_options.exclude->needsRelativePath()) {
+    relativePath = batch.relativeDirectory.empty()
+                       ? std::string(name)
+                       : batch.relativeDirectory + '/' + name;
+  }
+  if (!m_options.exclude->excludes(name, relativePath, isDirectory)) {
+    return false;
+  }
+  m_prunedEntries.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void DirectoryScanner::walkDirectory(Walk &walk, size_t rootIndex,
+                                     fs::path directory,
+                                     std::shared_ptr<const DirHandle> parent) {
+  if (walk.stopped.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  DirectoryBatch batch;
+  batch.rootIndex = rootIndex;
+  if (m_options.exclude != nullptr && m_options.exclude->needsRelativePath() &&
+      directory != walk.roots[rootIndex].path) {
+    batch.relativeDirectory =
+        directory.lexically_relative(walk.roots[rootIndex].path)
+            .generic_string();
+  }
+
+  bool cached = false;
+  bool recordIndex = false;
+  ScanIndex::Stamp stamp;
+#ifndef _WIN32
+  if (m_options.index != nullptr &&
+      stampDirectory(parent.get(), directory, stamp)) {
+    std::vector<ScanIndex::Entry> entries;
+    cached = m_options.index->lookup(directory.native(), stamp, entries);
+    if (cached) {
+      replayListing(walk, directory, stamp, entries, batch);
+    }
+    recordIndex = true;
+  }
+#endif
+
+  if (!cached) {
+#ifdef __linux__
+    if (m_options.backend != Backend::Portable) {
+      readGetdents(walk, directory, std::move(parent), batch);
+    } else {
+      readPortable(walk, directory, batch);
+    }
+#else
+    readPortable(walk, directory, batch);
+#endif
+  }
+
+  if (recordIndex) {
+    recordListing(directory, stamp, batch);
+  }
+
+  if (!batch.files.empty()) {
+    batch.directory = std::move(directory);
+    if (!walk.emit(std::move(batch))) {
+      walk.stopped.store(true, std::memory_order_relaxed);
+    }
+  }
+}
+
+void DirectoryScanner::replayListing(
+    Walk &walk, const fs::path &directory, const ScanIndex::Stamp &stamp,
+    const std::vector<ScanIndex::Entry> &entries, DirectoryBatch &batch) {
+  for (const auto &entry : entries) {
+    if (entry.isDirectory) {
+      batch.subdirectories.push_back(entry.name);
+      submitDirectory(walk, batch.rootIndex, directory / entry.name);
+      continue;
+    }
+
+    FileRecord record;
+    record.path = directory / entry.name;
+    record.size = entry.size;
+    record.mtime = entry.mtime;
+    record.device = stamp.device;
+    record.inode = entry.inode;
+    record.mode = entry.mode;
+    record.sourceIndex = static_cast<std::uint32_t>(batch.rootIndex);
+    batch.files.push_back(std::move(record));
+  }
+}
+
+void DirectoryScanner::recordListing(const fs::path &directory,
+                                     const ScanIndex::Stamp &stamp,
+                                     const DirectoryBatch &batch) {
+  std::vector<ScanIndex::Entry> entries;
+  entries.reserve(batch.files.size() + batch.subdirectories.size());
+  for (const auto &name : batch.subdirectories) {
+    ScanIndex::Entry entry;
+    entry.name = name;
+    entry.isDirectory = true;
+    entries.push_back(std::move(entry));
+  }
+  for (const auto &file : batch.files) {
+    ScanIndex::Entry entry;
+    entry.name = file.path.filename().string();
+    entry.size = file.size;
+    entry.mtime = file.mtime;
+    entry.inode = file.inode;
+    entry.mode = file.mode;
+    entries.push_back(std::move(entry));
+  }
+  m_options.index->record(directory.string(), stamp, std::move(entries));
+}
+
+void DirectoryScanner::readPortable(Walk &walk, const fs::path &directory,
+                                    DirectoryBatch &batch) {
+  for (const auto &entry : fs::directory_iterator(directory)) {
+    fs::file_status status = entry.symlink_status();
+    const std::string name = entry.path().filename().string();
+
+    if (isHidden(name.c_str())) {
+      continue;
+    }
+    if ((fs::is_directory(status) || fs::is_regular_file(status)) &&
+        isExcluded(batch, name.c_str(), fs::is_directory(status))) {
+      continue;
+    }
+
+    if (fs::is_directory(status)) {
+      if (m_options.index != nullptr) {
+        batch.subdirectories.push_back(name);
+      }
+      submitDirectory(walk, batch.rootIndex, entry.path());
+    } else if (fs::is_regular_file(status)) {
+      FileRecord record;
+      record.path = entry.path();
+      record.sourceIndex = static_cast<std::uint32_t>(batch.rootIndex);
+      if (m_options.collectMetadata && !fillMetadata(record)) {
+        continue;
+      }
+      batch.files.push_back(std::move(record));
+    }
+  }
+}
+
+bool DirectoryScanner::fillMetadata(FileRecord &record) {
+#ifndef _WIN32
+  struct stat st;
+  if (::lstat(record.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  copyStat(st, record);
+  return true;
+#else
+  std::error_code ec;
+  record.size = fs::file_size(record.path, ec);
+  if (ec) {
+    return false;
+  }
+  auto mtime = fs::last_write_time(record.path, ec);
+  record.mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     mtime.time_since_epoch())
+                     .count();
+  return true;
+#endif
+}
+
+#ifdef __linux__
+void DirectoryScanner::readGetdents(Walk &walk, const fs::path &directory,
+                                    std::shared_ptr<const DirHandle> parent,
+                                    DirectoryBatch &batch) {
+  // Below the root, only the last component is resolved, relative to the
+  // parent's descriptor.
+  UniqueFd ownedFd(
+      parent != nullptr
+          ? ::openat(parent->fd(), directory.filename().c_str(),
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+          : ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (!ownedFd.valid()) {
+    throw fs::filesystem_error("cannot open directory", directory,
+                               std::error_code(errno, std::generic_category()));
+  }
+  parent.reset();
+  const int fd = ownedFd.get();
+
+  // Handed to subdirectory tasks, created with the first subdirectory.
+  std::shared_ptr<const DirHandle> shared;
+  bool sharingDenied = false;
+  auto shareHandle = [&]() {
+    if (shared == nullptr && !sharingDenied) {
+      if (walk.sharedHandles.fetch_add(1) >= kMaxSharedHandles) {
+        walk.sharedHandles.fetch_sub(1);
+        sharingDenied = true;
+      } else {
+        struct Holder {
+          std::shared_ptr<DirHandle> handle;
+          std::atomic<size_t> &count;
+          ~Holder() { count.fetch_sub(1); }
+        };
+        auto holder = std::make_shared<Holder>(
+            Holder{DirHandle::adopt(ownedFd.release(), directory),
+                   walk.sharedHandles});
+        shared = std::shared_ptr<const DirHandle>(holder, holder->handle.get());
+      }
+    }
+    return shared;
+  };
+
+  thread_local std::vector<char> buffer(kDirentBufferSize);
+
+  StatRing *statRing = nullptr;
+  // Per queued name: whether its type is only known once it is stat'ed, so
+  // the exclude patterns still have to be checked.
+  std::vector<bool> unresolved;
+  if (m_options.backend == Backend::IoUring) {
+    statRing = workerStatRing();
+    if (statRing != nullptr) {
+      statRing->names.clear();
+    }
+  }
+
+  auto addEntry = [this, &walk, &directory, &batch, &shareHandle](
+                      const char *name, unsigned char type,
+                      const FileRecord *metadata, bool checkExcluded) {
+    if (checkExcluded && (type == DT_DIR || type == DT_REG) &&
+        isExcluded(batch, name, type == DT_DIR)) {
+      return;
+    }
+    if (type == DT_DIR) {
+      if (m_options.index != nullptr) {
+        batch.subdirectories.emplace_back(name);
+      }
+      submitDirectory(walk, batch.rootIndex, directory / name, shareHandle());
+    } else if (type == DT_REG) {
+      FileRecord record;
+      if (metadata != nullptr) {
+        record = *metadata;
+      }
+      record.path = directory / name;
+      record.sourceIndex = static_cast<std::uint32_t>(batch.rootIndex);
+      batch.files.push_back(std::move(record));
+    }
+  };
+
+  while (true) {
+    long bytes = ::syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+    if (bytes < 0) {
+      throw fs::filesystem_error(
+          "cannot read directory", directory,
+          std::error_code(errno, std::generic_category()));
+    }
+    if (bytes == 0) {
+      break;
+    }
+
+    for (long offset = 0; offset < bytes;) {
+      const auto *entry =
+          reinterpret_cast<const LinuxDirent64 *>(buffer.data() + offset);
+      offset += entry->d_reclen;
+
+      const char *name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      if (isHidden(name)) {
+        continue;
+      }
+
+      unsigned char type = entry->d_type;
+      // Checked before any stat, so excluded entries cost nothing more.
+      if ((type == DT_DIR || type == DT_REG) &&
+          isExcluded(batch, name, type == DT_DIR)) {
+        continue;
+      }
+      if (type == DT_UNKNOWN ||
+          (type == DT_REG && m_options.collectMetadata)) {
+        // Directories never need a stat. Regular files need exactly one when
+        // metadata is wanted; otherwise only filesystems that leave d_type
+        // empty (older XFS, many FUSE/NFS mounts) pay for it.
+        if (statRing != nullptr) {
+          statRing->names.emplace_back(name);
+          unresolved.push_back(type == DT_UNKNOWN);
+          continue;
+        }
+        struct stat st;
+        if (::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          continue;
+        }
+        FileRecord metadata;
+        copyStat(st, metadata);
+        addEntry(name, typeFromMode(metadata.mode), &metadata,
+                 type == DT_UNKNOWN);
+        continue;
+      }
+      addEntry(name, type, nullptr, false);
+    }
+  }
+
+  if (statRing != nullptr && !statRing->names.empty()) {
+    // The whole directory's stats go to the kernel in one batch instead of
+    // one round trip each.
+    statBatched(*statRing, fd,
+                [statRing, &unresolved, &addEntry](size_t index,
+                                                   const FileRecord &record) {
+                  addEntry(statRing->names[index].c_str(),
+                           typeFromMode(record.mode), &record,
+                           unresolved[index]);
+                });
+  }
+}
+#endif
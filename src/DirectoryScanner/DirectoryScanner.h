@@ -0,0 +1,154 @@
+#pragma once
+
+#include "src/DirHandle/DirHandle.h"
+#include "src/ExcludeMatcher/ExcludeMatcher.h"
+#include "src/FileList/FileList.h"
+#include "src/FileRecord/FileRecord.h"
+#include "src/ScanIndex/ScanIndex.h"
+#include "src/ThreadPool/ThreadPool.h"
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Walks source trees in parallel. Every directory is one task on a
+// work-stealing pool, so wide and deep trees keep all workers busy while
+// metadata round trips (NAS, network mounts) are overlapped.
+//
+// Roots on different devices are walked at the same time. Roots that share
+// a device are walked one after the other, so a spinning disk is not made
+// to seek between several trees.
+class DirectoryScanner {
+public:
+  enum class Backend {
+    // getdents64 on Linux, the portable walker elsewhere.
+    Auto,
+    // std::filesystem::directory_iterator.
+    Portable,
+    // getdents64, with the stat calls of each directory submitted to the
+    // kernel as one io_uring batch. Behaves like Auto where io_uring or its
+    // statx operation is not available.
+    IoUring,
+  };
+
+  struct Options {
+    bool includeHidden = false;
+    Backend backend = Backend::Auto;
+    // Fill size, mtime, device, inode and mode of every file. Costs one
+    // stat per regular file; callers that only need paths can skip it.
+    bool collectMetadata = true;
+    // 0 picks std::thread::hardware_concurrency().
+    unsigned threads = 0;
+    // When set, directories whose stamp matches the index are not read
+    // again, and every listing is recorded for the next index.
+    ScanIndex *index = nullptr;
+    // Files and folders matching these patterns are skipped; matching
+    // folders are not descended into.
+    const ExcludeMatcher *exclude = nullptr;
+  };
+
+  explicit DirectoryScanner(Options options) : m_options(options) {}
+
+  // Appends every regular file below the given roots to files. Symbolic
+  // links are never followed or reported. Unless includeHidden is set,
+  // dotfiles are skipped and dot-directories are not descended into. The
+  // output is grouped by root in the order given, then by directory and file
+  // name, so it does not depend on thread timing.
+  void scan(const std::vector<fs::path> &roots, FileList &files);
+
+  // Returns false to stop the walk early.
+  using BatchSink = std::function<bool(std::vector<FileRecord> &&files)>;
+
+  // Streams the files of each directory to sink as soon as that directory
+  // has been read, with the same filtering as above but in no particular
+  // order. sink is called concurrently from the worker threads and may block
+  // to throttle the walk.
+  void scan(const std::vector<fs::path> &roots, const BatchSink &sink);
+
+  // True when Backend::IoUring can batch stat calls on this system.
+  static bool batchedStatAvailable();
+
+  // Identifies the options that shape a listing, so an index written by a
+  // scan with different filtering is not reused.
+  std::uint64_t filterKey() const;
+
+  // Entries skipped because of the exclude patterns, counting a pruned
+  // folder once. Folders served from the scan index are not re-checked.
+  size_t prunedEntries() const { return m_prunedEntries.load(); }
+
+private:
+  struct DirectoryBatch {
+    size_t rootIndex = 0;
+    fs::path directory;
+    // directory below its root, '/'-separated; only filled when an exclude
+    // pattern needs it.
+    std::string relativeDirectory;
+    std::vector<FileRecord> files;
+    // Only collected when an index is being written.
+    std::vector<std::string> subdirectories;
+  };
+
+  static constexpr size_t kNoRoot = static_cast<size_t>(-1);
+
+  struct RootState {
+    fs::path path;
+    // Directory tasks of this root that have not finished yet.
+    std::atomic<size_t> pending{0};
+    // Root to start once this one is done (same device), or kNoRoot.
+    size_t nextOnDevice = kNoRoot;
+  };
+
+  // State shared by every directory task of one scan.
+  struct Walk {
+    ThreadPool::TaskGroup &group;
+    const std::function<bool(DirectoryBatch &&)> &emit;
+    std::vector<RootState> roots;
+    std::atomic<bool> stopped{false};
+    // Directory handles currently kept open for subdirectory tasks.
+    std::atomic<size_t> sharedHandles{0};
+  };
+
+  void run(ThreadPool &pool, const std::vector<fs::path> &roots,
+           const std::function<bool(DirectoryBatch &&)> &emit);
+  // parent, when set, is the open parent folder; the subdirectory is then
+  // opened relative to it instead of by full path.
+  void submitDirectory(Walk &walk, size_t rootIndex, fs::path directory,
+                       std::shared_ptr<const DirHandle> parent = nullptr);
+  void finishDirectory(Walk &walk, size_t rootIndex);
+  void walkDirectory(Walk &walk, size_t rootIndex, fs::path directory,
+                     std::shared_ptr<const DirHandle> parent);
+  static std::string deviceKey(const fs::path &root);
+
+  // Lists one directory: regular files go into batch, subdirectories are
+  // submitted to the pool.
+  void readPortable(Walk &walk, const fs::path &directory,
+                    DirectoryBatch &batch);
+#ifdef __linux__
+  void readGetdents(Walk &walk, const fs::path &directory,
+                    std::shared_ptr<const DirHandle> parent,
+                    DirectoryBatch &batch);
+#endif
+
+  // Serves a directory from the index instead of reading it.
+  void replayListing(Walk &walk, const fs::path &directory,
+                     const ScanIndex::Stamp &stamp,
+                     const std::vector<ScanIndex::Entry> &entries,
+                     DirectoryBatch &batch);
+  void recordListing(const fs::path &directory, const ScanIndex::Stamp &stamp,
+                     const DirectoryBatch &batch);
+
+  static bool fillMetadata(FileRecord &record);
+
+  bool isHidden(const char *name) const {
+    return !m_options.includeHidden && name[0] == '.';
+  }
+  bool isExcluded(const DirectoryBatch &batch, const char *name,
+                  bool isDirectory);
+
+  Options m_options;
+  std::atomic<size_t> m_prunedEntries{0};
+};
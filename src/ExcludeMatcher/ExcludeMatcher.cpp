@@ -0,0 +1,196 @@
+#include "ExcludeMatcher.h"
+#include <fstream>
+
+namespace {
+constexpr std::uint64_t kFnvOffset = 1469598103934665603ull;
+constexpr std::uint64_t kFnvPrime = 1099511628211ull;
+
+bool hasWildcard(std::string_view text) {
+  return text.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+bool endsWith(std::string_view text, std::string_view suffix) {
+  return text.size() >= suffix.size() &&
+         text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Matches a '[...]' class at the start of pattern against c. Sets length to
+// the size of the class; returns false with length 0 if it is unterminated.
+bool matchClass(std::string_view pattern, char c, size_t &length) {
+  size_t i = 1;
+  bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+  if (negate) {
+    ++i;
+  }
+  bool matched = false;
+  bool first = true;
+  for (; i < pattern.size() && (first || pattern[i] != ']'); first = false) {
+    char low = pattern[i];
+    char high = low;
+    if (i + 2 < pattern.size() && pattern[i + 1] == '-' &&
+        pattern[i + 2] != ']') {
+      high = pattern[i + 2];
+      i += 3;
+    } else {
+      ++i;
+    }
+    if (low <= c && c <= high) {
+      matched = true;
+    }
+  }
+  if (i >= pattern.size()) {
+    length = 0;
+    return false;
+  }
+  length = i + 1;
+  return matched != negate;
+}
+
+// Shell-style glob match. '*' and '?' never match '/', '**' matches across
+// folders and '**/' also matches no folder at all.
+bool globMatch(std::string_view pattern, std::string_view text) {
+  size_t p = 0;
+  size_t t = 0;
+  while (p < pattern.size()) {
+    char c = pattern[p];
+    if (c == '*') {
+      bool anyDepth = p + 1 < pattern.size() && pattern[p + 1] == '*';
+      size_t rest = p + (anyDepth ? 2 : 1);
+      if (anyDepth && rest < pattern.size() && pattern[rest] == '/' &&
+          globMatch(pattern.substr(rest + 1), text.substr(t))) {
+        return true;
+      }
+      for (size_t k = t; k <= text.size(); ++k) {
+        if (globMatch(pattern.substr(rest), text.substr(k))) {
+          return true;
+        }
+        if (k < text.size() && text[k] == '/' && !anyDepth) {
+          return false;
+        }
+      }
+      return false;
+    }
+    if (t >= text.size()) {
+      return false;
+    }
+    if (c == '?') {
+      if (text[t] == '/') {
+        return false;
+      }
+    } else if (c == '[') {
+      size_t length = 0;
+      bool matched = matchClass(pattern.substr(p), text[t], length);
+      if (length == 0) {
+        // An unterminated '[' is an ordinary character.
+        if (text[t] != '[') {
+          return false;
+        }
+      } else {
+        if (!matched) {
+          return false;
+        }
+        p += length;
+        ++t;
+        continue;
+      }
+    } else {
+      if (c == '\\' && p + 1 < pattern.size()) {
+        c = pattern[++p];
+      }
+      if (c != text[t]) {
+        return false;
+      }
+    }
+    ++p;
+    ++t;
+  }
+  return t == text.size();
+}
+} // namespace
+
+void ExcludeMatcher::add(std::string pattern) {
+  while (!pattern.empty() &&
+         (pattern.back() == '\r' || pattern.back() == ' ' ||
+          pattern.back() == '\t')) {
+    pattern.pop_back();
+  }
+  if (pattern.empty() || pattern[0] == '#') {
+    return;
+  }
+
+  m_fingerprint = (m_patternCount == 0 ? kFnvOffset : m_fingerprint);
+  for (char c : pattern) {
+    m_fingerprint = (m_fingerprint ^ static_cast<unsigned char>(c)) * kFnvPrime;
+  }
+  m_fingerprint = (m_fingerprint ^ '\n') * kFnvPrime;
+  ++m_patternCount;
+
+  bool directoryOnly = false;
+  if (pattern.size() > 1 && pattern.back() == '/') {
+    directoryOnly = true;
+    pattern.pop_back();
+  }
+
+  if (pattern.find('/') != std::string::npos) {
+    // Anchored at the source folder.
+    if (pattern[0] == '/') {
+      pattern.erase(0, 1);
+    }
+    m_pathGlobs.push_back(Rule{std::move(pattern), directoryOnly});
+    return;
+  }
+
+  RuleSet &rules = directoryOnly ? m_directoriesOnly : m_anyEntry;
+  if (!hasWildcard(pattern)) {
+    rules.names.insert(std::move(pattern));
+  } else if (pattern[0] == '*' && !hasWildcard(pattern.substr(1))) {
+    rules.suffixes.push_back(pattern.substr(1));
+  } else {
+    rules.nameGlobs.push_back(std::move(pattern));
+  }
+}
+
+bool ExcludeMatcher::addFile(const fs::path &file) {
+  std::ifstream in(file);
+  if (!in) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    add(line);
+  }
+  return true;
+}
+
+bool ExcludeMatcher::matchesName(const RuleSet &rules, std::string_view name) {
+  if (!rules.names.empty() && rules.names.count(std::string(name)) != 0) {
+    return true;
+  }
+  for (const auto &suffix : rules.suffixes) {
+    if (endsWith(name, suffix)) {
+      return true;
+    }
+  }
+  for (const auto &glob : rules.nameGlobs) {
+    if (globMatch(glob, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ExcludeMatcher::excludes(std::string_view name,
+                              std::string_view relativePath,
+                              bool isDirectory) const {
+  if (matchesName(m_anyEntry, name) ||
+      (isDirectory && matchesName(m_directoriesOnly, name))) {
+    return true;
+  }
+  for (const auto &rule : m_pathGlobs) {
+    if ((isDirectory || !rule.directoryOnly) &&
+        globMatch(rule.text, relativePath)) {
+      return true;
+    }
+  }
+  return false;
+}
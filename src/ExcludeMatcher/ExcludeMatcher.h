@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Decides which files and folders the scan leaves out.
+//
+// Patterns use shell glob syntax ('*', '?', '[a-z]', '\' to escape):
+//   node_modules   any entry with that name, at any depth
+//   *.pyc          any entry whose name matches the glob
+//   build/         only folders
+//   docs/*.tmp     a path relative to the source folder; '**' spans folders
+//
+// Patterns are compiled once: plain names go into a hash set and '*suffix'
+// globs into a suffix list, so the common cases cost a lookup per entry.
+// Only the remaining patterns run the general glob matcher.
+class ExcludeMatcher {
+public:
+  // Adds one pattern. Blank lines and lines starting with '#' are ignored.
+  void add(std::string pattern);
+
+  // Adds every line of file as a pattern. Returns false if it cannot be
+  // read.
+  bool addFile(const fs::path &file);
+
+  bool empty() const { return m_patternCount == 0; }
+
+  // True when some pattern needs the entry's path, not just its name.
+  bool needsRelativePath() const { return !m_pathGlobs.empty(); }
+
+  // name is the entry's file name. relativePath is its path below the
+  // source folder with '/' separators; it is only read when
+  // needsRelativePath() is true.
+  bool excludes(std::string_view name, std::string_view relativePath,
+                bool isDirectory) const;
+
+  // Identifies the pattern set, so cached scans made with other patterns
+  // are not reused.
+  std::uint64_t fingerprint() const { return m_fingerprint; }
+
+private:
+  struct Rule {
+    std::string text;
+    bool directoryOnly = false;
+  };
+
+  struct RuleSet {
+    std::unordered_set<std::string> names;
+    std::vector<std::string> suffixes;
+    std::vector<std::string> nameGlobs;
+  };
+
+  static bool matchesName(const RuleSet &rules, std::string_view name);
+
+  RuleSet m_anyEntry;
+  RuleSet m_directoriesOnly;
+  std::vector<Rule> m_pathGlobs;
+  size_t m_patternCount = 0;
+  std::uint64_t m_fingerprint = 0;
+};
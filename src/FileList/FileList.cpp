@@ -0,0 +1,99 @@
+#include "FileList.h"
+
+namespace {
+// Strings up to this length live inside std::string itself (libstdc++,
+// libc++ and MSVC all inline at least 15 characters).
+constexpr size_t kSmallStringCapacity = 15;
+} // namespace
+
+std::uint32_t FileList::addDirectory(const fs::path &directory,
+                                     std::uint32_t sourceIndex) {
+  const std::string path = directory.string();
+  Directory record;
+  record.pathOffset = m_arena.size();
+  record.pathLength = static_cast<std::uint32_t>(path.size());
+  record.sourceIndex = sourceIndex;
+  record.firstFile = m_files.size();
+  record.fileCount = 0;
+  m_arena += path;
+  m_directories.push_back(record);
+  return static_cast<std::uint32_t>(m_directories.size() - 1);
+}
+
+void FileList::addFile(std::string_view name, const FileRecord &record) {
+  Entry entry;
+  entry.size = record.size;
+  entry.mtime = record.mtime;
+  entry.device = record.device;
+  entry.inode = record.inode;
+  entry.mode = record.mode;
+  pushEntry(entry, name);
+}
+
+void FileList::pushEntry(Entry entry, std::string_view name) {
+  Directory &directory = m_directories.back();
+  entry.nameOffset = m_arena.size();
+  entry.nameLength = static_cast<std::uint32_t>(name.size());
+  entry.directoryId = static_cast<std::uint32_t>(m_directories.size() - 1);
+  m_arena += name;
+  m_files.push_back(entry);
+  ++directory.fileCount;
+
+  size_t pathLength = directory.pathLength + 1 + name.size();
+  m_pathPerFileBytes += sizeof(FileRecord);
+  if (pathLength > kSmallStringCapacity) {
+    m_pathPerFileBytes += pathLength + 1;
+  }
+}
+
+std::string_view FileList::directoryPath(std::uint32_t id) const {
+  const Directory &directory = m_directories[id];
+  return std::string_view(m_arena.data() + directory.pathOffset,
+                          directory.pathLength);
+}
+
+std::string_view FileList::name(size_t index) const {
+  const Entry &entry = m_files[index];
+  return std::string_view(m_arena.data() + entry.nameOffset,
+                          entry.nameLength);
+}
+
+fs::path FileList::path(size_t index) const {
+  fs::path result(directoryPath(m_files[index].directoryId));
+  result /= name(index);
+  return result;
+}
+
+FileRecord FileList::record(size_t index) const {
+  const Entry &entry = m_files[index];
+  FileRecord record;
+  record.path = path(index);
+  record.size = entry.size;
+  record.mtime = entry.mtime;
+  record.device = entry.device;
+  record.inode = entry.inode;
+  record.mode = entry.mode;
+  record.sourceIndex = m_directories[entry.directoryId].sourceIndex;
+  return record;
+}
+
+void FileList::appendDirectory(const FileList &other, std::uint32_t id) {
+  const Directory &source = other.m_directories[id];
+  addDirectory(fs::path(other.directoryPath(id)), source.sourceIndex);
+  for (std::uint64_t i = 0; i < source.fileCount; ++i) {
+    size_t index = static_cast<size_t>(source.firstFile + i);
+    pushEntry(other.m_files[index], other.name(index));
+  }
+}
+
+void FileList::reserve(size_t directories, size_t files, size_t arenaBytes) {
+  m_directories.reserve(directories);
+  m_files.reserve(files);
+  m_arena.reserve(arenaBytes);
+}
+
+size_t FileList::memoryUsage() const {
+  return sizeof(*this) + m_arena.capacity() +
+         m_directories.capacity() * sizeof(Directory) +
+         m_files.capacity() * sizeof(Entry);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "src/FileRecord/FileRecord.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// A compact list of scanned files.
+//
+// Storing one fs::path per file repeats the parent directory in every entry
+// and costs a heap allocation each. Here every directory path and every file
+// name is stored once in a single contiguous string arena; a file is a
+// fixed-size entry holding its directory id, the offset of its name and its
+// metadata. Full paths are only assembled when a caller asks for one.
+class FileList {
+public:
+  // Starts a new directory; files added afterwards belong to it until the
+  // next call. Returns the directory's id.
+  std::uint32_t addDirectory(const fs::path &directory,
+                             std::uint32_t sourceIndex);
+
+  // Adds a file to the most recently added directory. Only the metadata of
+  // record is used; its path is not stored.
+  void addFile(std::string_view name, const FileRecord &record);
+
+  size_t size() const { return m_files.size(); }
+  bool empty() const { return m_files.empty(); }
+
+  // Builds the full path of file index.
+  fs::path path(size_t index) const;
+  std::string_view name(size_t index) const;
+  std::uintmax_t fileSize(size_t index) const { return m_files[index].size; }
+  // Materializes one file as a FileRecord, full path included.
+  FileRecord record(size_t index) const;
+
+  // Appends directory id of another list, with its files in their order.
+  void appendDirectory(const FileList &other, std::uint32_t id);
+  void reserve(size_t directories, size_t files, size_t arenaBytes);
+  size_t arenaSize() const { return m_arena.size(); }
+  size_t directoryCount() const { return m_directories.size(); }
+  std::uint32_t directorySource(std::uint32_t id) const {
+    return m_directories[id].sourceIndex;
+  }
+  std::string_view directoryPath(std::uint32_t id) const;
+
+  // Bytes held by this list.
+  size_t memoryUsage() const;
+  // Estimated bytes the same files would take as a vector of FileRecords
+  // with one heap-allocated path each.
+  size_t pathPerFileMemoryUsage() const { return m_pathPerFileBytes; }
+
+private:
+  struct Directory {
+    std::uint64_t pathOffset;
+    std::uint32_t pathLength;
+    std::uint32_t sourceIndex;
+    std::uint64_t firstFile;
+    std::uint64_t fileCount;
+  };
+
+  struct Entry {
+    std::uint64_t nameOffset;
+    std::uint32_t nameLength;
+    std::uint32_t directoryId;
+    std::uint64_t size;
+    std::int64_t mtime;
+    std::uint64_t device;
+    std::uint64_t inode;
+    std::uint32_t mode;
+  };
+
+  void pushEntry(Entry entry, std::string_view name);
+
+  std::string m_arena;
+  std::vector<Directory> m_directories;
+  std::vector<Entry> m_files;
+  size_t m_pathPerFileBytes = 0;
+};
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// Everything the merge needs to know about one source file. The scanner
+// fills it from a single stat, and every later stage (planning, copying,
+// progress) reads it from here instead of asking the filesystem again.
+struct FileRecord {
+  fs::path path;
+  std::uintmax_t size = 0;
+  // Modification time in nanoseconds since the Unix epoch.
+  std::int64_t mtime = 0;
+  std::uint64_t device = 0;
+  std::uint64_t inode = 0;
+  std::uint32_t mode = 0;
+  // Position of the source root this file was found under.
+  std::uint32_t sourceIndex = 0;
+};
@@ -0,0 +1,264 @@
+#include "IoUring.h"
+
+#ifdef __linux__
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+int setupRing(unsigned entries, io_uring_params &params) {
+  return static_cast<int>(::syscall(SYS_io_uring_setup, entries, &params));
+}
+
+int enterRing(int fd, unsigned toSubmit, unsigned minComplete,
+              unsigned flags) {
+  return static_cast<int>(::syscall(SYS_io_uring_enter, fd, toSubmit,
+                                    minComplete, flags, nullptr, 0));
+}
+
+void *mapRing(int fd, size_t size, off_t offset) {
+  void *ring = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ring == MAP_FAILED ? nullptr : ring;
+}
+
+template <typename T> T *at(void *base, unsigned offset) {
+  return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+} // namespace
+
+IoUring::IoUring(unsigned entries) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int fd = setupRing(entries, params);
+  if (fd < 0) {
+    return;
+  }
+
+  m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  m_cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  // Since 5.4 both rings share one mapping.
+  bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMap) {
+    m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+  }
+
+  m_sqRing = mapRing(fd, m_sqRingSize, IORING_OFF_SQ_RING);
+  if (m_sqRing != nullptr) {
+    m_cqRing = singleMap ? m_sqRing
+                         : mapRing(fd, m_cqRingSize, IORING_OFF_CQ_RING);
+  }
+  m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  if (m_cqRing != nullptr) {
+    m_sqes = mapRing(fd, m_sqesSize, IORING_OFF_SQES);
+  }
+  m_fd = fd;
+  if (m_sqes == nullptr) {
+    release();
+    return;
+  }
+
+  m_sqEntries = params.sq_entries;
+  m_sqHead = at<unsigned>(m_sqRing, params.sq_off.head);
+  m_sqTail = at<unsigned>(m_sqRing, params.sq_off.tail);
+  m_sqMask = *at<unsigned>(m_sqRing, params.sq_off.ring_mask);
+  m_sqArray = at<unsigned>(m_sqRing, params.sq_off.array);
+  m_cqHead = at<unsigned>(m_cqRing, params.cq_off.head);
+  m_cqTail = at<unsigned>(m_cqRing, params.cq_off.tail);
+  m_cqMask = *at<unsigned>(m_cqRing, params.cq_off.ring_mask);
+  m_cqes = at<io_uring_cqe>(m_cqRing, params.cq_off.cqes);
+}
+
+IoUring::~IoUring() { release(); }
+
+void IoUring::release() {
+  if (m_sqes != nullptr) {
+    ::munmap(m_sqes, m_sqesSize);
+    m_sqes = nullptr;
+  }
+  if (m_cqRing != nullptr && m_cqRing != m_sqRing) {
+    ::munmap(m_cqRing, m_cqRingSize);
+  }
+  m_cqRing = nullptr;
+  if (m_sqRing != nullptr) {
+    ::munmap(m_sqRing, m_sqRingSize);
+    m_sqRing = nullptr;
+  }
+  if (m_fd >= 0) {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+bool IoUring::supports(std::uint8_t opcode) {
+  static const std::array<bool, 256> supported = [] {
+    std::array<bool, 256> result{};
+    IoUring ring(2);
+    if (!ring.valid()) {
+      return result;
+    }
+    // io_uring_probe ends in a flexible array of per-opcode entries.
+    constexpr unsigned kOps = 256;
+    std::array<char, sizeof(io_uring_probe) + kOps * sizeof(io_uring_probe_op)>
+        storage{};
+    auto *probe = reinterpret_cast<io_uring_probe *>(storage.data());
+    if (::syscall(SYS_io_uring_register, ring.m_fd, IORING_REGISTER_PROBE,
+                  probe, kOps) < 0) {
+      return result;
+    }
+    for (unsigned i = 0; i < probe->ops_len && i < kOps; ++i) {
+      result[probe->ops[i].op] =
+          (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    return result;
+  }();
+  return supported[opcode];
+}
+
+io_uring_sqe *IoUring::nextSqe() {
+  unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+  unsigned tail = *m_sqTail + m_toSubmit;
+  if (tail - head >= m_sqEntries) {
+    return nullptr;
+  }
+  unsigned index = tail & m_sqMask;
+  auto *sqe = static_cast<io_uring_sqe *>(m_sqes) + index;
+  std::memset(sqe, 0, sizeof(*sqe));
+  m_sqArray[index] = index;
+  ++m_toSubmit;
+  return sqe;
+}
+
+bool IoUring::prepareStatx(int dirfd, const char *path, int flags,
+                           unsigned mask, struct statx *out,
+                           std::uint64_t userData) {
+  io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = dirfd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(path);
+  sqe->len = mask;
+  sqe->off = reinterpret_cast<std::uint64_t>(out);
+  sqe->statx_flags = static_cast<std::uint32_t>(flags);
+  sqe->user_data = userData;
+  return true;
+}
+
+bool IoUring::registerBuffers(const struct iovec *buffers, unsigned count) {
+  return ::syscall(SYS_io_uring_register, m_fd, IORING_REGISTER_BUFFERS,
+                   buffers, count) == 0;
+}
+
+namespace {
+void prepareReadWrite(io_uring_sqe *sqe, bool write, int fd,
+                      const void *buffer, unsigned length,
+                      std::uint64_t offset, int bufferIndex,
+                      std::uint64_t userData, bool link) {
+  if (bufferIndex >= 0) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = static_cast<std::uint16_t>(bufferIndex);
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(buffer);
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->flags = link ? IOSQE_IO_LINK : 0;
+  sqe->user_data = userData;
+}
+} // namespace
+
+bool IoUring::prepareRead(int fd, void *buffer, unsigned length,
+                          std::uint64_t offset, int bufferIndex,
+                          std::uint64_t userData, bool link) {
+  io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  prepareReadWrite(sqe, false, fd, buffer, length, offset, bufferIndex,
+                   userData, link);
+  return true;
+}
+
+bool IoUring::prepareWrite(int fd, const void *buffer, unsigned length,
+                           std::uint64_t offset, int bufferIndex,
+                           std::uint64_t userData, bool link) {
+  io_uring_sqe *sqe = nextSqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  prepareReadWrite(sqe, true, fd, buffer, length, offset, bufferIndex,
+                   userData, link);
+  return true;
+}
+
+bool IoUring::submit(unsigned waitFor) {
+  // Publish the new tail only after the entries are written.
+  unsigned tail = *m_sqTail + m_toSubmit;
+  __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+  m_toSubmit = 0;
+  while (true) {
+    // Entries the kernel has not consumed yet, including any left over by
+    // an earlier failed call.
+    unsigned pending = tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (pending == 0 && waitFor == 0) {
+      return true;
+    }
+    int submitted = enterRing(m_fd, pending, waitFor,
+                              waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    waitFor = 0;
+  }
+}
+
+bool IoUring::popCompletion(std::uint64_t &userData, int &result) {
+  unsigned head = *m_cqHead;
+  if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  const io_uring_cqe &cqe =
+      static_cast<const io_uring_cqe *>(m_cqes)[head & m_cqMask];
+  userData = cqe.user_data;
+  result = cqe.res;
+  __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+#else
+
+IoUring::IoUring(unsigned entries) { (void)entries; }
+
+IoUring::~IoUring() = default;
+
+void IoUring::release() {}
+
+bool IoUring::supports(std::uint8_t opcode) {
+  (void)opcode;
+  return false;
+}
+
+bool IoUring::submit(unsigned waitFor) {
+  (void)waitFor;
+  return false;
+}
+
+bool IoUring::popCompletion(std::uint64_t &userData, int &result) {
+  (void)userData;
+  (void)result;
+  return false;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+// A minimal io_uring submission/completion ring, driven through the raw
+// syscalls so no liburing is needed.
+//
+// One ring belongs to one thread. Callers take submission entries with
+// nextSqe(), fill them in, call submit() and then drain completions with
+// popCompletion(). On platforms or kernels without io_uring valid() is false
+// and callers are expected to use their synchronous path instead.
+class IoUring {
+public:
+  explicit IoUring(unsigned entries);
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  bool valid() const { return m_fd >= 0; }
+  unsigned capacity() const { return m_sqEntries; }
+
+  // True when the running kernel accepts io_uring and implements opcode.
+  // Probed once per process; seccomp filters that block io_uring (common in
+  // containers) read as unsupported.
+  static bool supports(std::uint8_t opcode);
+
+#ifdef __linux__
+  // A zeroed submission entry, or nullptr when the queue is full. It is
+  // handed to the kernel by the next submit().
+  io_uring_sqe *nextSqe();
+
+  // Queues statx(dirfd, path, flags, mask, out). path and out must stay
+  // valid until the completion has been popped.
+  bool prepareStatx(int dirfd, const char *path, int flags, unsigned mask,
+                    struct statx *out, std::uint64_t userData);
+
+  // Registers buffers with the kernel once, so fixed reads and writes skip
+  // pinning the pages on every request.
+  bool registerBuffers(const struct iovec *buffers, unsigned count);
+
+  // Queue pread/pwrite of length bytes at offset. bufferIndex >= 0 names the
+  // registered buffer that buffer lies in (READ_FIXED/WRITE_FIXED); -1 uses
+  // plain READ/WRITE. With link the next queued entry only starts once this
+  // one has completed in full; otherwise it is cancelled (-ECANCELED).
+  bool prepareRead(int fd, void *buffer, unsigned length,
+                   std::uint64_t offset, int bufferIndex,
+                   std::uint64_t userData, bool link);
+  bool prepareWrite(int fd, const void *buffer, unsigned length,
+                    std::uint64_t offset, int bufferIndex,
+                    std::uint64_t userData, bool link);
+#endif
+
+  // Hands queued entries to the kernel and waits until at least waitFor
+  // completions are ready. Returns false on error (errno is set).
+  bool submit(unsigned waitFor);
+
+  // Pops one ready completion. result is what the syscall would have
+  // returned, or -errno.
+  bool popCompletion(std::uint64_t &userData, int &result);
+
+private:
+  void release();
+
+  int m_fd = -1;
+  unsigned m_sqEntries = 0;
+  // Entries queued by nextSqe() that submit() has not handed over yet.
+  unsigned m_toSubmit = 0;
+
+  void *m_sqRing = nullptr;
+  size_t m_sqRingSize = 0;
+  void *m_cqRing = nullptr;
+  size_t m_cqRingSize = 0;
+  void *m_sqes = nullptr;
+  size_t m_sqesSize = 0;
+
+  unsigned *m_sqHead = nullptr;
+  unsigned *m_sqTail = nullptr;
+  unsigned m_sqMask = 0;
+  unsigned *m_sqArray = nullptr;
+  unsigned *m_cqHead = nullptr;
+  unsigned *m_cqTail = nullptr;
+  unsigned m_cqMask = 0;
+  void *m_cqes = nullptr;
+};
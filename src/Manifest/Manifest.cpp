@@ -0,0 +1,147 @@
+#include "Manifest.h"
+#include "src/ContentHash/ContentHash.h"
+#include <sstream>
+
+namespace {
+std::string escape(const std::string &text) {
+  std::string escaped;
+  escaped.reserve(text.size());
+  for (char c : text) {
+    switch (c) {
+    case '\\':
+      escaped += "\\\\";
+      break;
+    case '\t':
+      escaped += "\\t";
+      break;
+    case '\n':
+      escaped += "\\n";
+      break;
+    case '\r':
+      escaped += "\\r";
+      break;
+    default:
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+bool unescape(const std::string &text, std::string &plain) {
+  plain.clear();
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '\\') {
+      plain += text[i];
+      continue;
+    }
+    if (++i == text.size()) {
+      return false;
+    }
+    switch (text[i]) {
+    case '\\':
+      plain += '\\';
+      break;
+    case 't':
+      plain += '\t';
+      break;
+    case 'n':
+      plain += '\n';
+      break;
+    case 'r':
+      plain += '\r';
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Splits line at its tabs into exactly count fields.
+bool split(const std::string &line, size_t count,
+           std::vector<std::string> &fields) {
+  fields.clear();
+  size_t start = 0;
+  while (fields.size() + 1 < count) {
+    size_t tab = line.find('\t', start);
+    if (tab == std::string::npos) {
+      return false;
+    }
+    fields.push_back(line.substr(start, tab - start));
+    start = tab + 1;
+  }
+  if (line.find('\t', start) != std::string::npos) {
+    return false;
+  }
+  fields.push_back(line.substr(start));
+  return true;
+}
+} // namespace
+
+bool Manifest::open(const fs::path &path) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_out.open(path, std::ios::out | std::ios::trunc);
+  if (!m_out) {
+    return false;
+  }
+  m_out << "# ekatra manifest: hash, size, source, destination\n";
+  m_entries = 0;
+  return true;
+}
+
+void Manifest::add(const Entry &entry) {
+  // Resolved outside the lock; it asks for the working directory.
+  std::string line = ContentHash::toHex(entry.hash) + '\t' +
+                     std::to_string(entry.size) + '\t' +
+                     escape(fs::absolute(entry.source).string()) + '\t' +
+                     escape(fs::absolute(entry.destination).string()) + '\n';
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_out << line;
+  ++m_entries;
+}
+
+size_t Manifest::size() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_entries;
+}
+
+bool Manifest::close() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_out.flush();
+  bool good = static_cast<bool>(m_out);
+  m_out.close();
+  return good;
+}
+
+bool Manifest::read(const fs::path &path, std::vector<Entry> &entries,
+                    size_t &badLines) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  badLines = 0;
+  std::string line;
+  std::vector<std::string> fields;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    Entry entry;
+    std::string source;
+    std::string destination;
+    std::istringstream size(split(line, 4, fields) ? fields[1] : "");
+    if (fields.size() != 4 || !ContentHash::fromHex(fields[0], entry.hash) ||
+        !(size >> entry.size) || !size.eof() || !unescape(fields[2], source) ||
+        !unescape(fields[3], destination)) {
+      ++badLines;
+      continue;
+    }
+    entry.source = source;
+    entry.destination = destination;
+    entries.push_back(std::move(entry));
+  }
+  return !in.bad();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// The files a run copied, with the ContentHash of their bytes (--manifest);
+// --verify later re-reads the destinations and compares.
+//
+// One line per file, tab-separated: hash as 16 hex digits, size in bytes,
+// source path, destination path. Paths are absolute; backslashes, tabs and
+// newlines in them are escaped with a backslash. Lines starting with '#'
+// are comments.
+class Manifest {
+public:
+  struct Entry {
+    fs::path source;
+    fs::path destination;
+    std::uintmax_t size = 0;
+    std::uint64_t hash = 0;
+  };
+
+  // Creates path, replacing an older manifest. False if it cannot.
+  bool open(const fs::path &path);
+  bool isOpen() const { return m_out.is_open(); }
+
+  // Thread-safe.
+  void add(const Entry &entry);
+  size_t size() const;
+
+  // Flushes and closes the file. False if any write failed.
+  bool close();
+
+  // Reads the entries of a manifest. False if path cannot be read;
+  // malformed lines are skipped and counted in badLines.
+  static bool read(const fs::path &path, std::vector<Entry> &entries,
+                   size_t &badLines);
+
+private:
+  mutable std::mutex m_mutex;
+  std::ofstream m_out;
+  size_t m_entries = 0;
+};
@@ -1,8 +1,106 @@
 #include "MergeManager.h"
+#include "BoundedQueue/BoundedQueue.h"
+#include "BufferPool/BufferPool.h"
+#include "ContentHash/ContentHash.h"
+#include "CopyEngine/CopyEngine.h"
+#include "DestinationIndex/DestinationIndex.h"
+#include "DeviceScheduler/DeviceScheduler.h"
+#include "DirHandle/DirHandle.h"
+#include "DirectoryScanner/DirectoryScanner.h"
+#include "ExcludeMatcher/ExcludeMatcher.h"
+#include "Manifest/Manifest.h"
 #include "ProgressReporter/ProgressReporter.h"
+#include "ScanIndex/ScanIndex.h"
+#include "ThreadPool/ThreadPool.h"
+#include "UringCopier/UringCopier.h"
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+// How many scanned-but-unprocessed files streaming mode may buffer.
+constexpr size_t kStreamingQueueCapacity = 65536;
+
+namespace {
+struct ScanStats {
+  bool usedExcludes = false;
+  size_t prunedEntries = 0;
+  bool usedIndex = false;
+  size_t reusedDirectories = 0;
+  size_t totalDirectories = 0;
+};
+
+// Walks every source with the scanner, in the order given. When a scan
+// index is configured it is loaded before and rewritten after the walk.
+// output is either a FileList or a streaming batch sink.
+template <typename Output>
+ScanStats scanSources(const ProcessOptions &options, bool collectMetadata,
+                      Output &&output) {
+  DirectoryScanner::Options scanOptions;
+  scanOptions.includeHidden = options.includeHidden;
+  scanOptions.collectMetadata = collectMetadata;
+  scanOptions.threads = options.scanThreads;
+
+  ScanStats stats;
+  ExcludeMatcher excludes;
+  for (const auto &pattern : options.excludePatterns) {
+    excludes.add(pattern);
+  }
+  if (!options.excludeFile.empty() && !excludes.addFile(options.excludeFile)) {
+    std::cerr << "Warning: Could not open exclude file: "
+              << options.excludeFile.string() << std::endl;
+  }
+  if (!excludes.empty()) {
+    scanOptions.exclude = &excludes;
+    stats.usedExcludes = true;
+  }
+  if (options.ioUringScan) {
+    scanOptions.backend = DirectoryScanner::Backend::IoUring;
+  }
+
+  // The index stores listings with metadata, so only full scans use it.
+  stats.usedIndex = collectMetadata && !options.scanIndexFile.empty();
+  ScanIndex index;
+  if (stats.usedIndex) {
+    scanOptions.index = &index;
+  }
+
+  DirectoryScanner scanner(scanOptions);
+  if (stats.usedIndex) {
+    index.load(options.scanIndexFile, scanner.filterKey());
+  }
+  scanner.scan(options.sources, std::forward<Output>(output));
+  stats.prunedEntries = scanner.prunedEntries();
+  if (stats.usedIndex) {
+    index.save(options.scanIndexFile, scanner.filterKey());
+    stats.reusedDirectories = index.reusedDirectories();
+    stats.totalDirectories =
+        index.reusedDirectories() + index.scannedDirectories();
+  }
+  return stats;
+}
+
+// Finishes the --manifest file once every transfer is done.
+void closeManifest(Manifest *manifest, const fs::path &path,
+                   ProgressReporter &reporter) {
+  if (manifest == nullptr) {
+    return;
+  }
+  if (!manifest->close()) {
+    reporter.reportFileError(path, std::make_error_code(std::errc::io_error));
+    return;
+  }
+  reporter.reportManifest(manifest->size(), path);
+}
+} // namespace
 
 const std::map<std::string, fs::path> categoryMap = {
     // Media
@@ -54,26 +152,274 @@ const std::map<std::string, fs::path> categoryMap = {
     {".dmg", "Applications"},
     {".app", "Applications"}};
 
+class MergeManager::Transfers {
+public:
+  using Transfer = std::function<void(const TransferContext &)>;
+
+  // Threads of the pool that copies large files in ranges, when --jobs does
+  // not already provide one.
+  static constexpr unsigned kRangeThreads = 4;
+  // Threads that flush and finish moves across filesystems, and how many
+  // moves may wait for them before the copies stop for a while.
+  static constexpr unsigned kFinalizeThreads = 4;
+  static constexpr size_t kMaxFinalizing = 64;
+  // Workers shared by the device queues unless --jobs asks for a number:
+  // enough for two SSDs at their limit.
+  static constexpr unsigned kDeviceQueueThreads =
+      2 * DeviceScheduler::kSolidStateLimit;
+  // Planned transfers the device queues may hold. Deep, so a disk that is
+  // slow to drain does not stop the files of the others from being planned.
+  static constexpr size_t kMaxDeviceQueued = 65536;
+
+  Transfers(const ProcessOptions &options, Manifest *manifest)
+      : m_parallelCopies(options.parallelCopyThreshold > 0),
+        m_durability(options.durability), m_manifest(manifest) {
+#ifndef _WIN32
+    struct stat st;
+    if (::stat(options.destination.c_str(), &st) == 0) {
+      m_destinationDevice = static_cast<std::uint64_t>(st.st_dev);
+    }
+#endif
+    if (options.deviceQueues) {
+      m_pool = std::make_unique<ThreadPool>(
+          options.jobs > 1 ? options.jobs : kDeviceQueueThreads);
+      for (unsigned i = 0; i < m_pool->size(); ++i) {
+        m_workerDirectories.push_back(std::make_unique<DirHandleCache>());
+      }
+      m_scheduler =
+          std::make_unique<DeviceScheduler>(*m_pool, kMaxDeviceQueued);
+      return;
+    }
+    if (options.jobs > 1) {
+      m_pool = std::make_unique<ThreadPool>(options.jobs);
+      for (unsigned i = 0; i < m_pool->size(); ++i) {
+        m_workerDirectories.push_back(std::make_unique<DirHandleCache>());
+      }
+      m_group = std::make_unique<ThreadPool::TaskGroup>(*m_pool);
+      // Enough queued work to keep every worker busy, without holding the
+      // whole file list in tasks.
+      m_maxQueued = m_pool->size() * 4;
+      return;
+    }
+    if (options.ioUringCopy && options.operation != Operation::Move) {
+      UringCopier::Options copierOptions;
+      copierOptions.filesInFlight = options.filesInFlight;
+      m_copier = std::make_unique<UringCopier>(copierOptions);
+      if (!m_copier->valid()) {
+        m_copier.reset();
+      } else if (m_copier->filesInFlight() < options.filesInFlight) {
+        std::cout << "Copying " << m_copier->filesInFlight()
+                  << " files at a time to stay within the open file limit."
+                  << std::endl;
+      }
+    }
+  }
+
+  // Runs transfer now, or queues it for a worker once fewer than
+  // m_maxQueued are waiting. With device queues it waits in the queue of
+  // sourceDevice instead.
+  void run(std::uint64_t sourceDevice, Transfer transfer) {
+    if (m_scheduler) {
+      schedule(sourceDevice, std::move(transfer));
+      return;
+    }
+    bool ranges = rangesAllowed(sourceDevice);
+    if (!m_pool) {
+      transfer(TransferContext{*this, m_directories, m_copier.get(),
+                               ranges ? rangePool() : nullptr});
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_slotFree.wait(lock, [this] { return m_queued < m_maxQueued; });
+      ++m_queued;
+    }
+    m_group->submit([this, ranges, transfer = std::move(transfer)] {
+      struct Release {
+        Transfers &transfers;
+        ~Release() {
+          std::lock_guard<std::mutex> lock(transfers.m_mutex);
+          --transfers.m_queued;
+          transfers.m_slotFree.notify_one();
+        }
+      } release{*this};
+      try {
+        // Large files are split over the same workers; one waiting for its
+        // ranges helps run them.
+        transfer(TransferContext{
+            *this, *m_workerDirectories[m_pool->currentWorkerIndex()],
+            nullptr, ranges ? m_pool.get() : nullptr});
+      } catch (...) {
+        m_failed = true;
+        throw;
+      }
+    });
+  }
+
+  // Runs step on a finalizer thread, so its fsyncs overlap the next
+  // copies. Blocks while kMaxFinalizing steps are waiting. Thread-safe.
+  void finalize(std::function<void()> step) {
+    {
+      std::unique_lock<std::mutex> lock(m_finalizeMutex);
+      m_finalizeSlotFree.wait(
+          lock, [this] { return m_finalizing < kMaxFinalizing; });
+      ++m_finalizing;
+      if (!m_finalizePool) {
+        m_finalizePool = std::make_unique<ThreadPool>(kFinalizeThreads);
+        m_finalizeGroup =
+            std::make_unique<ThreadPool::TaskGroup>(*m_finalizePool);
+      }
+    }
+    m_finalizeGroup->submit([this, step = std::move(step)] {
+      step();
+      std::lock_guard<std::mutex> lock(m_finalizeMutex);
+      --m_finalizing;
+      m_finalizeSlotFree.notify_one();
+    });
+  }
+
+  // Waits for every transfer so far and rethrows the first fatal error.
+  void finish() {
+    if (m_copier) {
+      m_copier->drain();
+    }
+    if (m_group) {
+      m_group->wait();
+    }
+    if (m_scheduler) {
+      m_scheduler->wait();
+    }
+    // Transfers may finalize until they are done.
+    if (m_finalizeGroup) {
+      m_finalizeGroup->wait();
+    }
+  }
+
+  // A transfer failed fatally; no more should be started.
+  bool failed() const { return m_failed; }
+
+  SyncTracker &durability() { return m_durability; }
+
+  // Where copies record their hash; nullptr without --manifest.
+  Manifest *manifest() { return m_manifest; }
+
+  // Flushes what the durability policy still holds back and reports the
+  // time syncing took. After finish().
+  void makeDurable(ProgressReporter &reporter) {
+    if (m_durability.policy() == SyncTracker::Policy::None) {
+      return;
+    }
+    m_durability.flush([&reporter](const fs::path &path,
+                                   const std::error_code &ec) {
+      reporter.reportFileError(path, ec);
+    });
+    reporter.reportSync(m_durability.filesSynced(), m_durability.timeSpent());
+  }
+
+private:
+  void schedule(std::uint64_t sourceDevice, Transfer transfer) {
+    bool ranges = rangesAllowed(sourceDevice);
+    m_scheduler->submit(
+        sourceDevice, m_destinationDevice,
+        [this, ranges, transfer = std::move(transfer)] {
+          try {
+            transfer(TransferContext{
+                *this, *m_workerDirectories[m_pool->currentWorkerIndex()],
+                nullptr, ranges ? m_pool.get() : nullptr});
+          } catch (...) {
+            m_failed = true;
+            throw;
+          }
+        });
+  }
+
+  // Whether large files read from sourceDevice may be copied in ranges.
+  // Ranges of one file on a spinning disk would only make it seek.
+  bool rangesAllowed(std::uint64_t sourceDevice) {
+    return m_parallelCopies && !rotational(sourceDevice) &&
+           !rotational(m_destinationDevice);
+  }
+
+  // Detected once per device. Only called from the planning thread.
+  bool rotational(std::uint64_t device) {
+    if (m_scheduler) {
+      return m_scheduler->rotational(device);
+    }
+    auto found = m_rotational.find(device);
+    if (found == m_rotational.end()) {
+      found = m_rotational
+                  .emplace(device, DeviceScheduler::isRotational(device))
+                  .first;
+    }
+    return found->second;
+  }
+
+  // Created on first use, as most runs never see a file that large.
+  ThreadPool *rangePool() {
+    if (!m_parallelCopies || m_copier) {
+      return nullptr;
+    }
+    if (!m_rangePool) {
+      unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+      m_rangePool =
+          std::make_unique<ThreadPool>(std::min(kRangeThreads, cores));
+    }
+    return m_rangePool.get();
+  }
+
+  bool m_parallelCopies;
+  std::map<std::uint64_t, bool> m_rotational;
+  SyncTracker m_durability;
+  Manifest *m_manifest;
+  std::unique_ptr<ThreadPool> m_rangePool;
+  std::unique_ptr<UringCopier> m_copier;
+  DirHandleCache m_directories;
+  std::unique_ptr<ThreadPool> m_pool;
+  std::vector<std::unique_ptr<DirHandleCache>> m_workerDirectories;
+  std::uint64_t m_destinationDevice = 0;
+  std::mutex m_mutex;
+  std::condition_variable m_slotFree;
+  size_t m_queued = 0;
+  size_t m_maxQueued = 0;
+  std::atomic<bool> m_failed{false};
+  std::mutex m_finalizeMutex;
+  std::condition_variable m_finalizeSlotFree;
+  size_t m_finalizing = 0;
+  // Declared last: their destructors wait for the tasks using the above.
+  // The transfers come after the finalizer, so they are waited for first;
+  // they may still hand it steps.
+  std::unique_ptr<ThreadPool> m_finalizePool;
+  std::unique_ptr<ThreadPool::TaskGroup> m_finalizeGroup;
+  std::unique_ptr<ThreadPool::TaskGroup> m_group;
+  std::unique_ptr<DeviceScheduler> m_scheduler;
+};
+
 void MergeManager::scanOnly(const ProcessOptions &options) {
   loadCustomRules(options.rulesFile);
 
-  if (!fs::exists(options.sourceA) || !fs::exists(options.sourceB)) {
-    std::cerr << "Error: One or both source folders do not exist." << std::endl;
+  if (!sourcesExist(options)) {
     return;
   }
 
   std::cout << "Scanning for all files..." << std::endl;
-  std::vector<fs::path> allFiles;
-  scanDirectory(options.sourceA, allFiles, options.includeHidden);
-  scanDirectory(options.sourceB, allFiles, options.includeHidden);
+  FileList allFiles;
+  ScanStats stats = scanSources(options, false, allFiles);
+  if (stats.usedExcludes) {
+    std::cout << "Excluded " << stats.prunedEntries
+              << " files and folders matching the exclude patterns."
+              << std::endl;
+  }
   std::cout << "Found " << allFiles.size()
             << " files. Identifying uncategorized files..." << std::endl;
 
+  // Classification only looks at the file name, so full paths are built
+  // just for the files that end up in the report.
   std::vector<fs::path> uncategorizedFiles;
-  for (const auto &filePath : allFiles) {
-    fs::path targetDir = getDestinationForFile(filePath, options.destination);
+  for (size_t i = 0; i < allFiles.size(); ++i) {
+    fs::path targetDir =
+        getDestinationForFile(fs::path(allFiles.name(i)), options.destination);
     if (targetDir.empty()) {
-      uncategorizedFiles.push_back(filePath);
+      uncategorizedFiles.push_back(allFiles.path(i));
     }
   }
 
@@ -103,6 +449,114 @@ void MergeManager::scanOnly(const ProcessOptions &options) {
             << options.scanFile << "' to create custom rules." << std::endl;
 }
 
+bool MergeManager::verify(const ProcessOptions &options) {
+  std::vector<Manifest::Entry> entries;
+  size_t badLines = 0;
+  if (!Manifest::read(options.manifestFile, entries, badLines)) {
+    std::cerr << "Error: Could not read manifest file: "
+              << options.manifestFile.string() << std::endl;
+    return false;
+  }
+  if (badLines > 0) {
+    std::cerr << "Warning: Skipped " << badLines
+              << " malformed lines in the manifest." << std::endl;
+  }
+  BufferPool::shared().configure(options.bufferMemory, options.hugePages);
+
+  long long totalSize = 0;
+  for (const auto &entry : entries) {
+    totalSize += static_cast<long long>(entry.size);
+  }
+  ProgressReporter reporter;
+  reporter.reportVerifyBegin(entries.size(), totalSize);
+  reporter.startProcessing();
+
+  // Only the destination is read; the source may be gone after a move.
+  auto check = [&reporter](const Manifest::Entry &entry) {
+    size_t progressId = reporter.startFile(
+        entry.destination, static_cast<long long>(entry.size));
+    std::uintmax_t size = 0;
+    std::error_code ec;
+    std::uint64_t hash = ContentHash::hashFile(
+        entry.destination, size,
+        [&reporter, progressId](long long bytes) {
+          reporter.updateFileProgress(progressId, bytes);
+        },
+        ec);
+    reporter.finishFile(progressId);
+    if (ec) {
+      reporter.reportMismatch(entry.destination, ec.message());
+    } else if (size != entry.size) {
+      reporter.reportMismatch(entry.destination,
+                              "size is " + std::to_string(size) +
+                                  " bytes, the manifest says " +
+                                  std::to_string(entry.size));
+    } else if (hash != entry.hash) {
+      reporter.reportMismatch(entry.destination,
+                              "contents differ from what was copied");
+    }
+  };
+  if (options.jobs > 1) {
+    ThreadPool pool(options.jobs);
+    ThreadPool::TaskGroup group(pool);
+    for (const auto &entry : entries) {
+      group.submit([&check, &entry] { check(entry); });
+    }
+    group.wait();
+  } else {
+    for (const auto &entry : entries) {
+      check(entry);
+    }
+  }
+  return reporter.finishVerify();
+}
+
+bool MergeManager::reflinkPossible(const ProcessOptions &options) {
+  if (options.operation != Operation::Copy ||
+      options.reflink != CopyEngine::Reflink::Always) {
+    return true;
+  }
+#ifdef _WIN32
+  std::cerr << "Error: --reflink=always is not supported on this platform."
+            << std::endl;
+  return false;
+#else
+  std::error_code ec;
+  fs::create_directories(options.destination, ec);
+  struct stat destination;
+  if (::stat(options.destination.c_str(), &destination) != 0) {
+    std::cerr << "Error: Cannot access destination folder: "
+              << options.destination.string() << std::endl;
+    return false;
+  }
+  for (const auto &source : options.sources) {
+    struct stat st;
+    if (::stat(source.c_str(), &st) != 0 || st.st_dev != destination.st_dev) {
+      std::cerr << "Error: --reflink=always needs every source on the same "
+                   "filesystem as the destination, but "
+                << source.string() << " is not." << std::endl;
+      return false;
+    }
+  }
+  return true;
+#endif
+}
+
+bool MergeManager::sourcesExist(const ProcessOptions &options) {
+  if (options.sources.empty()) {
+    std::cerr << "Error: No source folders given." << std::endl;
+    return false;
+  }
+  for (const auto &source : options.sources) {
+    if (!fs::exists(source)) {
+      std::cerr << "Error: Source folder does not exist: " << source.string()
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
 void MergeManager::loadCustomRules(const fs::path &rulesFilePath) {
   if (rulesFilePath.empty() || !fs::exists(rulesFilePath)) {
     return;
@@ -147,129 +601,515 @@ void MergeManager::loadCustomRules(const fs::path &rulesFilePath) {
   }
 }
 
-void MergeManager::scanDirectory(const fs::path &sourceDir,
-                                 std::vector<fs::path> &fileList,
-                                 bool includeHidden) {
-  for (const auto &entry : fs::recursive_directory_iterator(sourceDir)) {
-    if (fs::is_regular_file(entry.symlink_status())) {
-
-      if (!includeHidden && entry.path().filename().string()[0] == '.') {
-        continue;
-      }
-
-      fileList.push_back(entry.path());
-    }
+CopyEngine::Result MergeManager::copyFileWithProgress(
+    const DirHandle &fromDir, const std::string &fromName,
+    const DirHandle &toDir, const std::string &toName, std::uintmax_t size,
+    const CopyEngine::Options &engineOptions,
+    const std::function<void(long long)> &onProgress, std::error_code &ec) {
+#ifndef _WIN32
+  UniqueFd in(fromDir.openFile(fromName, O_RDONLY, ec));
+  if (!in.valid()) {
+    return CopyEngine::Result();
   }
-}
-
-void MergeManager::copyFileWithProgress(
-    const fs::path &from, const fs::path &to,
-    const std::function<void(long long)> &onProgress) {
-  const size_t bufferSize = 8192;
-  char buffer[bufferSize];
+  UniqueFd out(
+      toDir.openFile(toName, O_WRONLY | O_CREAT | O_TRUNC, ec, 0666));
+  if (!out.valid()) {
+    return CopyEngine::Result();
+  }
+  return CopyEngine(engineOptions)
+      .copy(in.get(), out.get(), size, onProgress, ec);
+#else
+  CopyEngine::Result result;
+  if (engineOptions.reflink == CopyEngine::Reflink::Always) {
+    ec = std::make_error_code(std::errc::operation_not_supported);
+    return result;
+  }
+  BufferPool::Lease buffer = BufferPool::shared().acquire(
+      static_cast<size_t>(std::min<std::uintmax_t>(
+          engineOptions.chunkSize, std::max<std::uintmax_t>(size, 1))));
   long long bytesCopied = 0;
 
-  std::ifstream in(from, std::ios::binary);
-  std::ofstream out(to, std::ios::binary);
+  std::ifstream in(fromDir.pathOf(fromName), std::ios::binary);
+  std::ofstream out(toDir.pathOf(toName), std::ios::binary);
+  ContentHash hash;
 
-  while (in.read(buffer, bufferSize)) {
-    out.write(buffer, in.gcount());
+  while (in.read(buffer.data(), buffer.size())) {
+    out.write(buffer.data(), in.gcount());
+    if (engineOptions.hash) {
+      hash.update(buffer.data(), static_cast<size_t>(in.gcount()));
+    }
     bytesCopied += in.gcount();
     onProgress(bytesCopied);
   }
-  out.write(buffer, in.gcount());
+  out.write(buffer.data(), in.gcount());
+  if (engineOptions.hash) {
+    hash.update(buffer.data(), static_cast<size_t>(in.gcount()));
+    result.hash = hash.digest();
+  }
   bytesCopied += in.gcount();
   onProgress(bytesCopied); // Final update
+  if (!out) {
+    ec = std::make_error_code(std::errc::io_error);
+  }
+  result.bytes = static_cast<std::uintmax_t>(bytesCopied);
+  return result;
+#endif
 }
 
 void MergeManager::process(const ProcessOptions &options) {
 
   loadCustomRules(options.rulesFile);
 
-  if (!fs::exists(options.sourceA) || !fs::exists(options.sourceB)) {
-    std::cerr << "Error: One or both source folders do not exist." << std::endl;
+  if (!sourcesExist(options) || !reflinkPossible(options)) {
+    return;
+  }
+  BufferPool::shared().configure(options.bufferMemory, options.hugePages);
+
+  // Opened before the scan, which may take long, so a bad path fails fast.
+  Manifest manifest;
+  if (!options.manifestFile.empty() && !manifest.open(options.manifestFile)) {
+    std::cerr << "Error: Could not create manifest file: "
+              << options.manifestFile.string() << std::endl;
     return;
   }
+  Manifest *manifestOut = manifest.isOpen() ? &manifest : nullptr;
 
   ProgressReporter reporter;
 
+  if (options.streaming) {
+    processStreaming(options, manifestOut, reporter);
+    return;
+  }
+
   reporter.reportScanBegin();
-  std::vector<fs::path> allFiles;
-  scanDirectory(options.sourceA, allFiles, options.includeHidden);
-  scanDirectory(options.sourceB, allFiles, options.includeHidden);
+  FileList allFiles;
+  ScanStats stats = scanSources(options, true, allFiles);
   long long totalSize = 0;
-  for (const auto &file : allFiles) {
-    totalSize += fs::file_size(file);
+  for (size_t i = 0; i < allFiles.size(); ++i) {
+    totalSize += allFiles.fileSize(i);
   }
   reporter.reportScanComplete(allFiles.size(), totalSize);
+  reporter.setFileListMemory(allFiles.memoryUsage(),
+                             allFiles.pathPerFileMemoryUsage());
+  if (stats.usedIndex) {
+    reporter.reportScanIndex(stats.reusedDirectories, stats.totalDirectories);
+  }
+  if (stats.usedExcludes) {
+    reporter.setPrunedEntries(stats.prunedEntries);
+  }
 
   reporter.startProcessing();
 
   try {
     fs::create_directories(options.destination);
-    for (const auto &filePath : allFiles) {
+    DestinationIndex destinations;
+    Transfers transfers(options, manifestOut);
+    for (size_t i = 0; i < allFiles.size() && !transfers.failed(); ++i) {
+      processFile(allFiles.record(i), options, destinations, transfers,
+                  reporter);
+    }
+    transfers.finish();
+    transfers.makeDurable(reporter);
+    closeManifest(manifestOut, options.manifestFile, reporter);
+    reporter.finishProcessing();
+  } catch (const fs::filesystem_error &e) {
+    std::cerr << "\nFatal error: " << e.what() << std::endl;
+  }
+}
 
-      fs::path targetDir;
-      fs::path destFile;
+void MergeManager::processStreaming(const ProcessOptions &options,
+                                    Manifest *manifest,
+                                    ProgressReporter &reporter) {
+  BoundedQueue<FileRecord> queue(kStreamingQueueCapacity);
+  std::atomic<size_t> filesFound{0};
+  std::atomic<long long> bytesFound{0};
+  std::exception_ptr scanError;
+  ScanStats stats;
 
-      if (options.noSort) {
-        fs::path sourceRoot;
+  // The walker runs on its own pool and feeds the queue while this thread
+  // classifies and copies. A full queue blocks the walker, so memory stays
+  // bounded no matter how large the sources are.
+  std::thread scanThread([&] {
+    try {
+      DirectoryScanner::BatchSink sink =
+          [&](std::vector<FileRecord> &&files) {
+            for (auto &file : files) {
+              filesFound.fetch_add(1, std::memory_order_relaxed);
+              bytesFound.fetch_add(static_cast<long long>(file.size),
+                                   std::memory_order_relaxed);
+              if (!queue.push(std::move(file))) {
+                return false;
+              }
+            }
+            return true;
+          };
+      stats = scanSources(options, true, sink);
+    } catch (...) {
+      scanError = std::current_exception();
+    }
+    queue.close();
+  });
 
-        if (filePath.string().find(options.sourceA.string()) == 0) {
-          sourceRoot = options.sourceA;
-        } else {
-          sourceRoot = options.sourceB;
-        }
+  // Whatever happens below, stop the walker and wait for it before the
+  // queue goes out of scope.
+  struct ScanThreadGuard {
+    BoundedQueue<FileRecord> &queue;
+    std::thread &thread;
+    ~ScanThreadGuard() {
+      queue.close();
+      if (thread.joinable()) {
+        thread.join();
+      }
+    }
+  } guard{queue, scanThread};
 
-        fs::path relativePath = fs::relative(filePath, sourceRoot);
-        destFile = options.destination / relativePath;
+  reporter.startEstimatedProcessing();
 
-        fs::create_directories(destFile.parent_path());
+  try {
+    fs::create_directories(options.destination);
+    DestinationIndex destinations;
+    Transfers transfers(options, manifest);
+    FileRecord file;
+    while (!transfers.failed() && queue.pop(file)) {
+      reporter.updateScanEstimate(filesFound.load(), bytesFound.load());
+      processFile(file, options, destinations, transfers, reporter);
+    }
+    transfers.finish();
+    transfers.makeDurable(reporter);
+    closeManifest(manifest, options.manifestFile, reporter);
+    scanThread.join();
+    if (scanError) {
+      std::rethrow_exception(scanError);
+    }
+    reporter.finishScanEstimate(filesFound.load(), bytesFound.load());
+    if (stats.usedExcludes) {
+      reporter.setPrunedEntries(stats.prunedEntries);
+    }
+    reporter.finishProcessing();
+    if (stats.usedIndex) {
+      reporter.reportScanIndex(stats.reusedDirectories,
+                               stats.totalDirectories);
+    }
+  } catch (const fs::filesystem_error &e) {
+    std::cerr << "\nFatal error: " << e.what() << std::endl;
+  }
+}
 
-        if (fs::exists(destFile)) {
-          reporter.reportFileProcessed(filePath);
-          continue;
-        }
+void MergeManager::processFile(const FileRecord &file,
+                               const ProcessOptions &options,
+                               DestinationIndex &destinations,
+                               Transfers &transfers,
+                               ProgressReporter &reporter) {
+  fs::path destFile =
+      planFile(file, options, destinations, transfers, reporter);
+  if (destFile.empty()) {
+    return;
+  }
+  auto transfer = [this, file, destFile = std::move(destFile), &options,
+                   &reporter](const TransferContext &context) {
+    transferFile(file, destFile, options, context, reporter);
+  };
+  transfers.run(file.device, std::move(transfer));
+}
+
+fs::path MergeManager::planFile(const FileRecord &file,
+                                const ProcessOptions &options,
+                                DestinationIndex &destinations,
+                                Transfers &transfers,
+                                ProgressReporter &reporter) {
+  const fs::path &filePath = file.path;
+
+  fs::path targetDir;
+  fs::path destFile;
+
+  if (options.noSort) {
+    // The scanner builds every path as root / relative, so the relative
+    // part can be recovered lexically without touching the disk.
+    const fs::path &sourceRoot = options.sources[file.sourceIndex];
+    fs::path relativePath = filePath.lexically_relative(sourceRoot);
+    destFile = options.destination / relativePath;
+
+    if (!destinations.claim(destFile.parent_path(), destFile.filename())) {
+      reporter.reportFileProcessed(file.size);
+      return fs::path();
+    }
+  } else {
+    targetDir = getDestinationForFile(filePath, options.destination);
+    if (targetDir.empty()) {
+      // Let running transfers finish so the prompt is not drawn over.
+      transfers.finish();
+      targetDir = reporter.promptForUnknownFile(
+          filePath, options.destination, m_userRules, m_customRules);
+    }
+
+    if (options.skipDuplicates) {
+      destFile = targetDir / filePath.filename();
+      if (!destinations.claim(targetDir, filePath.filename())) {
+        reporter.reportFileProcessed(file.size);
+        return fs::path();
+      }
+    } else {
+      destFile = destinations.claimUnique(targetDir, filePath.filename());
+    }
+  }
+  return destFile;
+}
+
+void MergeManager::transferFile(const FileRecord &file,
+                                const fs::path &destFile,
+                                const ProcessOptions &options,
+                                const TransferContext &context,
+                                ProgressReporter &reporter) {
+  const fs::path &filePath = file.path;
+  DirHandleCache &directories = context.directories;
+  UringCopier *copier = context.copier;
+  std::error_code ec;
+  bool reflinkFailed = false;
+  try {
+    // Both sides work relative to cached folder handles, so only the file
+    // names are resolved per file.
+    std::shared_ptr<DirHandle> fromDir =
+        directories.get(filePath.parent_path(), false);
+    std::shared_ptr<DirHandle> toDir =
+        directories.get(destFile.parent_path(), true);
+    const std::string fromName = filePath.filename().string();
+    const std::string toName = destFile.filename().string();
+
+    bool copy = options.operation == Operation::Copy;
+    // Where a move that has to copy writes first.
+    std::string tempName;
+    if (options.operation == Operation::Link) {
+      fromDir->link(fromName, *toDir, toName, ec);
+      if (ec == std::errc::cross_device_link) {
+        // Hard links cannot cross filesystems.
+        ec.clear();
+        reporter.reportLinkFallback();
+        copy = true;
       } else {
-        targetDir = getDestinationForFile(filePath, options.destination);
-        if (targetDir.empty()) {
-          targetDir = reporter.promptForUnknownFile(
-              filePath, options.destination, m_userRules, m_customRules);
+        reporter.reportFileProcessed(file.size);
+        if (!ec) {
+          context.transfers.durability().entryChanged(*toDir);
         }
-        fs::create_directories(targetDir);
-
-        if (options.skipDuplicates) {
-          destFile = targetDir / filePath.filename();
-          if (fs::exists(destFile)) {
-            reporter.reportFileProcessed(filePath);
-            continue;
-          }
-        } else {
-          destFile = getUniquePath(targetDir / filePath.filename());
+      }
+    } else if (options.operation == Operation::Move) {
+      fromDir->rename(fromName, *toDir, toName, ec);
+      if (ec == std::errc::cross_device_link) {
+        // Neither can renames: copy under a hidden name, and let a
+        // finalizer thread publish it and remove the source.
+        ec.clear();
+        tempName = "." + toName + ".ekatra-part";
+        copy = true;
+      } else {
+        reporter.reportFileProcessed(file.size);
+        if (!ec) {
+          context.transfers.durability().entryChanged(*toDir);
+          context.transfers.durability().entryChanged(*fromDir);
         }
       }
-
-      std::error_code ec;
-      if (options.operation == Operation::Copy) {
-        reporter.startFile(filePath);
-        copyFileWithProgress(filePath, destFile, [&](long long bytes) {
-          reporter.updateFileProgress(bytes);
+    }
+    Manifest *manifest = context.transfers.manifest();
+    if (copy && copier != nullptr && copier->valid() &&
+        options.reflink != CopyEngine::Reflink::Always) {
+      startAsyncCopy(file, *fromDir, fromName, toDir, toName, options,
+                     *copier, context.transfers.durability(), manifest,
+                     reporter, ec);
+    } else if (copy) {
+      size_t progressId = reporter.startFile(filePath, file.size);
+      CopyEngine::Options engineOptions;
+      engineOptions.reflink = options.reflink;
+      engineOptions.pool = context.rangePool;
+      engineOptions.parallelThreshold = options.parallelCopyThreshold;
+      engineOptions.directIo = options.directIo;
+      engineOptions.hash = manifest != nullptr;
+      const std::string &copyName = tempName.empty() ? toName : tempName;
+      CopyEngine::Result result = copyFileWithProgress(
+          *fromDir, fromName, *toDir, copyName, file.size, engineOptions,
+          [&](long long bytes) {
+            reporter.updateFileProgress(progressId, bytes);
+          },
+          ec);
+      if (!ec && result.method == CopyEngine::Method::Reflink) {
+        reporter.reportReflinked(static_cast<long long>(result.bytes));
+      } else if (!ec && options.directIo &&
+                 file.size >= engineOptions.directIoThreshold &&
+                 result.method != CopyEngine::Method::Direct) {
+        reporter.reportCachedCopy();
+      }
+      reporter.finishFile(progressId);
+      if (ec && (options.reflink == CopyEngine::Reflink::Always ||
+                 !tempName.empty())) {
+        // Don't leave the empty or partial target behind.
+        std::error_code ignored;
+        toDir->remove(copyName, ignored);
+        reflinkFailed = options.reflink == CopyEngine::Reflink::Always;
+      } else if (!ec && tempName.empty()) {
+        if (manifest != nullptr) {
+          manifest->add({filePath, destFile, result.bytes, result.hash});
+        }
+        context.transfers.durability().fileWritten(*toDir, toName,
+                                                   result.bytes, ec);
+      } else if (!tempName.empty()) {
+        Manifest::Entry entry{filePath, destFile, result.bytes, result.hash};
+        context.transfers.finalize([fromDir, fromName, toDir, tempName,
+                                    toName, manifest, entry, &reporter] {
+          if (completeMove(entry.source, fromDir, fromName, toDir, tempName,
+                           toName, reporter) &&
+              manifest != nullptr) {
+            manifest->add(entry);
+          }
         });
-        reporter.finishFile();
-      } else { // Operation::Move
-        reporter.reportFileProcessed(filePath);
-        fs::rename(filePath, destFile, ec);
       }
+    }
+  } catch (const fs::filesystem_error &e) {
+    ec = e.code();
+  }
+
+  if (reflinkFailed) {
+    // --reflink=always: stop rather than copy the remaining files.
+    throw fs::filesystem_error("cannot reflink", filePath, destFile, ec);
+  }
+  if (ec) {
+    reporter.reportFileError(filePath, ec);
+  }
+}
+
+bool MergeManager::completeMove(const fs::path &filePath,
+                                const std::shared_ptr<DirHandle> &fromDir,
+                                const std::string &fromName,
+                                const std::shared_ptr<DirHandle> &toDir,
+                                const std::string &tempName,
+                                const std::string &toName,
+                                ProgressReporter &reporter) {
+  std::error_code ec;
+  toDir->syncFile(tempName, ec);
+  if (!ec) {
+    toDir->rename(tempName, *toDir, toName, ec);
+  }
+  if (!ec) {
+    toDir->sync(ec);
+  }
+  if (ec) {
+    // The source is still there; only the copy goes.
+    std::error_code ignored;
+    toDir->remove(tempName, ignored);
+    reporter.reportFileError(filePath, ec);
+    return false;
+  }
+  fromDir->remove(fromName, ec);
+  if (ec) {
+    reporter.reportFileError(filePath, ec);
+  }
+  return true;
+}
 
-      if (ec) {
-        std::cerr << "\nError processing " << filePath.string() << ": "
-                  << ec.message() << std::endl;
+void MergeManager::startAsyncCopy(const FileRecord &file,
+                                  const DirHandle &fromDir,
+                                  const std::string &fromName,
+                                  const std::shared_ptr<DirHandle> &toDir,
+                                  const std::string &toName,
+                                  const ProcessOptions &options,
+                                  UringCopier &copier,
+                                  SyncTracker &durability, Manifest *manifest,
+                                  ProgressReporter &reporter,
+                                  std::error_code &ec) {
+#ifndef _WIN32
+  UniqueFd in(fromDir.openFile(fromName, O_RDONLY, ec));
+  if (!in.valid()) {
+    return;
+  }
+  UniqueFd out(
+      toDir->openFile(toName, O_WRONLY | O_CREAT | O_TRUNC, ec, 0666));
+  if (!out.valid()) {
+    return;
+  }
+
+  size_t progressId = reporter.startFile(file.path, file.size);
+  fs::path filePath = file.path;
+  fs::path destFile = toDir->pathOf(toName);
+  std::uintmax_t cloned = 0;
+  std::error_code cloneError;
+  if (options.reflink == CopyEngine::Reflink::Auto &&
+      CopyEngine::clone(in.get(), out.get(), cloned, cloneError)) {
+    // Nothing to copy, but the hash still needs the bytes.
+    reporter.reportReflinked(static_cast<long long>(cloned));
+    if (manifest != nullptr) {
+      std::uint64_t hash = ContentHash::hashDescriptor(
+          in.get(), cloned, [](long long) {}, ec);
+      if (!ec) {
+        manifest->add({filePath, destFile, cloned, hash});
       }
     }
-    reporter.finishProcessing();
-  } catch (const fs::filesystem_error &e) {
-    std::cerr << "\nFatal error: " << e.what() << std::endl;
+    reporter.finishFile(progressId);
+    if (!ec) {
+      durability.fileWritten(*toDir, toName, cloned, ec);
+    }
+    return;
   }
+  if (CopyEngine::isSparse(in.get())) {
+    // The ring would write the holes out as zeros.
+    CopyEngine::Options engineOptions;
+    engineOptions.reflink = CopyEngine::Reflink::Never;
+    engineOptions.hash = manifest != nullptr;
+    CopyEngine::Result result = CopyEngine(engineOptions).copy(
+        in.get(), out.get(), file.size,
+        [&reporter, progressId](long long bytes) {
+          reporter.updateFileProgress(progressId, bytes);
+        },
+        ec);
+    reporter.finishFile(progressId);
+    if (!ec && manifest != nullptr) {
+      manifest->add({filePath, destFile, result.bytes, result.hash});
+    }
+    if (!ec) {
+      durability.fileWritten(*toDir, toName, result.bytes, ec);
+    }
+    return;
+  }
+  if (file.size >= CopyEngine::kPreallocateThreshold) {
+    CopyEngine::preallocate(out.get(), file.size);
+  }
+  CopyEngine::adviseSequential(in.get());
+
+  UringCopier::Callbacks callbacks;
+  callbacks.onProgress = [&reporter, progressId](long long bytes) {
+    reporter.updateFileProgress(progressId, bytes);
+  };
+  std::shared_ptr<ContentHash> hash;
+  if (manifest != nullptr) {
+    hash = std::make_shared<ContentHash>();
+    callbacks.onData = [hash](const char *data, size_t size) {
+      hash->update(data, size);
+    };
+  }
+  callbacks.onDone = [&reporter, &durability, progressId, filePath, destFile,
+                      toDir, toName, manifest,
+                      hash](std::uintmax_t bytes, std::error_code copyError) {
+    reporter.finishFile(progressId);
+    if (!copyError && manifest != nullptr) {
+      manifest->add({filePath, destFile, bytes, hash->digest()});
+    }
+    if (!copyError) {
+      durability.fileWritten(*toDir, toName, bytes, copyError);
+    }
+    if (copyError) {
+      reporter.reportFileError(filePath, copyError);
+    }
+  };
+  copier.submit(std::move(in), std::move(out), file.size,
+                std::move(callbacks));
+#else
+  (void)file;
+  (void)fromDir;
+  (void)fromName;
+  (void)toDir;
+  (void)toName;
+  (void)options;
+  (void)copier;
+  (void)durability;
+  (void)manifest;
+  (void)reporter;
+  ec = std::make_error_code(std::errc::function_not_supported);
+#endif
 }
 
 fs::path MergeManager::getDestinationForFile(const fs::path &file,
@@ -298,17 +1138,3 @@ fs::path MergeManager::getDestinationForFile(const fs::path &file,
   }
   return fs::path();
 }
-
-fs::path MergeManager::getUniquePath(const fs::path &targetPath) {
-  if (!fs::exists(targetPath))
-    return targetPath;
-  fs::path newPath = targetPath;
-  const std::string stem = targetPath.stem().string();
-  const std::string extension = targetPath.extension().string();
-  int counter = 1;
-  while (fs::exists(newPath)) {
-    newPath = targetPath.parent_path() /
-              (stem + "_" + std::to_string(counter++) + extension);
-  }
-  return newPath;
-}
@@ -1,23 +1,81 @@
 #pragma once
 
+#include "src/CopyEngine/CopyEngine.h"
+#include "src/FileRecord/FileRecord.h"
+#include "src/SyncTracker/SyncTracker.h"
 #include <filesystem>
 #include <functional>
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+class DestinationIndex;
+class DirHandle;
+class DirHandleCache;
+class Manifest;
+class ProgressReporter;
+class ThreadPool;
+class UringCopier;
+
 struct ProcessOptions {
-  fs::path sourceA;
-  fs::path sourceB;
+  // Folders to merge. Files of earlier sources are planned first, so they
+  // keep their names when later sources contain duplicates. Not with
+  // streaming: files are planned in the order the parallel scan finds
+  // them, so which duplicate keeps its name may differ between runs.
+  std::vector<fs::path> sources;
   fs::path destination;
-  enum class Operation { Copy, Move } operation = Operation::Copy;
+  // Link fills the destination with hard links to the source files; files
+  // on another filesystem than the destination are copied instead.
+  enum class Operation { Copy, Move, Link } operation = Operation::Copy;
+  // Whether copies may share data with their source (btrfs, XFS).
+  CopyEngine::Reflink reflink = CopyEngine::Reflink::Auto;
   bool verbose = false;
   bool skipDuplicates = false;
   bool includeHidden = false;
   bool noSort = false;
+  // Number of threads used to walk the sources; 0 uses every hardware thread.
+  unsigned scanThreads = 0;
+  // Batch each directory's stat calls through io_uring where available.
+  bool ioUringScan = false;
+  // Copy through io_uring with up to filesInFlight files at once.
+  bool ioUringCopy = false;
+  unsigned filesInFlight = 16;
+  // Worker threads that copy, move or link files; 1 does it all on the
+  // calling thread. Destinations are still decided there, in order.
+  unsigned jobs = 1;
+  // Run a queue per source device and cap the files in flight per source
+  // and destination device by its kind (see DeviceScheduler). Uses jobs
+  // worker threads when more than 1 is given.
+  bool deviceQueues = false;
+  // Files of at least this size are copied in ranges by several threads,
+  // unless either end is a spinning disk; 0 disables it.
+  std::uintmax_t parallelCopyThreshold = 1024ull * 1024 * 1024;
+  // Memory all copy buffers together may use, and whether to back them
+  // with huge pages.
+  size_t bufferMemory = 256 * 1024 * 1024;
+  bool hugePages = false;
+  // Copy large files around the page cache (O_DIRECT); files on
+  // filesystems that refuse it are copied normally.
+  bool directIo = false;
+  // How the copies are made to survive a crash (see SyncTracker).
+  SyncTracker::Policy durability = SyncTracker::Policy::Batch;
+  // process() writes the hash of every file it copies here (see Manifest);
+  // verify() checks the destinations against it. Empty writes none.
+  fs::path manifestFile;
+  // Start copying while the sources are still being scanned. Duplicates
+  // are then renamed in the order they are found, not in source order.
+  bool streaming = false;
+  // Cache of directory listings that makes repeated scans incremental;
+  // empty disables it.
+  fs::path scanIndexFile;
+  // Glob patterns of files and folders to leave out (see ExcludeMatcher),
+  // and a file with one pattern per line.
+  std::vector<std::string> excludePatterns;
+  fs::path excludeFile;
   std::string rulesFile;
   std::string scanFile;
 };
@@ -30,19 +88,87 @@ public:
 
   void scanOnly(const ProcessOptions &options);
 
+  // Re-reads every destination listed in options.manifestFile and compares
+  // its size and hash. Returns true when all of them match.
+  bool verify(const ProcessOptions &options);
+
   fs::path getDestinationForFile(const fs::path &file,
                                  const fs::path &destBaseDir);
 
 private:
-  void scanDirectory(const fs::path &sourceDir, std::vector<fs::path> &fileList,
-                     bool includeHidden);
+  // Carries out planned transfers: inline, through the io_uring copier or
+  // on worker threads (--jobs).
+  class Transfers;
 
-  void copyFileWithProgress(const fs::path &from, const fs::path &to,
-                            const std::function<void(long long)> &onProgress);
+  void processStreaming(const ProcessOptions &options, Manifest *manifest,
+                        ProgressReporter &reporter);
 
-  void loadCustomRules(const fs::path &rulesFilePath);
+  // Plans the copy, move or link of a single file and hands it to
+  // transfers, which may still be running it when this returns.
+  void processFile(const FileRecord &file, const ProcessOptions &options,
+                   DestinationIndex &destinations, Transfers &transfers,
+                   ProgressReporter &reporter);
+
+  // Decides where file goes and claims that name. Returns an empty path
+  // when the file is skipped as a duplicate. Always runs on the main
+  // thread, so duplicates are renamed in source order.
+  fs::path planFile(const FileRecord &file, const ProcessOptions &options,
+                    DestinationIndex &destinations, Transfers &transfers,
+                    ProgressReporter &reporter);
+
+  // What a transfer may use on the thread it runs on.
+  struct TransferContext {
+    Transfers &transfers;
+    DirHandleCache &directories;
+    // Set when copies go through io_uring.
+    UringCopier *copier;
+    // Workers for range-parallel copies of large files, if any.
+    ThreadPool *rangePool;
+  };
+
+  // Copies, moves or links file to destFile. Safe to run on any thread, as
+  // long as the context belongs to that thread.
+  void transferFile(const FileRecord &file, const fs::path &destFile,
+                    const ProcessOptions &options,
+                    const TransferContext &context,
+                    ProgressReporter &reporter);
 
-  fs::path getUniquePath(const fs::path &targetPath);
+  // Second half of a move across filesystems, once the source has been
+  // copied to tempName: flushes the copy, renames it to toName, flushes the
+  // folder and only then removes the source. A crash at any point leaves a
+  // complete file at the source or the destination. Returns whether the
+  // copy took the destination's name.
+  static bool completeMove(const fs::path &filePath,
+                           const std::shared_ptr<DirHandle> &fromDir,
+                           const std::string &fromName,
+                           const std::shared_ptr<DirHandle> &toDir,
+                           const std::string &tempName,
+                           const std::string &toName,
+                           ProgressReporter &reporter);
+
+  // Hands the copy to copier; sets ec when the files cannot be opened.
+  // toDir is kept open until the copy is done.
+  void startAsyncCopy(const FileRecord &file, const DirHandle &fromDir,
+                      const std::string &fromName,
+                      const std::shared_ptr<DirHandle> &toDir,
+                      const std::string &toName,
+                      const ProcessOptions &options, UringCopier &copier,
+                      SyncTracker &durability, Manifest *manifest,
+                      ProgressReporter &reporter, std::error_code &ec);
+
+  CopyEngine::Result
+  copyFileWithProgress(const DirHandle &fromDir, const std::string &fromName,
+                       const DirHandle &toDir, const std::string &toName,
+                       std::uintmax_t size,
+                       const CopyEngine::Options &engineOptions,
+                       const std::function<void(long long)> &onProgress,
+                       std::error_code &ec);
+
+  bool sourcesExist(const ProcessOptions &options);
+  // --reflink=always: every source must share the destination's filesystem.
+  bool reflinkPossible(const ProcessOptions &options);
+
+  void loadCustomRules(const fs::path &rulesFilePath);
 
   // This map stores user-defined rules for unknown file extensions.
   std::map<std::string, fs::path> m_userRules;
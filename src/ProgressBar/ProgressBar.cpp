@@ -4,13 +4,22 @@
 
 void ProgressBar::start(long long total, std::string label) {
   m_total = total;
+  m_estimated = false;
   m_label = std::move(label);
 }
 
+void ProgressBar::setTotal(long long total, bool estimated) {
+  m_total = total;
+  m_estimated = estimated;
+}
+
 std::string ProgressBar::getString(long long current) {
   const int BAR_WIDTH = 50;
   float percentage =
       (m_total == 0) ? 1.0f : static_cast<float>(current) / m_total;
+  if (percentage > 1.0f) {
+    percentage = 1.0f;
+  }
   int pos = static_cast<int>(BAR_WIDTH * percentage);
 
   std::stringstream ss;
@@ -21,8 +30,10 @@ std::string ProgressBar::getString(long long current) {
     else
       ss << " ";
   }
-  ss << "] " << std::fixed << std::setprecision(1) << percentage * 100.0
-     << "% (" << formatBytes(current) << " / " << formatBytes(m_total) << ")";
+  const char *approx = m_estimated ? "~" : "";
+  ss << "] " << approx << std::fixed << std::setprecision(1)
+     << percentage * 100.0 << "% (" << formatBytes(current) << " / " << approx
+     << formatBytes(m_total) << ")" << m_note;
   return ss.str();
 }
 
@@ -6,6 +6,11 @@
 class ProgressBar {
 public:
   void start(long long total, std::string label);
+  // Updates the total of a running bar. An estimated total is shown with a
+  // '~' until the real total is known.
+  void setTotal(long long total, bool estimated);
+  // Extra text shown after the byte counts.
+  void setNote(std::string note) { m_note = std::move(note); }
   std::string getString(long long current);
 
   // Helper function to format bytes into a human-readable string.
@@ -13,5 +18,7 @@ public:
 
 private:
   long long m_total = 0;
+  bool m_estimated = false;
   std::string m_label;
+  std::string m_note;
 };
@@ -1,5 +1,6 @@
 #include "ProgressReporter.h"
 #include <iomanip>
+#include <iterator>
 #include <limits>
 #include <sstream>
 
@@ -14,16 +15,60 @@ void ProgressReporter::reportScanComplete(size_t fileCount,
             << ProgressBar::formatBytes(totalSize) << ")." << std::endl;
 }
 
+void ProgressReporter::reportScanIndex(size_t reusedDirectories,
+                                       size_t totalDirectories) {
+  std::cout << "Scan index: reused " << reusedDirectories << " of "
+            << totalDirectories << " directory listings." << std::endl;
+}
+
+void ProgressReporter::setFileListMemory(size_t usedBytes,
+                                         size_t pathPerFileBytes) {
+  m_fileListBytes = usedBytes;
+  m_pathPerFileBytes = pathPerFileBytes;
+}
+
+void ProgressReporter::setPrunedEntries(size_t count) {
+  m_reportPruned = true;
+  m_prunedEntries = count;
+}
+
 void ProgressReporter::startProcessing() {
   m_overallBar.start(m_totalSize, "Total Progress");
   draw();
 }
 
-void ProgressReporter::startFile(const fs::path &path) {
-  m_fileSize = fs::file_size(path);
-  m_fileBytesProcessed = 0;
-  m_isCopyingFile = true;
+void ProgressReporter::startEstimatedProcessing() {
+  std::cout << "Scanning and processing at the same time; the total is an "
+               "estimate until the scan finishes."
+            << std::endl;
+  m_totalIsEstimate = true;
+  m_overallBar.start(0, "Total Progress");
+  m_overallBar.setTotal(0, true);
+  draw();
+}
+
+void ProgressReporter::updateScanEstimate(size_t fileCount,
+                                          long long totalSize) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!m_totalIsEstimate) {
+    return;
+  }
+  m_fileCount = fileCount;
+  m_totalSize = totalSize;
+  m_overallBar.setTotal(totalSize, true);
+}
+
+void ProgressReporter::finishScanEstimate(size_t fileCount,
+                                          long long totalSize) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_totalIsEstimate = false;
+  m_fileCount = fileCount;
+  m_totalSize = totalSize;
+  m_overallBar.setTotal(totalSize, false);
+}
 
+size_t ProgressReporter::startFile(const fs::path &path, long long size) {
+  std::lock_guard<std::mutex> lock(m_mutex);
   std::string filename = path.filename().string();
 
   const int LABEL_WIDTH = 15;
@@ -36,29 +81,90 @@ void ProgressReporter::startFile(const fs::path &path) {
 
   std::stringstream ss;
   ss << std::left << std::setw(LABEL_WIDTH) << filename;
-  std::string fileLabel = ss.str();
-
-  m_fileBar.start(m_fileSize, fileLabel);
 
-  std::cout << std::endl;
+  if (m_activeFiles.empty()) {
+    std::cout << std::endl;
+  }
+  size_t file = m_nextFile++;
+  m_activeFiles[file] = ActiveFile{size, 0, ss.str()};
+  showFile(file);
 
   draw();
+  return file;
+}
+
+void ProgressReporter::showFile(size_t file) {
+  const ActiveFile &active = m_activeFiles.at(file);
+  m_shownFile = file;
+  m_fileBar.start(active.size, active.label);
 }
 
-void ProgressReporter::updateFileProgress(long long bytes) {
-  m_fileBytesProcessed = bytes;
+void ProgressReporter::updateFileProgress(size_t file, long long bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ActiveFile &active = m_activeFiles.at(file);
+  m_activeBytes += bytes - active.bytes;
+  active.bytes = bytes;
   draw();
 }
 
-void ProgressReporter::finishFile() {
-  m_processedSize += m_fileSize;
-  m_isCopyingFile = false;
+void ProgressReporter::reportReflinked(long long size) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_reflinkedBytes += size;
+  m_overallBar.setNote(", " + ProgressBar::formatBytes(m_reflinkedBytes) +
+                       " reflinked");
+}
+
+void ProgressReporter::reportLinkFallback() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ++m_linkFallbacks;
+}
+
+void ProgressReporter::reportCachedCopy() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ++m_cachedCopies;
+}
+
+void ProgressReporter::reportSync(size_t files,
+                                  std::chrono::steady_clock::duration elapsed) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_reportSync = true;
+  m_syncedFiles = files;
+  m_syncTime = elapsed;
+}
+
+void ProgressReporter::reportManifest(size_t files, const fs::path &path) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_manifestFiles = files;
+  m_manifestPath = path;
+}
+
+void ProgressReporter::reportFileError(const fs::path &path,
+                                       const std::error_code &ec) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::cerr << "\nError processing " << path.string() << ": " << ec.message()
+            << std::endl;
+}
+
+void ProgressReporter::finishFile(size_t file) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto found = m_activeFiles.find(file);
+  m_processedSize += found->second.size;
+  m_copiedBytes += found->second.size;
+  m_activeBytes -= found->second.bytes;
+  m_activeFiles.erase(found);
+  if (!m_activeFiles.empty()) {
+    if (file == m_shownFile) {
+      showFile(std::prev(m_activeFiles.end())->first);
+    }
+    draw();
+    return;
+  }
+
   // 1. Move the cursor up to the "Overall" progress line.
   std::cout << "\x1B[A";
 
   // 2. Clear the "Overall" line and redraw it with the latest progress.
-  std::cout << "\r\x1B[K"
-            << m_overallBar.getString(m_processedSize + m_fileBytesProcessed);
+  std::cout << "\r\x1B[K" << m_overallBar.getString(m_processedSize);
 
   // 3. Move the cursor down to the now-obsolete "File" progress line.
   std::cout << std::endl;
@@ -73,36 +179,124 @@ void ProgressReporter::finishFile() {
   std::cout.flush(); // Ensure changes are written to the console.
 }
 
-void ProgressReporter::reportFileProcessed(const fs::path &path) {
-  m_processedSize += fs::file_size(path);
+void ProgressReporter::reportFileProcessed(long long size) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_processedSize += size;
   draw();
 }
 
 void ProgressReporter::finishProcessing() {
+  std::lock_guard<std::mutex> lock(m_mutex);
   draw(); // Final update to 100%
   std::cout << std::endl;
+  if (m_fileCount > 0) {
+    std::cout << "Scan found " << m_fileCount << " files ("
+              << ProgressBar::formatBytes(m_totalSize) << ")." << std::endl;
+  }
+  if (m_reflinkedBytes > 0) {
+    std::cout << "Reflinked " << ProgressBar::formatBytes(m_reflinkedBytes)
+              << " of " << ProgressBar::formatBytes(m_copiedBytes)
+              << " copied; those files share their data with the source."
+              << std::endl;
+  }
+  if (m_linkFallbacks > 0) {
+    std::cout << m_linkFallbacks
+              << " files are on another filesystem than the destination and "
+                 "were copied instead of linked."
+              << std::endl;
+  }
+  if (m_cachedCopies > 0) {
+    std::cout << m_cachedCopies
+              << " files are on a filesystem without direct I/O and were "
+                 "copied through the page cache."
+              << std::endl;
+  }
+  if (m_reportSync) {
+    std::cout << "Syncing to disk took " << std::fixed << std::setprecision(2)
+              << std::chrono::duration<double>(m_syncTime).count() << " s";
+    if (m_syncedFiles > 0) {
+      std::cout << " (" << m_syncedFiles << " files)";
+    }
+    std::cout << "." << std::defaultfloat << std::endl;
+  }
+  if (!m_manifestPath.empty()) {
+    std::cout << "Wrote the hashes of " << m_manifestFiles
+              << " copied files to " << m_manifestPath.string() << "."
+              << std::endl;
+  }
+  if (m_reportPruned) {
+    std::cout << "Excluded " << m_prunedEntries
+              << " files and folders matching the exclude patterns."
+              << std::endl;
+  }
+  if (m_fileListBytes > 0) {
+    long long saved = static_cast<long long>(m_pathPerFileBytes) -
+                      static_cast<long long>(m_fileListBytes);
+    std::cout << "File list memory: "
+              << ProgressBar::formatBytes(
+                     static_cast<long long>(m_fileListBytes))
+              << " (saved about "
+              << ProgressBar::formatBytes(saved > 0 ? saved : 0)
+              << " over storing a full path per file)." << std::endl;
+  }
   std::cout << "\n Merge operation completed successfully!" << std::endl;
 }
 
+void ProgressReporter::reportVerifyBegin(size_t fileCount,
+                                         long long totalSize) {
+  m_fileCount = fileCount;
+  m_totalSize = totalSize;
+  std::cout << "Verifying " << fileCount << " files ("
+            << ProgressBar::formatBytes(totalSize)
+            << ") against the manifest." << std::endl;
+}
+
+void ProgressReporter::reportMismatch(const fs::path &path,
+                                      const std::string &problem) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ++m_mismatches;
+  std::cerr << "\nMismatch in " << path.string() << ": " << problem
+            << std::endl;
+}
+
+bool ProgressReporter::finishVerify() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  draw();
+  std::cout << std::endl;
+  if (m_mismatches == 0) {
+    std::cout << "All " << m_fileCount << " files match the manifest."
+              << std::endl;
+    return true;
+  }
+  std::cout << m_mismatches << " of " << m_fileCount
+            << " files do not match the manifest." << std::endl;
+  return false;
+}
+
 void ProgressReporter::draw() {
   // To avoid flickering, only redraw periodically.
   auto now = std::chrono::steady_clock::now();
   if (std::chrono::duration_cast<std::chrono::milliseconds>(now -
                                                             m_lastDrawTime)
               .count() < 50 &&
-      m_processedSize + m_fileBytesProcessed < m_totalSize) {
+      (m_totalIsEstimate ||
+       m_processedSize + m_activeBytes < m_totalSize)) {
     return;
   }
   m_lastDrawTime = now;
 
-  if (m_isCopyingFile) {
+  if (!m_activeFiles.empty()) {
     // For a stable two-line display, move cursor up, clear line, draw, repeat.
     std::cout << "\x1B[A";   // ANSI escape code to move cursor up one line
     std::cout << "\r\x1B[K"; // Carriage return and clear line
-    std::cout << m_overallBar.getString(m_processedSize + m_fileBytesProcessed);
+    std::cout << m_overallBar.getString(m_processedSize + m_activeBytes);
     std::cout << std::endl;
     std::cout << "\r\x1B[K"; // Carriage return and clear line
-    std::cout << m_fileBar.getString(m_fileBytesProcessed);
+    m_fileBar.setNote(m_activeFiles.size() > 1
+                          ? " +" + std::to_string(m_activeFiles.size() - 1) +
+                                " more"
+                          : std::string());
+    std::cout << m_fileBar.getString(m_activeFiles.at(m_shownFile).bytes);
   } else {
     // For single-line display, just use carriage return.
     std::cout << "\r\x1B[K"; // Carriage return and clear line
@@ -5,38 +5,106 @@
 #include <filesystem>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <system_error>
 
 namespace fs = std::filesystem;
 
 // Manages all console output, including progress bars and user prompts.
+//
+// The per-file calls (startFile through reportFileError) and
+// updateScanEstimate may come from several threads at once; the rest is
+// called from the main thread while no files are being processed.
 class ProgressReporter {
 public:
   void reportScanBegin();
   void reportScanComplete(size_t fileCount, long long totalSize);
+  void reportScanIndex(size_t reusedDirectories, size_t totalDirectories);
+  // Memory of the compact file list, and what one path per file would have
+  // cost; shown in the final summary.
+  void setFileListMemory(size_t usedBytes, size_t pathPerFileBytes);
+  // Entries skipped by exclude patterns; shown in the final summary.
+  void setPrunedEntries(size_t count);
 
   void startProcessing();
-  void startFile(const fs::path &path);
-  void updateFileProgress(long long bytes);
-  void finishFile();
-  void reportFileProcessed(const fs::path &path);
+
+  // Streaming mode: processing starts before the scan has finished. The
+  // overall bar runs against what has been found so far until
+  // finishScanEstimate() fixes the real total.
+  void startEstimatedProcessing();
+  void updateScanEstimate(size_t fileCount, long long totalSize);
+  void finishScanEstimate(size_t fileCount, long long totalSize);
+
+  // Several files may be copying at once; each gets an id. The file bar
+  // follows the most recently started one.
+  size_t startFile(const fs::path &path, long long size);
+  void updateFileProgress(size_t file, long long bytes);
+  void finishFile(size_t file);
+  void reportFileProcessed(long long size);
+  // Counts a file whose copy was a reflink (shared data, nothing copied).
+  void reportReflinked(long long size);
+  // Counts a file that could not be hard-linked and was copied instead.
+  void reportLinkFallback();
+  // A large file was copied through the page cache despite --direct-io.
+  void reportCachedCopy();
+  void reportFileError(const fs::path &path, const std::error_code &ec);
+  // Time spent making the copies durable, as its own line in the summary.
+  void reportSync(size_t files, std::chrono::steady_clock::duration elapsed);
+  // The hashes of files copies were written to path (--manifest).
+  void reportManifest(size_t files, const fs::path &path);
   void finishProcessing();
 
+  // --verify: files listed in the manifest, checked like copies are made.
+  void reportVerifyBegin(size_t fileCount, long long totalSize);
+  // Thread-safe. A destination that is missing or differs from the
+  // manifest.
+  void reportMismatch(const fs::path &path, const std::string &problem);
+  // Returns true when every file matched.
+  bool finishVerify();
+
   fs::path promptForUnknownFile(
       const fs::path &file, const fs::path &destBaseDir,
       std::map<std::string, fs::path> &userRules,
       std::vector<std::pair<std::regex, std::string>> &customRules);
 
 private:
+  struct ActiveFile {
+    long long size = 0;
+    long long bytes = 0;
+    std::string label;
+  };
+
+  void showFile(size_t file);
   void draw();
 
+  std::mutex m_mutex;
   ProgressBar m_overallBar;
   ProgressBar m_fileBar;
   long long m_totalSize = 0;
+  size_t m_fileCount = 0;
+  size_t m_fileListBytes = 0;
+  size_t m_pathPerFileBytes = 0;
+  long long m_copiedBytes = 0;
+  long long m_reflinkedBytes = 0;
+  size_t m_linkFallbacks = 0;
+  size_t m_cachedCopies = 0;
+  bool m_reportSync = false;
+  size_t m_syncedFiles = 0;
+  std::chrono::steady_clock::duration m_syncTime{};
+  size_t m_manifestFiles = 0;
+  fs::path m_manifestPath;
+  size_t m_mismatches = 0;
+  bool m_reportPruned = false;
+  size_t m_prunedEntries = 0;
+  bool m_totalIsEstimate = false;
   long long m_processedSize = 0;
-  long long m_fileBytesProcessed = 0;
-  long long m_fileSize = 0;
-  bool m_isCopyingFile = false;
+  std::map<size_t, ActiveFile> m_activeFiles;
+  size_t m_nextFile = 0;
+  // The file the file bar shows.
+  size_t m_shownFile = 0;
+  // Bytes copied so far of all active files.
+  long long m_activeBytes = 0;
   std::chrono::steady_clock::time_point m_lastDrawTime;
 };
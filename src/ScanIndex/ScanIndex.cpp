@@ -0,0 +1,301 @@
+#include "ScanIndex.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr char kMagic[8] = {'E', 'K', 'S', 'C', 'I', 'D', 'X', '1'};
+constexpr std::uint32_t kVersion = 1;
+
+struct FileHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t reserved;
+  std::uint64_t filterKey;
+  std::uint64_t directoryCount;
+  std::uint64_t entryCount;
+  std::uint64_t stringBytes;
+};
+
+struct DirectoryRecord {
+  std::uint64_t pathOffset;
+  std::uint32_t pathLength;
+  std::uint32_t entryCount;
+  std::uint64_t firstEntry;
+  std::uint64_t device;
+  std::uint64_t inode;
+  std::int64_t mtime;
+  std::int64_t ctime;
+};
+
+struct EntryRecord {
+  std::uint64_t nameOffset;
+  std::uint32_t nameLength;
+  std::uint32_t mode;
+  std::uint64_t size;
+  std::int64_t mtime;
+  std::uint64_t inode;
+  std::uint64_t isDirectory;
+};
+
+// Keeping every record a multiple of 8 bytes keeps all tables aligned inside
+// the mapping, so they can be read in place.
+static_assert(sizeof(FileHeader) % 8 == 0, "unaligned header");
+static_assert(sizeof(DirectoryRecord) % 8 == 0, "unaligned directory record");
+static_assert(sizeof(EntryRecord) % 8 == 0, "unaligned entry record");
+
+bool sameStamp(const DirectoryRecord &record, const ScanIndex::Stamp &stamp) {
+  return record.device == stamp.device && record.inode == stamp.inode &&
+         record.mtime == stamp.mtime && record.ctime == stamp.ctime;
+}
+} // namespace
+
+ScanIndex::ScanIndex() {
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  m_racyBefore =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() -
+      std::chrono::nanoseconds(std::chrono::seconds(2)).count();
+}
+
+ScanIndex::~ScanIndex() { unmap(); }
+
+fs::path ScanIndex::defaultPath(const fs::path &destination) {
+  fs::path normalized = destination.lexically_normal();
+  if (normalized.filename().empty()) {
+    normalized = normalized.parent_path();
+  }
+  return normalized.parent_path() /
+         (normalized.filename().string() + ".ekatra-index");
+}
+
+void ScanIndex::unmap() {
+#ifndef _WIN32
+  if (m_data != nullptr) {
+    ::munmap(const_cast<char *>(m_data), m_size);
+  }
+#endif
+  m_data = nullptr;
+  m_size = 0;
+  m_directoryCount = 0;
+}
+
+bool ScanIndex::load(const fs::path &file, std::uint64_t filterKey) {
+  unmap();
+#ifdef _WIN32
+  (void)file;
+  (void)filterKey;
+  return false;
+#else
+  int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(FileHeader)) {
+    ::close(fd);
+    return false;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  m_data = static_cast<const char *>(data);
+  m_size = size;
+
+  const auto *header = reinterpret_cast<const FileHeader *>(m_data);
+  // Each table is checked against what is left of the file before its size
+  // is computed, so damaged counts cannot wrap the sum around to the file
+  // size.
+  std::uint64_t left = size - sizeof(FileHeader);
+  bool fits = header->directoryCount <= left / sizeof(DirectoryRecord);
+  if (fits) {
+    left -= header->directoryCount * sizeof(DirectoryRecord);
+    fits = header->entryCount <= left / sizeof(EntryRecord);
+  }
+  if (fits) {
+    left -= header->entryCount * sizeof(EntryRecord);
+    fits = header->stringBytes == left;
+  }
+  if (std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion || header->filterKey != filterKey ||
+      !fits) {
+    unmap();
+    return false;
+  }
+  m_directoryCount = header->directoryCount;
+  return true;
+#endif
+}
+
+bool ScanIndex::lookup(const std::string &directory, const Stamp &stamp,
+                       std::vector<Entry> &entries) const {
+  if (m_data == nullptr) {
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  const auto *header = reinterpret_cast<const FileHeader *>(m_data);
+  const auto *directories =
+      reinterpret_cast<const DirectoryRecord *>(m_data + sizeof(FileHeader));
+  const auto *entryTable = reinterpret_cast<const EntryRecord *>(
+      directories + header->directoryCount);
+  const char *strings =
+      reinterpret_cast<const char *>(entryTable + header->entryCount);
+
+  const std::uint64_t stringBytes = header->stringBytes;
+
+  // Offsets are checked as they are used, so a damaged index can only cause
+  // misses, never reads outside the mapping. The checks subtract rather
+  // than add, so huge offsets cannot wrap around.
+  auto pathOf = [strings, stringBytes](const DirectoryRecord &record) {
+    if (record.pathOffset > stringBytes ||
+        record.pathLength > stringBytes - record.pathOffset) {
+      return std::string_view();
+    }
+    return std::string_view(strings + record.pathOffset, record.pathLength);
+  };
+
+  const DirectoryRecord *end = directories + m_directoryCount;
+  const DirectoryRecord *it = std::lower_bound(
+      directories, end, std::string_view(directory),
+      [&pathOf](const DirectoryRecord &record, std::string_view key) {
+        return pathOf(record) < key;
+      });
+  if (it == end || pathOf(*it) != directory || !sameStamp(*it, stamp) ||
+      it->firstEntry > header->entryCount ||
+      it->entryCount > header->entryCount - it->firstEntry) {
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  entries.clear();
+  entries.reserve(it->entryCount);
+  for (std::uint64_t i = 0; i < it->entryCount; ++i) {
+    const EntryRecord &record = entryTable[it->firstEntry + i];
+    if (record.nameOffset > stringBytes ||
+        record.nameLength > stringBytes - record.nameOffset) {
+      entries.clear();
+      m_misses.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    Entry entry;
+    entry.name.assign(strings + record.nameOffset, record.nameLength);
+    entry.isDirectory = record.isDirectory != 0;
+    entry.size = record.size;
+    entry.mtime = record.mtime;
+    entry.inode = record.inode;
+    entry.mode = record.mode;
+    entries.push_back(std::move(entry));
+  }
+  m_hits.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void ScanIndex::record(const std::string &directory, const Stamp &stamp,
+                       std::vector<Entry> entries) {
+  if (stamp.mtime >= m_racyBefore) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_recorded.push_back(Listing{directory, stamp, std::move(entries)});
+}
+
+bool ScanIndex::save(const fs::path &file, std::uint64_t filterKey) {
+#ifdef _WIN32
+  (void)file;
+  (void)filterKey;
+  return false;
+#else
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::sort(m_recorded.begin(), m_recorded.end(),
+            [](const Listing &a, const Listing &b) {
+              return a.directory < b.directory;
+            });
+
+  std::vector<DirectoryRecord> directories;
+  std::vector<EntryRecord> entries;
+  std::string strings;
+  directories.reserve(m_recorded.size());
+
+  for (const auto &listing : m_recorded) {
+    DirectoryRecord record{};
+    record.pathOffset = strings.size();
+    record.pathLength = static_cast<std::uint32_t>(listing.directory.size());
+    record.entryCount = static_cast<std::uint32_t>(listing.entries.size());
+    record.firstEntry = entries.size();
+    record.device = listing.stamp.device;
+    record.inode = listing.stamp.inode;
+    record.mtime = listing.stamp.mtime;
+    record.ctime = listing.stamp.ctime;
+    strings += listing.directory;
+    directories.push_back(record);
+
+    for (const auto &entry : listing.entries) {
+      EntryRecord entryRecord{};
+      entryRecord.nameOffset = strings.size();
+      entryRecord.nameLength = static_cast<std::uint32_t>(entry.name.size());
+      entryRecord.mode = entry.mode;
+      entryRecord.size = entry.size;
+      entryRecord.mtime = entry.mtime;
+      entryRecord.inode = entry.inode;
+      entryRecord.isDirectory = entry.isDirectory ? 1 : 0;
+      strings += entry.name;
+      entries.push_back(entryRecord);
+    }
+  }
+
+  FileHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.filterKey = filterKey;
+  header.directoryCount = directories.size();
+  header.entryCount = entries.size();
+  header.stringBytes = strings.size();
+
+  // Write next to the target and rename, so a crash never leaves a torn
+  // index behind and a concurrent reader keeps its old mapping.
+  fs::path temporary = file;
+  temporary += ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      std::cerr << "Warning: Could not write scan index: " << temporary.string()
+                << std::endl;
+      return false;
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(directories.data()),
+              directories.size() * sizeof(DirectoryRecord));
+    out.write(reinterpret_cast<const char *>(entries.data()),
+              entries.size() * sizeof(EntryRecord));
+    out.write(strings.data(), strings.size());
+    if (!out) {
+      std::cerr << "Warning: Could not write scan index: " << temporary.string()
+                << std::endl;
+      return false;
+    }
+  }
+
+  std::error_code ec;
+  fs::rename(temporary, file, ec);
+  if (ec) {
+    std::cerr << "Warning: Could not save scan index " << file.string() << ": "
+              << ec.message() << std::endl;
+    return false;
+  }
+  return true;
+#endif
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// A persistent cache of directory listings, used to make repeated scans of
+// the same sources incremental.
+//
+// Every directory is stored with a stamp (device, inode, mtime, ctime). A
+// directory's mtime changes whenever an entry is created, removed or renamed
+// in it, so an unchanged stamp means the cached listing is still the list of
+// names in that directory and the walker can skip reading it.
+//
+// The file is a flat binary image: a header, a table of directory records
+// sorted by path, a table of entry records and one string blob. It is
+// memory-mapped and searched in place, so loading it costs one mmap rather
+// than parsing.
+class ScanIndex {
+public:
+  struct Stamp {
+    std::uint64_t device = 0;
+    std::uint64_t inode = 0;
+    std::int64_t mtime = 0;
+    std::int64_t ctime = 0;
+  };
+
+  struct Entry {
+    std::string name;
+    bool isDirectory = false;
+    std::uint64_t size = 0;
+    std::int64_t mtime = 0;
+    std::uint64_t inode = 0;
+    std::uint32_t mode = 0;
+  };
+
+  ScanIndex();
+  ~ScanIndex();
+
+  ScanIndex(const ScanIndex &) = delete;
+  ScanIndex &operator=(const ScanIndex &) = delete;
+
+  // '<destination>.ekatra-index', next to the destination folder.
+  static fs::path defaultPath(const fs::path &destination);
+
+  // Maps a previously saved index. filterKey describes the scan settings
+  // that shaped the listings (hidden files, metadata); an index written with
+  // different settings is ignored. Returns false when there is nothing
+  // usable, in which case every lookup misses.
+  bool load(const fs::path &file, std::uint64_t filterKey);
+
+  // Fills entries with the cached listing of directory if its stamp still
+  // matches. Safe to call from several threads.
+  bool lookup(const std::string &directory, const Stamp &stamp,
+              std::vector<Entry> &entries) const;
+
+  // Adds a listing to the next index. Safe to call from several threads.
+  void record(const std::string &directory, const Stamp &stamp,
+              std::vector<Entry> entries);
+
+  // Writes every recorded listing to file, replacing it atomically.
+  bool save(const fs::path &file, std::uint64_t filterKey);
+
+  size_t reusedDirectories() const { return m_hits.load(); }
+  size_t scannedDirectories() const { return m_misses.load(); }
+
+private:
+  struct Listing {
+    std::string directory;
+    Stamp stamp;
+    std::vector<Entry> entries;
+  };
+
+  void unmap();
+
+  const char *m_data = nullptr;
+  size_t m_size = 0;
+  std::uint64_t m_directoryCount = 0;
+
+  // Directories modified after this may change again within the same
+  // timestamp tick, so their listings are not cached.
+  std::int64_t m_racyBefore = 0;
+
+  std::mutex m_mutex;
+  std::vector<Listing> m_recorded;
+
+  mutable std::atomic<size_t> m_hits{0};
+  mutable std::atomic<size_t> m_misses{0};
+};
@@ -0,0 +1,167 @@
+#include "SyncTracker.h"
+#include "src/DirHandle/DirHandle.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void SyncTracker::fileWritten(const DirHandle &folder, const std::string &name,
+                              std::uintmax_t bytes, std::error_code &ec) {
+  if (m_policy == Policy::None) {
+    return;
+  }
+  if (m_policy == Policy::File) {
+    auto started = std::chrono::steady_clock::now();
+    folder.syncFile(name, ec);
+    addTime(started, 1);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    track(folder);
+    return;
+  }
+
+  fs::path batchFolder;
+  std::vector<fs::path> batch;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Filesystem &filesystem = track(folder);
+    filesystem.files.push_back(folder.pathOf(name));
+    filesystem.bytes += bytes;
+    if (filesystem.files.size() < kBatchFiles &&
+        filesystem.bytes < kBatchBytes) {
+      return;
+    }
+    batchFolder = filesystem.folder;
+    batch.swap(filesystem.files);
+    filesystem.bytes = 0;
+  }
+  // Flushed outside the lock; the other threads keep copying meanwhile.
+  // A failure concerns the whole batch, not this file, so it waits for
+  // flush() to be reported against the filesystem.
+  syncBatch(batchFolder, batch,
+            [this](const fs::path &path, const std::error_code &error) {
+              std::lock_guard<std::mutex> lock(m_mutex);
+              m_batchErrors.emplace_back(path, error);
+            });
+}
+
+void SyncTracker::entryChanged(const DirHandle &folder) {
+  if (m_policy == Policy::None) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  track(folder);
+}
+
+void SyncTracker::flush(const ErrorHandler &onError) {
+  if (m_policy == Policy::None) {
+    return;
+  }
+  std::map<std::uintmax_t, Filesystem> filesystems;
+  std::map<fs::path, std::uintmax_t> folders;
+  std::vector<std::pair<fs::path, std::error_code>> batchErrors;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    filesystems.swap(m_filesystems);
+    folders.swap(m_folders);
+    batchErrors.swap(m_batchErrors);
+  }
+  for (const auto &error : batchErrors) {
+    onError(error.first, error.second);
+  }
+  for (const auto &filesystem : filesystems) {
+    if (!filesystem.second.files.empty()) {
+      syncBatch(filesystem.second.folder, filesystem.second.files, onError);
+    }
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  for (const auto &folder : folders) {
+    std::error_code ec;
+    try {
+      DirHandle::open(folder.first)->sync(ec);
+    } catch (const fs::filesystem_error &e) {
+      ec = e.code();
+    }
+    if (ec) {
+      onError(folder.first, ec);
+    }
+  }
+  addTime(started, 0);
+}
+
+size_t SyncTracker::filesSynced() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_filesSynced;
+}
+
+std::chrono::steady_clock::duration SyncTracker::timeSpent() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_timeSpent;
+}
+
+SyncTracker::Filesystem &SyncTracker::track(const DirHandle &folder) {
+  auto found = m_folders.find(folder.path());
+  if (found == m_folders.end()) {
+    std::uintmax_t device = 0;
+#ifndef _WIN32
+    struct stat st;
+    if (::fstat(folder.fd(), &st) == 0) {
+      device = static_cast<std::uintmax_t>(st.st_dev);
+    }
+#endif
+    found = m_folders.emplace(folder.path(), device).first;
+  }
+  Filesystem &filesystem = m_filesystems[found->second];
+  if (filesystem.folder.empty()) {
+    filesystem.folder = folder.path();
+  }
+  return filesystem;
+}
+
+void SyncTracker::syncBatch(const fs::path &folder,
+                            const std::vector<fs::path> &files,
+                            const ErrorHandler &onError) {
+  auto started = std::chrono::steady_clock::now();
+#ifdef __linux__
+  // One call writes back every dirty file of the filesystem, the batch
+  // included, and commits the journal once.
+  (void)files;
+  int fd = ::open(folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || ::syncfs(fd) != 0) {
+    onError(folder, std::error_code(errno, std::generic_category()));
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+#else
+  // Consecutive files mostly share a folder; open each folder once.
+  (void)folder;
+  std::shared_ptr<DirHandle> parent;
+  for (const fs::path &file : files) {
+    std::error_code ec;
+    try {
+      if (!parent || parent->path() != file.parent_path()) {
+        parent = DirHandle::open(file.parent_path());
+      }
+      parent->syncFile(file.filename().string(), ec);
+    } catch (const fs::filesystem_error &e) {
+      ec = e.code();
+    }
+    if (ec) {
+      onError(file, ec);
+    }
+  }
+#endif
+  addTime(started, files.size());
+}
+
+void SyncTracker::addTime(std::chrono::steady_clock::time_point started,
+                          size_t files) {
+  auto elapsed = std::chrono::steady_clock::now() - started;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_timeSpent += elapsed;
+  m_filesSynced += files;
+}
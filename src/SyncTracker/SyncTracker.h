@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+class DirHandle;
+
+// Makes the files a run writes durable, following the --durability policy.
+//
+//   None   leaves everything to the kernel's writeback.
+//   Batch  groups finished files by the filesystem they are on and flushes
+//          each filesystem at once (syncfs) every kBatchFiles files or
+//          kBatchBytes bytes, and once more at the end. Systems without
+//          syncfs fsync the batch's files one by one instead.
+//   File   fsyncs every file as soon as it is written.
+// Folders whose entries changed (new files, renames, links) are fsynced by
+// flush(), so the names survive a crash as well as the data.
+class SyncTracker {
+public:
+  enum class Policy { None, Batch, File };
+
+  static constexpr size_t kBatchFiles = 4096;
+  static constexpr std::uintmax_t kBatchBytes = 1024ull * 1024 * 1024;
+
+  using ErrorHandler =
+      std::function<void(const fs::path &, const std::error_code &)>;
+
+  explicit SyncTracker(Policy policy) : m_policy(policy) {}
+
+  Policy policy() const { return m_policy; }
+
+  // Thread-safe. name was written in folder. Under File it is fsynced now;
+  // ec is set if that fails. Under Batch it may complete a batch, whose
+  // failure flush() reports against the filesystem's folder.
+  void fileWritten(const DirHandle &folder, const std::string &name,
+                   std::uintmax_t bytes, std::error_code &ec);
+
+  // Thread-safe. An entry of folder was renamed, linked or removed.
+  void entryChanged(const DirHandle &folder);
+
+  // Flushes everything still pending and every changed folder, reporting
+  // to onError what failed, including the batches flushed earlier. Call
+  // once no more files are being written.
+  void flush(const ErrorHandler &onError);
+
+  // Files flushed so far, and the time spent flushing (all threads).
+  size_t filesSynced() const;
+  std::chrono::steady_clock::duration timeSpent() const;
+
+private:
+  struct Filesystem {
+    // A folder on it, to name the filesystem to syncfs.
+    fs::path folder;
+    // Files written since its last flush.
+    std::vector<fs::path> files;
+    std::uintmax_t bytes = 0;
+  };
+
+  // Records folder and returns the filesystem it is on. Called with the
+  // lock held.
+  Filesystem &track(const DirHandle &folder);
+  // Flushes files on the filesystem of folder. Called without the lock.
+  void syncBatch(const fs::path &folder, const std::vector<fs::path> &files,
+                 const ErrorHandler &onError);
+  void addTime(std::chrono::steady_clock::time_point started, size_t files);
+
+  Policy m_policy;
+  mutable std::mutex m_mutex;
+  // Changed folders, with the id of the filesystem each is on.
+  std::map<fs::path, std::uintmax_t> m_folders;
+  std::map<std::uintmax_t, Filesystem> m_filesystems;
+  // Failed batch flushes, for flush() to report.
+  std::vector<std::pair<fs::path, std::error_code>> m_batchErrors;
+  size_t m_filesSynced = 0;
+  std::chrono::steady_clock::duration m_timeSpent{};
+};
@@ -0,0 +1,172 @@
+#include "ThreadPool.h"
+#include <chrono>
+
+namespace {
+struct WorkerIdentity {
+  const ThreadPool *pool = nullptr;
+  int index = -1;
+};
+
+thread_local WorkerIdentity t_worker;
+} // namespace
+
+ThreadPool::TaskGroup::~TaskGroup() {
+  try {
+    wait();
+  } catch (...) {
+    // Errors must be collected with an explicit wait(); never throw here.
+  }
+}
+
+void ThreadPool::TaskGroup::submit(Task task) {
+  m_pending.fetch_add(1, std::memory_order_relaxed);
+  m_pool.push([this, task = std::move(task)]() {
+    std::exception_ptr error;
+    try {
+      task();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    taskFinished(error);
+  });
+}
+
+void ThreadPool::TaskGroup::taskFinished(std::exception_ptr error) {
+  // Decrement and notify under the lock so a waiter cannot destroy the group
+  // between the two steps.
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (error && !m_error) {
+    m_error = error;
+  }
+  if (m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    m_done.notify_all();
+  }
+}
+
+void ThreadPool::TaskGroup::wait() {
+  int index = m_pool.currentWorkerIndex();
+  if (index >= 0) {
+    // Waiting from inside a worker: keep executing tasks instead of blocking,
+    // otherwise nested groups could starve the pool.
+    while (m_pending.load(std::memory_order_acquire) != 0) {
+      if (!m_pool.runOne(index)) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait_for(lock, std::chrono::milliseconds(1), [this] {
+          return m_pending.load(std::memory_order_acquire) == 0;
+        });
+      }
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this] {
+    return m_pending.load(std::memory_order_acquire) == 0;
+  });
+  if (m_error) {
+    std::exception_ptr error = m_error;
+    m_error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+ThreadPool::ThreadPool(unsigned threadCount) {
+  if (threadCount == 0) {
+    threadCount = std::thread::hardware_concurrency();
+  }
+  if (threadCount == 0) {
+    threadCount = 1;
+  }
+
+  for (unsigned i = 0; i < threadCount; ++i) {
+    m_workers.push_back(std::make_unique<Worker>());
+  }
+  for (unsigned i = 0; i < threadCount; ++i) {
+    m_threads.emplace_back([this, i] { workerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_sleepMutex);
+    m_stop = true;
+  }
+  m_wakeUp.notify_all();
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+}
+
+int ThreadPool::currentWorkerIndex() const {
+  return t_worker.pool == this ? t_worker.index : -1;
+}
+
+void ThreadPool::push(Task task) {
+  int index = currentWorkerIndex();
+  unsigned target =
+      index >= 0 ? static_cast<unsigned>(index)
+                 : m_nextWorker.fetch_add(1, std::memory_order_relaxed) %
+                       m_workers.size();
+
+  {
+    std::lock_guard<std::mutex> lock(m_sleepMutex);
+    m_queued.fetch_add(1, std::memory_order_relaxed);
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_workers[target]->mutex);
+    m_workers[target]->tasks.push_back(std::move(task));
+  }
+  m_wakeUp.notify_one();
+}
+
+bool ThreadPool::tryPop(unsigned index, Task &task) {
+  Worker &worker = *m_workers[index];
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  if (worker.tasks.empty()) {
+    return false;
+  }
+  task = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  return true;
+}
+
+bool ThreadPool::trySteal(unsigned thief, Task &task) {
+  const size_t count = m_workers.size();
+  for (size_t offset = 1; offset < count; ++offset) {
+    Worker &victim = *m_workers[(thief + offset) % count];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ThreadPool::runOne(int index) {
+  Task task;
+  if (!tryPop(index, task) && !trySteal(index, task)) {
+    return false;
+  }
+  m_queued.fetch_sub(1, std::memory_order_relaxed);
+  task();
+  return true;
+}
+
+void ThreadPool::workerLoop(unsigned index) {
+  t_worker.pool = this;
+  t_worker.index = static_cast<int>(index);
+
+  while (true) {
+    if (runOne(static_cast<int>(index))) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(m_sleepMutex);
+    m_wakeUp.wait(lock, [this] {
+      return m_stop || m_queued.load(std::memory_order_relaxed) > 0;
+    });
+    if (m_stop && m_queued.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool.
+//
+// Every worker owns a deque. Tasks submitted from inside a worker go to the
+// back of that worker's deque and are popped LIFO (depth-first, cache
+// friendly); idle workers steal from the front of other deques (FIFO), which
+// hands them the oldest and usually largest pieces of work.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  // Tracks a set of tasks so a caller can wait for just those tasks. Tasks
+  // may submit more tasks into the same group. The first exception thrown by
+  // a task in the group is rethrown from wait().
+  class TaskGroup {
+  public:
+    explicit TaskGroup(ThreadPool &pool) : m_pool(pool) {}
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void submit(Task task);
+    void wait();
+
+  private:
+    friend class ThreadPool;
+
+    void taskFinished(std::exception_ptr error);
+
+    ThreadPool &m_pool;
+    std::atomic<size_t> m_pending{0};
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::exception_ptr m_error;
+  };
+
+  // threadCount == 0 picks std::thread::hardware_concurrency().
+  explicit ThreadPool(unsigned threadCount = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned size() const { return static_cast<unsigned>(m_threads.size()); }
+
+  // Index of the calling worker in [0, size()), or -1 when the caller is not
+  // one of this pool's workers.
+  int currentWorkerIndex() const;
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void push(Task task);
+  bool tryPop(unsigned index, Task &task);
+  bool trySteal(unsigned thief, Task &task);
+  bool runOne(int index);
+  void workerLoop(unsigned index);
+
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::vector<std::thread> m_threads;
+  std::atomic<unsigned> m_nextWorker{0};
+
+  std::mutex m_sleepMutex;
+  std::condition_variable m_wakeUp;
+  std::atomic<size_t> m_queued{0};
+  bool m_stop = false;
+};
@@ -0,0 +1,339 @@
+#include "UringCopier.h"
+#include <algorithm>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+namespace {
+#ifdef __linux__
+std::error_code errorOf(int error) {
+  return std::error_code(error, std::generic_category());
+}
+
+std::uint64_t userDataOf(size_t slot, bool write) {
+  return (static_cast<std::uint64_t>(slot) << 1) | (write ? 1 : 0);
+}
+#endif
+} // namespace
+
+struct UringCopier::Slot {
+#ifndef _WIN32
+  UniqueFd in;
+  UniqueFd out;
+#endif
+  char *buffer = nullptr;
+  std::uintmax_t expectedSize = 0;
+  // Bytes read and written so far; the current round starts here.
+  std::uintmax_t offset = 0;
+  // Length of the current read.
+  unsigned requested = 0;
+  // Whether the current read carries a linked write of requested bytes.
+  bool linked = false;
+  bool writeCancelled = false;
+  // Result of the current read, -1 while it is in the kernel.
+  long long got = -1;
+  // Bytes of the current round written so far.
+  unsigned written = 0;
+  // Requests of this slot in the kernel.
+  unsigned pending = 0;
+  std::error_code ec;
+  Callbacks callbacks;
+};
+
+UringCopier::UringCopier(Options options) : m_chunkSize(options.chunkSize) {
+#ifdef __linux__
+  if (!supported()) {
+    return;
+  }
+  // Every file in flight holds two descriptors.
+  rlim_t files = std::min(std::max(1u, options.filesInFlight),
+                          kMaxFilesInFlight);
+  struct rlimit limit;
+  if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY) {
+    rlim_t spare = limit.rlim_cur > kReservedDescriptors
+                       ? limit.rlim_cur - kReservedDescriptors
+                       : 0;
+    files = std::max<rlim_t>(1, std::min(files, spare / 2));
+  }
+
+  m_ring = std::make_unique<IoUring>(static_cast<unsigned>(files * 2));
+  if (!m_ring->valid()) {
+    m_ring.reset();
+    return;
+  }
+  // The slots take at most half the budget: the synchronous fallbacks
+  // (sparse files, hashing a reflink) borrow from the same pool on this
+  // thread, and would wait forever for buffers only this thread returns.
+  // The first buffer may come out smaller when the budget is short; the
+  // others match it, as long as the share allows.
+  BufferPool &pool = BufferPool::shared();
+  size_t share = std::max(BufferPool::kMinBufferSize, pool.budget() / 2);
+  m_buffers.push_back(pool.acquire(std::min(m_chunkSize, share)));
+  m_chunkSize = m_buffers.front().size();
+  while (m_buffers.size() < files &&
+         (m_buffers.size() + 1) * m_chunkSize <= share) {
+    BufferPool::Lease lease = pool.tryAcquire(m_chunkSize);
+    if (!lease) {
+      break;
+    }
+    m_buffers.push_back(std::move(lease));
+  }
+  files = m_buffers.size();
+  m_slots.resize(files);
+  std::vector<iovec> buffers(files);
+  for (size_t i = 0; i < files; ++i) {
+    m_slots[i].buffer = m_buffers[i].data();
+    buffers[i].iov_base = m_slots[i].buffer;
+    buffers[i].iov_len = m_chunkSize;
+  }
+  // Registration can fail on RLIMIT_MEMLOCK (before 5.12); plain reads and
+  // writes still work then.
+  m_registered = IoUring::supports(IORING_OP_READ_FIXED) &&
+                 IoUring::supports(IORING_OP_WRITE_FIXED) &&
+                 m_ring->registerBuffers(buffers.data(),
+                                         static_cast<unsigned>(files));
+  for (size_t i = files; i-- > 0;) {
+    m_freeSlots.push_back(i);
+  }
+  m_valid = true;
+#else
+  (void)options;
+#endif
+}
+
+UringCopier::~UringCopier() {
+  drain();
+  // Close the ring, cancelling anything left in it, before the buffers go
+  // back to the pool.
+  m_ring.reset();
+}
+
+bool UringCopier::supported() {
+#ifdef __linux__
+  return IoUring::supports(IORING_OP_READ) &&
+         IoUring::supports(IORING_OP_WRITE);
+#else
+  return false;
+#endif
+}
+
+unsigned UringCopier::filesInFlight() const {
+  return static_cast<unsigned>(m_slots.size());
+}
+
+#ifndef _WIN32
+void UringCopier::submit(UniqueFd in, UniqueFd out,
+                         std::uintmax_t expectedSize, Callbacks callbacks) {
+  while (m_valid && m_freeSlots.empty()) {
+    pump();
+  }
+  if (!m_valid) {
+    callbacks.onDone(0, std::make_error_code(std::errc::io_error));
+    return;
+  }
+  size_t index = m_freeSlots.back();
+  m_freeSlots.pop_back();
+  Slot &slot = m_slots[index];
+  slot.in = std::move(in);
+  slot.out = std::move(out);
+  slot.expectedSize = expectedSize;
+  slot.offset = 0;
+  slot.ec.clear();
+  slot.callbacks = std::move(callbacks);
+  ++m_active;
+
+  startRound(index);
+  // Hand the requests over now; the caller may take a while to come back.
+  if (!m_ring->submit(0)) {
+    failAll(std::error_code(errno, std::generic_category()));
+  }
+}
+#endif
+
+void UringCopier::drain() {
+  while (m_valid && m_active > 0) {
+    pump();
+  }
+}
+
+void UringCopier::pump() {
+#ifdef __linux__
+  if (!m_ring->submit(1)) {
+    failAll(errorOf(errno));
+    return;
+  }
+  std::uint64_t userData = 0;
+  int result = 0;
+  while (m_ring->popCompletion(userData, result)) {
+    handle(userData, result);
+  }
+#endif
+}
+
+void UringCopier::startRound(size_t index) {
+#ifdef __linux__
+  Slot &slot = m_slots[index];
+  std::uintmax_t remaining =
+      slot.expectedSize > slot.offset ? slot.expectedSize - slot.offset : 0;
+  // Up to the size the scan saw, each read carries its write. Past it, a
+  // lone read finds the real end of file.
+  slot.linked = remaining > 0;
+  slot.requested = static_cast<unsigned>(
+      slot.linked ? std::min<std::uintmax_t>(m_chunkSize, remaining)
+                  : m_chunkSize);
+  slot.writeCancelled = false;
+  slot.got = -1;
+  slot.written = 0;
+
+  if (!m_ring->prepareRead(slot.in.get(), slot.buffer, slot.requested,
+                           slot.offset,
+                           m_registered ? static_cast<int>(index) : -1,
+                           userDataOf(index, false), slot.linked)) {
+    slot.ec = std::make_error_code(std::errc::resource_unavailable_try_again);
+    advance(index);
+    return;
+  }
+  ++slot.pending;
+  if (slot.linked) {
+    queueWrite(index, slot.requested, true);
+  }
+#else
+  (void)index;
+#endif
+}
+
+void UringCopier::queueWrite(size_t index, unsigned length, bool afterRead) {
+#ifdef __linux__
+  Slot &slot = m_slots[index];
+  if (!m_ring->prepareWrite(slot.out.get(), slot.buffer + slot.written,
+                            length, slot.offset + slot.written,
+                            m_registered ? static_cast<int>(index) : -1,
+                            userDataOf(index, true), false)) {
+    slot.ec = std::make_error_code(std::errc::resource_unavailable_try_again);
+    if (afterRead) {
+      // The read was linked to a write that never got queued.
+      slot.linked = false;
+    }
+    return;
+  }
+  ++slot.pending;
+#else
+  (void)index;
+  (void)length;
+  (void)afterRead;
+#endif
+}
+
+void UringCopier::handle(std::uint64_t userData, int result) {
+#ifdef __linux__
+  size_t index = static_cast<size_t>(userData >> 1);
+  bool write = (userData & 1) != 0;
+  Slot &slot = m_slots[index];
+  --slot.pending;
+
+  if (!write) {
+    if (result < 0) {
+      slot.ec = slot.ec ? slot.ec : errorOf(-result);
+    } else {
+      slot.got = result;
+      // A short read cancels the linked write; the bytes it did read are
+      // written on their own.
+      if (result > 0 && !slot.ec && (!slot.linked || slot.writeCancelled)) {
+        queueWrite(index, static_cast<unsigned>(result), false);
+      }
+    }
+  } else if (result == -ECANCELED) {
+    slot.writeCancelled = true;
+    if (slot.got > 0 && !slot.ec) {
+      queueWrite(index, static_cast<unsigned>(slot.got), false);
+    }
+  } else if (result <= 0) {
+    slot.ec = slot.ec ? slot.ec
+                      : (result < 0 ? errorOf(-result)
+                                    : std::make_error_code(std::errc::io_error));
+  } else {
+    slot.written += static_cast<unsigned>(result);
+    unsigned target = slot.linked && !slot.writeCancelled
+                          ? slot.requested
+                          : static_cast<unsigned>(slot.got);
+    if (slot.written < target && !slot.ec) {
+      queueWrite(index, target - slot.written, false);
+    }
+  }
+  advance(index);
+#else
+  (void)userData;
+  (void)result;
+#endif
+}
+
+void UringCopier::advance(size_t index) {
+#ifdef __linux__
+  Slot &slot = m_slots[index];
+  if (slot.pending > 0) {
+    return;
+  }
+  if (slot.ec || slot.got <= 0) {
+    finish(index);
+    return;
+  }
+  if (slot.written > slot.got) {
+    // A linked write went through after a short read; drop what it wrote
+    // past the data.
+    if (::ftruncate(slot.out.get(),
+                    static_cast<off_t>(slot.offset + slot.got)) != 0) {
+      slot.ec = errorOf(errno);
+      finish(index);
+      return;
+    }
+  }
+  if (slot.callbacks.onData) {
+    slot.callbacks.onData(slot.buffer, static_cast<size_t>(slot.got));
+  }
+  slot.offset += static_cast<std::uintmax_t>(slot.got);
+  slot.callbacks.onProgress(static_cast<long long>(slot.offset));
+  startRound(index);
+#else
+  (void)index;
+#endif
+}
+
+void UringCopier::finish(size_t index) {
+  Slot &slot = m_slots[index];
+#ifndef _WIN32
+  // A file that shrank since the scan gives back whatever was reserved for
+  // it past its end.
+  if (!slot.ec && slot.offset < slot.expectedSize &&
+      ::ftruncate(slot.out.get(), static_cast<off_t>(slot.offset)) != 0) {
+    slot.ec = std::error_code(errno, std::generic_category());
+  }
+  slot.in.reset();
+  slot.out.reset();
+#endif
+  Callbacks callbacks = std::move(slot.callbacks);
+  slot.callbacks = Callbacks();
+  std::uintmax_t bytes = slot.offset;
+  std::error_code ec = slot.ec;
+  m_freeSlots.push_back(index);
+  --m_active;
+  callbacks.onDone(bytes, ec);
+}
+
+void UringCopier::failAll(std::error_code ec) {
+  // The ring is unusable; the requests still in it are cancelled when it is
+  // closed, and the buffers live until then.
+  m_valid = false;
+  for (size_t i = 0; i < m_slots.size(); ++i) {
+    if (m_slots[i].callbacks.onDone) {
+      m_slots[i].ec = m_slots[i].ec ? m_slots[i].ec : ec;
+      finish(i);
+    }
+  }
+}
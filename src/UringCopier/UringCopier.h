@@ -0,0 +1,97 @@
+#pragma once
+
+#include "src/BufferPool/BufferPool.h"
+#include "src/DirHandle/DirHandle.h"
+#include "src/IoUring/IoUring.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+// Copies many files at once through one io_uring.
+//
+// CopyEngine copies one file at a time with blocking calls, so a fast SSD
+// only ever sees one request. Here each of up to filesInFlight files owns a
+// slot with its own registered buffer, borrowed from BufferPool for the
+// copier's lifetime; a slot keeps a read and the write
+// linked to it queued, so the device always has several requests to work
+// on. Everything runs on the calling thread: completions, and with them
+// the callbacks, are handled inside submit() and drain().
+class UringCopier {
+public:
+  struct Options {
+    unsigned filesInFlight = 16;
+    // Size of each slot's buffer; one read/write pair moves at most this.
+    // The slots take at most half the buffer pool's budget, leaving the
+    // rest for copies that fall back to CopyEngine; fewer slots, or smaller
+    // buffers, are used when that is short.
+    size_t chunkSize = 1024 * 1024;
+  };
+
+  struct Callbacks {
+    // Bytes of this file copied so far.
+    std::function<void(long long bytes)> onProgress;
+    // Optional: the bytes themselves, in file order, once written.
+    std::function<void(const char *data, size_t size)> onData;
+    // Called once, after the last write or on the first error.
+    std::function<void(std::uintmax_t bytes, std::error_code ec)> onDone;
+  };
+
+  // Upper bound on filesInFlight; beyond it the device queue is full anyway.
+  static constexpr unsigned kMaxFilesInFlight = 256;
+  // Descriptors left for folder handles, the scanner and the rest of the
+  // process when sizing filesInFlight against RLIMIT_NOFILE.
+  static constexpr unsigned kReservedDescriptors = 384;
+
+  explicit UringCopier(Options options);
+  ~UringCopier();
+
+  UringCopier(const UringCopier &) = delete;
+  UringCopier &operator=(const UringCopier &) = delete;
+
+  // Whether the running kernel has io_uring with read/write support.
+  static bool supported();
+
+  // False when io_uring is unavailable, or after the ring failed; callers
+  // then copy synchronously.
+  bool valid() const { return m_valid; }
+  // Files copied at once, after the descriptor limit was applied.
+  unsigned filesInFlight() const;
+  // Whether the buffers could be registered (READ_FIXED/WRITE_FIXED).
+  bool registeredBuffers() const { return m_registered; }
+
+#ifndef _WIN32
+  // Copies in to out from offset 0 to the end of file; expectedSize is what
+  // the scan saw. Takes both descriptors. Waits for a free slot first,
+  // which may run callbacks of earlier files.
+  void submit(UniqueFd in, UniqueFd out, std::uintmax_t expectedSize,
+              Callbacks callbacks);
+#endif
+
+  // Waits until every submitted file is done.
+  void drain();
+
+private:
+  struct Slot;
+
+  // Handles completions, waiting for at least one.
+  void pump();
+  void startRound(size_t index);
+  void queueWrite(size_t index, unsigned length, bool afterRead);
+  void handle(std::uint64_t userData, int result);
+  void advance(size_t index);
+  void finish(size_t index);
+  void failAll(std::error_code ec);
+
+  bool m_valid = false;
+  bool m_registered = false;
+  size_t m_chunkSize;
+  std::unique_ptr<IoUring> m_ring;
+  std::vector<Slot> m_slots;
+  std::vector<size_t> m_freeSlots;
+  size_t m_active = 0;
+  // The slots' buffers, kept until the copier is gone.
+  std::vector<BufferPool::Lease> m_buffers;
+};
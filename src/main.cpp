@@ -1,5 +1,9 @@
 #include "MergeManager.h"
+#include "DirectoryScanner/DirectoryScanner.h"
+#include "ScanIndex/ScanIndex.h"
+#include "UringCopier/UringCopier.h"
 #include "include/argparse/argparse.hpp"
+#include <algorithm>
 #include <iostream>
 #include <string>
 
@@ -7,15 +11,15 @@ int main(int argc, char *argv[]) {
 
   argparse::ArgumentParser program("Ekatra", "1.0");
 
-  program.add_argument("source_a").help("First source folder to merge.");
-
-  program.add_argument("source_b").help("Second source folder to merge.");
-
-  program.add_argument("destination")
-      .help("Destination folder where merged files will be organized.");
+  program.add_argument("folders")
+      .help("Source folders to merge, followed by the destination folder "
+            "where merged files will be organized.")
+      .nargs(argparse::nargs_pattern::any);
 
   program.add_argument("--mode")
-      .help("Operation mode: 'copy' (default) or 'move'.")
+      .help("Operation mode: 'copy' (default), 'move', or 'link' to fill "
+            "the destination with hard links to the source files (copying "
+            "files on another filesystem).")
       .default_value(std::string("copy"));
 
   program.add_argument("-v", "--verbose")
@@ -35,8 +39,8 @@ int main(int argc, char *argv[]) {
       .implicit_value(true);
 
   program.add_argument("--include-hidden")
-      .help("Include hidden files (files starting with a dot). Ignored by "
-            "default.")
+      .help("Include hidden files and folders (names starting with a dot). "
+            "Ignored by default.")
       .default_value(false)
       .implicit_value(true);
 
@@ -50,6 +54,130 @@ int main(int argc, char *argv[]) {
             "copied.")
       .default_value(std::string(""));
 
+  program.add_argument("--exclude")
+      .help("Skip files and folders matching a glob pattern, e.g. "
+            "node_modules, '*.pyc', build/ or 'docs/**/*.tmp'. Matching "
+            "folders are not scanned at all. May be given several times.")
+      .default_value(std::vector<std::string>())
+      .append();
+
+  program.add_argument("--exclude-from")
+      .help("Read exclude patterns from a file, one per line ('#' starts a "
+            "comment).")
+      .default_value(std::string(""));
+
+  program.add_argument("--stream")
+      .help("Start copying while the sources are still being scanned. The "
+            "total shown is an estimate until the scan finishes, and which "
+            "duplicate receives the _1 suffix may differ between runs.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--incremental")
+      .help("Keep a scan index next to the destination "
+            "('<destination>.ekatra-index') so later runs only re-read "
+            "folders that changed.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--scan-index")
+      .help("Like --incremental, but store the scan index at the given path.")
+      .default_value(std::string(""));
+
+  program.add_argument("--scan-threads")
+      .help("Number of threads used to walk the source folders. Defaults to "
+            "the number of hardware threads; raise it for high-latency "
+            "network storage.")
+      .default_value(0u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--io-uring-scan")
+      .help("Submit the stat calls of each scanned folder to the kernel as "
+            "one io_uring batch (Linux). Helps most on network and FUSE "
+            "mounts. Falls back to regular stat calls where io_uring is not "
+            "available.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--reflink")
+      .help("Copy by sharing data with the source where the filesystem "
+            "supports it (btrfs, XFS): 'auto' (default) tries and falls back "
+            "to a regular copy, 'always' fails instead of copying, 'never' "
+            "always copies the data.")
+      .default_value(std::string("auto"));
+
+  program.add_argument("--io-uring-copy")
+      .help("Copy through io_uring with several files in flight at once "
+            "(Linux), keeping fast SSDs busy. Falls back to copying one file "
+            "at a time where io_uring is not available.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--files-in-flight")
+      .help("Files copied at once with --io-uring-copy; lowered to fit the "
+            "open file limit.")
+      .default_value(16u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("-j", "--jobs")
+      .help("Copy, move or link this many files at once on worker threads. "
+            "Helps with many small files; where each file goes is still "
+            "decided in order, so duplicates are renamed the same way.")
+      .default_value(1u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--device-queues")
+      .help("Give every source disk its own queue and copy from all of them "
+            "at once, with one file at a time on spinning disks and up to 8 "
+            "on SSDs (detected per device, Linux). --jobs, if given, sets "
+            "the total number of worker threads.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--large-file-threshold")
+      .help("Files of at least this many MiB are copied in ranges by several "
+            "threads at once (striped arrays, NVMe); never on spinning "
+            "disks. 0 turns it off.")
+      .default_value(1024u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--buffer-memory")
+      .help("MiB of memory all copy buffers together may use, however many "
+            "files are copied at once.")
+      .default_value(256u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--huge-pages")
+      .help("Back large copy buffers with huge pages where the system "
+            "offers them.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--durability")
+      .help("How copies are made to survive a power loss: 'batch' (default) "
+            "flushes each destination filesystem every few thousand files "
+            "and at the end, 'file' fsyncs every file as it is written, "
+            "'none' leaves it to the operating system.")
+      .default_value(std::string("batch"));
+
+  program.add_argument("--direct-io")
+      .help("Copy files of 4 MiB and up around the page cache (O_DIRECT), so "
+            "a large copy does not push everything else out of memory. Files "
+            "on filesystems without it are copied normally.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--manifest")
+      .help("Write the size and a hash of every copied file to this file, "
+            "computed while the file is copied, for a later --verify.")
+      .default_value(std::string(""));
+
+  program.add_argument("--verify")
+      .help("Re-read the destinations listed in a manifest written by "
+            "--manifest and report every file that is missing or differs. "
+            "Takes no folders; --jobs reads several files at once.")
+      .default_value(std::string(""));
+
   try {
     program.parse_args(argc, argv);
   } catch (const std::runtime_error &err) {
@@ -57,21 +185,122 @@ int main(int argc, char *argv[]) {
     std::cerr << program;
     return 1;
   }
+  std::string verifyFile = program.get<std::string>("--verify");
+  if (!verifyFile.empty()) {
+    ProcessOptions options;
+    options.manifestFile = verifyFile;
+    options.jobs = std::max(1u, program.get<unsigned>("--jobs"));
+    options.bufferMemory =
+        static_cast<size_t>(program.get<unsigned>("--buffer-memory")) * 1024 *
+        1024;
+    MergeManager manager;
+    return manager.verify(options) ? 0 : 1;
+  }
+
+  auto folders = program.get<std::vector<std::string>>("folders");
+  if (folders.size() < 2) {
+    std::cerr << "At least one source folder and a destination are required."
+              << std::endl;
+    std::cerr << program;
+    return 1;
+  }
+
   ProcessOptions options;
-  options.sourceA = program.get<std::string>("source_a");
-  options.sourceB = program.get<std::string>("source_b");
-  options.destination = program.get<std::string>("destination");
+  options.sources.assign(folders.begin(), folders.end() - 1);
+  options.destination = folders.back();
   options.noSort = program.get<bool>("--no-sort");
   options.verbose = program.get<bool>("--verbose");
   options.skipDuplicates = program.get<bool>("--skip-duplicates");
   options.includeHidden = program.get<bool>("--include-hidden");
   options.rulesFile = program.get<std::string>("--rules");
   options.scanFile = program.get<std::string>("--scan");
+  options.scanThreads = program.get<unsigned>("--scan-threads");
+  options.streaming = program.get<bool>("--stream");
+  options.excludePatterns =
+      program.get<std::vector<std::string>>("--exclude");
+  options.excludeFile = program.get<std::string>("--exclude-from");
+  options.ioUringScan = program.get<bool>("--io-uring-scan");
+  if (options.ioUringScan && !DirectoryScanner::batchedStatAvailable()) {
+    std::cout << "io_uring is not available here; scanning with regular "
+                 "stat calls."
+              << std::endl;
+  }
+  options.ioUringCopy = program.get<bool>("--io-uring-copy");
+  options.filesInFlight =
+      std::max(1u, program.get<unsigned>("--files-in-flight"));
+  options.jobs = std::max(1u, program.get<unsigned>("--jobs"));
+  options.bufferMemory =
+      static_cast<size_t>(program.get<unsigned>("--buffer-memory")) * 1024 *
+      1024;
+  options.hugePages = program.get<bool>("--huge-pages");
+  options.directIo = program.get<bool>("--direct-io");
+  options.manifestFile = program.get<std::string>("--manifest");
+  options.parallelCopyThreshold =
+      static_cast<std::uintmax_t>(
+          program.get<unsigned>("--large-file-threshold")) *
+      1024 * 1024;
+  options.deviceQueues = program.get<bool>("--device-queues");
+  if (options.ioUringCopy && options.deviceQueues) {
+    std::cout << "--io-uring-copy keeps many files in flight on one thread; "
+                 "ignoring it with --device-queues."
+              << std::endl;
+    options.ioUringCopy = false;
+  } else if (options.ioUringCopy && options.jobs > 1) {
+    std::cout << "--io-uring-copy keeps many files in flight on one thread; "
+                 "ignoring it with --jobs."
+              << std::endl;
+    options.ioUringCopy = false;
+  } else if (options.ioUringCopy && options.directIo) {
+    std::cout << "--io-uring-copy reads through the page cache; ignoring it "
+                 "with --direct-io."
+              << std::endl;
+    options.ioUringCopy = false;
+  } else if (options.ioUringCopy && !UringCopier::supported()) {
+    std::cout << "io_uring is not available here; copying one file at a "
+                 "time."
+              << std::endl;
+  }
+  options.scanIndexFile = program.get<std::string>("--scan-index");
+  if (options.scanIndexFile.empty() && program.get<bool>("--incremental")) {
+    options.scanIndexFile = ScanIndex::defaultPath(options.destination);
+  }
 
-  if (program.get<std::string>("--mode") == "move") {
+  std::string reflink = program.get<std::string>("--reflink");
+  if (reflink == "always") {
+    options.reflink = CopyEngine::Reflink::Always;
+  } else if (reflink == "never") {
+    options.reflink = CopyEngine::Reflink::Never;
+  } else if (reflink == "auto") {
+    options.reflink = CopyEngine::Reflink::Auto;
+  } else {
+    std::cerr << "Invalid --reflink value '" << reflink
+              << "': expected auto, always or never." << std::endl;
+    return 1;
+  }
+
+  std::string durability = program.get<std::string>("--durability");
+  if (durability == "none") {
+    options.durability = SyncTracker::Policy::None;
+  } else if (durability == "batch") {
+    options.durability = SyncTracker::Policy::Batch;
+  } else if (durability == "file") {
+    options.durability = SyncTracker::Policy::File;
+  } else {
+    std::cerr << "Invalid --durability value '" << durability
+              << "': expected none, batch or file." << std::endl;
+    return 1;
+  }
+
+  std::string mode = program.get<std::string>("--mode");
+  if (mode == "move") {
     options.operation = MergeManager::Operation::Move;
     std::cout << "Running in MOVE mode. Original files will be deleted."
               << std::endl;
+  } else if (mode == "link") {
+    options.operation = MergeManager::Operation::Link;
+    std::cout << "Running in LINK mode. Destination files will be hard links "
+                 "to the originals."
+              << std::endl;
   } else {
     options.operation = MergeManager::Operation::Copy;
     std::cout << "Running in COPY mode. Original files will be preserved."
@@ -0,0 +1,120 @@
+#include "../src/BufferPool/BufferPool.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+using namespace std::chrono_literals;
+
+TEST(BufferPoolTest, HandsOutAlignedPowerOfTwoBuffers) {
+  BufferPool pool;
+  BufferPool::Lease small = pool.acquire(1);
+  BufferPool::Lease odd = pool.acquire(300 * 1024);
+  BufferPool::Lease huge = pool.acquire(1ull << 30);
+
+  ASSERT_EQ(small.size(), BufferPool::kMinBufferSize);
+  ASSERT_EQ(odd.size(), 512u * 1024);
+  ASSERT_EQ(huge.size(), BufferPool::kMaxBufferSize);
+  for (const auto *lease : {&small, &odd, &huge}) {
+    ASSERT_EQ(reinterpret_cast<std::uintptr_t>(lease->data()) % 4096, 0u);
+  }
+}
+
+TEST(BufferPoolTest, ReusesReturnedBuffers) {
+  BufferPool pool;
+  char *first = nullptr;
+  {
+    BufferPool::Lease lease = pool.acquire(1024 * 1024);
+    first = lease.data();
+  }
+  BufferPool::Lease again = pool.acquire(1024 * 1024);
+  ASSERT_EQ(again.data(), first);
+  ASSERT_EQ(pool.allocated(), 1024u * 1024);
+}
+
+TEST(BufferPoolTest, ShrinksBuffersWhenTheBudgetIsShort) {
+  BufferPool pool(1024 * 1024);
+  BufferPool::Lease big = pool.acquire(768 * 1024);
+  ASSERT_EQ(big.size(), 1024u * 1024);
+
+  // Nothing fits next to it; the idle small buffers of the budget are gone.
+  ASSERT_FALSE(pool.tryAcquire(64 * 1024));
+  big = BufferPool::Lease();
+
+  BufferPool::Lease half = pool.acquire(512 * 1024);
+  BufferPool::Lease rest = pool.acquire(1024 * 1024);
+  ASSERT_EQ(half.size(), 512u * 1024);
+  ASSERT_EQ(rest.size(), 512u * 1024);
+  ASSERT_LE(pool.allocated(), 1024u * 1024);
+}
+
+TEST(BufferPoolTest, WaitsForABufferOnceTheBudgetIsUsedUp) {
+  BufferPool pool(BufferPool::kMinBufferSize);
+  BufferPool::Lease held = pool.acquire(1);
+  std::atomic<bool> served{false};
+  std::thread borrower([&] {
+    BufferPool::Lease lease = pool.acquire(1);
+    served = true;
+  });
+
+  std::this_thread::sleep_for(50ms);
+  ASSERT_FALSE(served);
+  held = BufferPool::Lease();
+  borrower.join();
+  ASSERT_TRUE(served);
+  ASSERT_EQ(pool.allocated(), BufferPool::kMinBufferSize);
+}
+
+TEST(BufferPoolTest, ServesABorrowerEvenWhenTheBudgetIsTooSmall) {
+  BufferPool pool(1024);
+  BufferPool::Lease lease = pool.acquire(1024 * 1024);
+  ASSERT_TRUE(lease);
+  ASSERT_EQ(lease.size(), BufferPool::kMinBufferSize);
+}
+
+TEST(BufferPoolTest, LoweringTheBudgetFreesIdleBuffers) {
+  BufferPool pool;
+  { BufferPool::Lease lease = pool.acquire(4 * 1024 * 1024); }
+  ASSERT_EQ(pool.allocated(), 4u * 1024 * 1024);
+  pool.configure(1024 * 1024, false);
+  ASSERT_EQ(pool.allocated(), 0u);
+}
+
+TEST(ChunkSizerTest, GrowsWhileLargerChunksAreFaster) {
+  BufferPool pool;
+  pool.reportChunkSize(64 * 1024);
+  {
+    ChunkSizer sizer(pool, 1ull << 30, 8 * 1024 * 1024);
+    ASSERT_EQ(sizer.size(), 64u * 1024);
+    // Fixed cost per call: doubling the chunk nearly doubles throughput,
+    // until 1 MiB, where it levels off.
+    while (sizer.size() < 1024 * 1024) {
+      size_t before = sizer.size();
+      for (unsigned i = 0; i < ChunkSizer::kSamples; ++i) {
+        sizer.record(sizer.size(), 1ms);
+      }
+      ASSERT_EQ(sizer.size(), before * 2);
+    }
+    for (unsigned i = 0; i < ChunkSizer::kSamples; ++i) {
+      sizer.record(sizer.size(), 2ms);
+    }
+    ASSERT_EQ(sizer.size(), 1024u * 1024);
+    // Settled: later samples change nothing.
+    for (unsigned i = 0; i < 3 * ChunkSizer::kSamples; ++i) {
+      sizer.record(sizer.size(), 1ms);
+    }
+    ASSERT_EQ(sizer.size(), 1024u * 1024);
+  }
+  // The next copy starts where this one settled.
+  ASSERT_EQ(pool.preferredChunkSize(), 1024u * 1024);
+}
+
+TEST(ChunkSizerTest, NeverExceedsTheFileOrTheBuffer) {
+  BufferPool pool;
+  pool.reportChunkSize(8 * 1024 * 1024);
+  ChunkSizer small(pool, 100 * 1024, 8 * 1024 * 1024);
+  ASSERT_EQ(small.size(), 128u * 1024);
+  ChunkSizer capped(pool, 1ull << 30, 2 * 1024 * 1024);
+  ASSERT_EQ(capped.size(), 2u * 1024 * 1024);
+}
@@ -0,0 +1,103 @@
+#include "../src/ContentHash/ContentHash.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+std::string pattern(size_t size) {
+  std::string data(size, '\0');
+  std::uint64_t state = 12345;
+  for (auto &c : data) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    c = static_cast<char>(state >> 56);
+  }
+  return data;
+}
+
+std::uint64_t hashOf(const std::string &data,
+                     ContentHash::Backend backend =
+                         ContentHash::Backend::Scalar) {
+  ContentHash hash(backend);
+  hash.update(data.data(), data.size());
+  return hash.digest();
+}
+
+// Around the stripe and block boundaries, and a few blocks past them.
+const std::vector<size_t> kSizes = {0,    1,    63,   64,   65,    1023,
+                                    1024, 1025, 2048, 4113, 100000};
+} // namespace
+
+TEST(ContentHashTest, EveryBackendGivesTheSameHash) {
+  for (auto backend :
+       {ContentHash::Backend::Avx2, ContentHash::Backend::Avx512}) {
+    if (!ContentHash::supported(backend)) {
+      continue;
+    }
+    for (size_t size : kSizes) {
+      std::string data = pattern(size);
+      ASSERT_EQ(hashOf(data, backend), hashOf(data)) << size;
+    }
+  }
+}
+
+TEST(ContentHashTest, SplittingTheInputDoesNotChangeTheHash) {
+  std::string data = pattern(100000);
+  std::uint64_t whole = hashOf(data);
+  for (size_t piece : {1, 7, 64, 1000, 1024, 4096, 65536}) {
+    ContentHash hash;
+    for (size_t offset = 0; offset < data.size(); offset += piece) {
+      hash.update(data.data() + offset,
+                  std::min(piece, data.size() - offset));
+    }
+    ASSERT_EQ(hash.digest(), whole) << piece;
+  }
+}
+
+TEST(ContentHashTest, ContentsAndLengthsChangeTheHash) {
+  for (size_t size : kSizes) {
+    if (size == 0) {
+      continue;
+    }
+    std::string data = pattern(size);
+    std::string changed = data;
+    changed[size / 2] = static_cast<char>(changed[size / 2] ^ 1);
+    ASSERT_NE(hashOf(data), hashOf(changed)) << size;
+  }
+  // Padding the last stripe must not make trailing zeros disappear.
+  ASSERT_NE(hashOf(std::string(10, '\0')), hashOf(std::string(11, '\0')));
+  ASSERT_NE(hashOf(""), hashOf(std::string(1, '\0')));
+}
+
+TEST(ContentHashTest, HexRoundTrips) {
+  std::uint64_t value = 0x0123456789abcdefULL;
+  std::string text = ContentHash::toHex(value);
+  ASSERT_EQ(text, "0123456789abcdef");
+  std::uint64_t parsed = 0;
+  ASSERT_TRUE(ContentHash::fromHex(text, parsed));
+  ASSERT_EQ(parsed, value);
+  ASSERT_FALSE(ContentHash::fromHex("0123", parsed));
+  ASSERT_FALSE(ContentHash::fromHex("0123456789abcdeg", parsed));
+}
+
+TEST(ContentHashTest, HashFileReadsTheWholeFile) {
+  fs::path path = fs::path(testing::TempDir()) / "EkatraContentHashTest.bin";
+  std::string data = pattern(3 * 1024 * 1024 + 77);
+  std::ofstream(path, std::ios::binary)
+      .write(data.data(), static_cast<std::streamsize>(data.size()));
+
+  std::uintmax_t size = 0;
+  long long progress = 0;
+  std::error_code ec;
+  std::uint64_t hash = ContentHash::hashFile(
+      path, size, [&progress](long long bytes) { progress = bytes; }, ec);
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(size, data.size());
+  ASSERT_EQ(progress, static_cast<long long>(data.size()));
+  ASSERT_EQ(hash, hashOf(data));
+
+  fs::remove(path);
+  ContentHash::hashFile(path, size, [](long long) {}, ec);
+  ASSERT_TRUE(ec);
+}
@@ -0,0 +1,415 @@
+#include "../src/ContentHash/ContentHash.h"
+#include "../src/CopyEngine/CopyEngine.h"
+#include "../src/ThreadPool/ThreadPool.h"
+#include "gtest/gtest.h"
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+class CopyEngineTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    baseDir = fs::path(testing::TempDir()) / "EkatraCopyEngineTest";
+    fs::remove_all(baseDir);
+    fs::create_directories(baseDir);
+    source = baseDir / "source.bin";
+    target = baseDir / "target.bin";
+
+    // Not a multiple of any chunk size, so the tail is exercised.
+    content.resize(3 * 1024 * 1024 + 12345);
+    for (size_t i = 0; i < content.size(); ++i) {
+      content[i] = static_cast<char>((i * 131) ^ (i >> 9));
+    }
+    std::ofstream(source, std::ios::binary)
+        .write(content.data(), static_cast<std::streamsize>(content.size()));
+  }
+
+  void TearDown() override {
+    std::error_code ec;
+    fs::remove_all(baseDir, ec);
+  }
+
+  CopyEngine::Result copyWith(CopyEngine::Options options,
+                              std::vector<long long> &progress,
+                              std::error_code &ec) {
+    int in = ::open(source.c_str(), O_RDONLY);
+    int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CopyEngine::Result result = CopyEngine(options).copy(
+        in, out, content.size(),
+        [&progress](long long bytes) { progress.push_back(bytes); }, ec);
+    ::close(in);
+    ::close(out);
+    return result;
+  }
+
+  std::string readTarget() {
+    std::ifstream in(target, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+  }
+
+  fs::path baseDir;
+  fs::path source;
+  fs::path target;
+  std::string content;
+};
+
+TEST_F(CopyEngineTest, EveryTierCopiesTheWholeFile) {
+  for (auto method :
+       {CopyEngine::Method::CopyFileRange, CopyEngine::Method::Sendfile,
+        CopyEngine::Method::Splice, CopyEngine::Method::ReadWrite}) {
+    CopyEngine::Options options;
+    options.firstMethod = method;
+    options.chunkSize = 1024 * 1024;
+    std::vector<long long> progress;
+    std::error_code ec;
+    CopyEngine::Result result = copyWith(options, progress, ec);
+
+    ASSERT_FALSE(ec) << ec.message();
+    ASSERT_EQ(result.bytes, content.size());
+    ASSERT_TRUE(readTarget() == content);
+    ASSERT_GE(progress.size(), 2u);
+    ASSERT_EQ(progress.back(), static_cast<long long>(content.size()));
+    for (size_t i = 1; i < progress.size(); ++i) {
+      ASSERT_LE(progress[i - 1], progress[i]);
+    }
+  }
+}
+
+TEST_F(CopyEngineTest, FallsBackWhenTheKernelTierIsRefused) {
+  // copy_file_range and sendfile both refuse an O_APPEND target, so the
+  // copy has to finish with read/write.
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                   0644);
+  std::error_code ec;
+  CopyEngine::Result result =
+      CopyEngine().copy(in, out, content.size(), [](long long) {}, ec);
+  ::close(in);
+  ::close(out);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.bytes, content.size());
+  ASSERT_TRUE(readTarget() == content);
+}
+
+TEST_F(CopyEngineTest, SpliceMovesTheFileThroughAPipe) {
+  CopyEngine::Options options;
+  options.firstMethod = CopyEngine::Method::Splice;
+  // Larger than the pipe, so it is filled and drained several times.
+  options.chunkSize = 4 * CopyEngine::kPipeSize;
+  std::vector<long long> progress;
+  std::error_code ec;
+  CopyEngine::Result result = copyWith(options, progress, ec);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.method, CopyEngine::Method::Splice);
+  ASSERT_TRUE(readTarget() == content);
+  ASSERT_GE(progress.size(), 4u);
+}
+
+TEST_F(CopyEngineTest, SplicePipeCarriesNothingOverFromAFailedCopy) {
+  CopyEngine::Options options;
+  options.firstMethod = CopyEngine::Method::Splice;
+  // The pipe is filled, then the target fails: a pipe nobody reads.
+  int in = ::open(source.c_str(), O_RDONLY);
+  int broken[2];
+  ASSERT_EQ(::pipe(broken), 0);
+  ::close(broken[0]);
+  void (*previous)(int) = ::signal(SIGPIPE, SIG_IGN);
+  std::error_code ec;
+  CopyEngine(options).copy(in, broken[1], content.size(), [](long long) {},
+                           ec);
+  ::signal(SIGPIPE, previous);
+  ::close(in);
+  ::close(broken[1]);
+  ASSERT_EQ(ec, std::errc::broken_pipe);
+
+  // The same thread's pipe copies the next file from its first byte.
+  std::vector<long long> progress;
+  ec.clear();
+  CopyEngine::Result result = copyWith(options, progress, ec);
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.method, CopyEngine::Method::Splice);
+  ASSERT_TRUE(readTarget() == content);
+}
+
+TEST_F(CopyEngineTest, SpliceWithoutAPipeOnlyGivesUpOnThatFile) {
+  CopyEngine::Options options;
+  options.firstMethod = CopyEngine::Method::Splice;
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  // A new thread has no pipe yet, and with the descriptor limit at the
+  // lowest free descriptor it cannot create one.
+  struct rlimit saved;
+  ASSERT_EQ(::getrlimit(RLIMIT_NOFILE, &saved), 0);
+  int lowestFree = ::dup(out);
+  ::close(lowestFree);
+  struct rlimit lowered = saved;
+  lowered.rlim_cur = static_cast<rlim_t>(lowestFree);
+  ASSERT_EQ(::setrlimit(RLIMIT_NOFILE, &lowered), 0);
+  std::error_code ec;
+  CopyEngine::Result result;
+  std::thread([&] {
+    result = CopyEngine(options).copy(in, out, content.size(),
+                                      [](long long) {}, ec);
+  }).join();
+  ::setrlimit(RLIMIT_NOFILE, &saved);
+  ::close(in);
+  ::close(out);
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.method, CopyEngine::Method::ReadWrite);
+  ASSERT_TRUE(readTarget() == content);
+
+  // The shortage was not taken for the filesystems refusing splice.
+  std::vector<long long> progress;
+  result = copyWith(options, progress, ec);
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.method, CopyEngine::Method::Splice);
+  ASSERT_TRUE(readTarget() == content);
+}
+
+TEST_F(CopyEngineTest, ReportsWriteErrors) {
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_RDONLY | O_CREAT, 0644);
+  std::error_code ec;
+  CopyEngine().copy(in, out, content.size(), [](long long) {}, ec);
+  ::close(in);
+  ::close(out);
+  ASSERT_TRUE(ec);
+}
+TEST_F(CopyEngineTest, ReflinkAutoCopiesWhereCloningIsRefused) {
+  CopyEngine::Options options;
+  options.reflink = CopyEngine::Reflink::Auto;
+  std::vector<long long> progress;
+  std::error_code ec;
+  CopyEngine::Result result = copyWith(options, progress, ec);
+
+  // Either way the target ends up with the same data.
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.bytes, content.size());
+  ASSERT_TRUE(readTarget() == content);
+  ASSERT_EQ(progress.back(), static_cast<long long>(content.size()));
+}
+
+TEST_F(CopyEngineTest, ReflinkAlwaysNeverFallsBackToCopying) {
+  CopyEngine::Options options;
+  options.reflink = CopyEngine::Reflink::Always;
+  std::vector<long long> progress;
+  std::error_code ec;
+  CopyEngine::Result result = copyWith(options, progress, ec);
+
+  ASSERT_EQ(result.method, CopyEngine::Method::Reflink);
+  if (ec) {
+    // The temp folder's filesystem cannot clone: nothing may be copied.
+    ASSERT_EQ(result.bytes, 0u);
+    ASSERT_TRUE(readTarget().empty());
+  } else {
+    ASSERT_TRUE(readTarget() == content);
+  }
+}
+
+TEST_F(CopyEngineTest, CopiesLargeFilesInParallelRanges) {
+  ThreadPool pool(3);
+  CopyEngine::Options options;
+  options.pool = &pool;
+  options.parallelThreshold = 1;
+  options.rangeSize = 1024 * 1024;
+  std::vector<long long> progress;
+  std::error_code ec;
+  CopyEngine::Result result = copyWith(options, progress, ec);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.bytes, content.size());
+  ASSERT_TRUE(readTarget() == content);
+  // One bar for all ranges: the combined count only grows.
+  ASSERT_EQ(progress.back(), static_cast<long long>(content.size()));
+  for (size_t i = 1; i < progress.size(); ++i) {
+    ASSERT_LE(progress[i - 1], progress[i]);
+  }
+}
+
+TEST_F(CopyEngineTest, ParallelCopyPicksUpDataAddedSinceTheScan) {
+  ThreadPool pool(2);
+  CopyEngine::Options options;
+  options.pool = &pool;
+  options.parallelThreshold = 1;
+  options.rangeSize = 1024 * 1024;
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  std::error_code ec;
+  // The scan saw only the first two MiB.
+  CopyEngine::Result result = CopyEngine(options).copy(
+      in, out, 2 * 1024 * 1024, [](long long) {}, ec);
+  ::close(in);
+  ::close(out);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.bytes, content.size());
+  ASSERT_TRUE(readTarget() == content);
+}
+
+TEST_F(CopyEngineTest, DirectIoCopiesTheUnalignedTail) {
+  int probe = ::open(target.c_str(), O_WRONLY | O_CREAT, 0644);
+  bool supported = CopyEngine::enterDirectMode(probe);
+  ::close(probe);
+
+  ThreadPool pool(2);
+  for (ThreadPool *ranges : {static_cast<ThreadPool *>(nullptr), &pool}) {
+    CopyEngine::Options options;
+    options.directIo = true;
+    options.directIoThreshold = 1;
+    options.pool = ranges;
+    options.parallelThreshold = 1;
+    options.rangeSize = 1024 * 1024;
+    std::vector<long long> progress;
+    std::error_code ec;
+    CopyEngine::Result result = copyWith(options, progress, ec);
+
+    ASSERT_FALSE(ec) << ec.message();
+    // Where the filesystem refuses O_DIRECT, the copy goes through the
+    // cache instead.
+    ASSERT_EQ(result.method == CopyEngine::Method::Direct, supported);
+    ASSERT_EQ(result.bytes, content.size());
+    ASSERT_EQ(progress.back(), static_cast<long long>(content.size()));
+    ASSERT_TRUE(readTarget() == content);
+  }
+}
+
+TEST_F(CopyEngineTest, GivesBackThePreallocationOfAFileThatShrank) {
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  std::error_code ec;
+  // The scan saw 64 MiB; the file has less than 4 now.
+  CopyEngine::Result result = CopyEngine().copy(
+      in, out, 64 * 1024 * 1024, [](long long) {}, ec);
+  struct stat st;
+  ASSERT_EQ(::fstat(out, &st), 0);
+  ::close(in);
+  ::close(out);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.bytes, content.size());
+  ASSERT_TRUE(readTarget() == content);
+  ASSERT_LT(static_cast<std::uintmax_t>(st.st_blocks) * 512,
+            content.size() + 1024 * 1024);
+}
+
+TEST_F(CopyEngineTest, DropBehindKeepsEveryTierIntact) {
+  for (CopyEngine::Method first :
+       {CopyEngine::Method::CopyFileRange, CopyEngine::Method::ReadWrite}) {
+    CopyEngine::Options options;
+    options.firstMethod = first;
+    options.chunkSize = 256 * 1024;
+    options.dropBehindWindow = 512 * 1024;
+    std::vector<long long> progress;
+    std::error_code ec;
+    CopyEngine::Result result = copyWith(options, progress, ec);
+
+    ASSERT_FALSE(ec) << ec.message();
+    ASSERT_EQ(result.bytes, content.size());
+    ASSERT_TRUE(readTarget() == content);
+  }
+}
+
+TEST_F(CopyEngineTest, KeepsTheHolesOfSparseFiles) {
+  // Data, a 16 MiB hole, data, and a hole to the end.
+  const off_t hole = 16 * 1024 * 1024;
+  const off_t size = 2 * hole + 8 * 1024 * 1024;
+  {
+    int fd = ::open(source.c_str(), O_WRONLY | O_TRUNC);
+    ASSERT_EQ(::pwrite(fd, content.data(), 100000, 0), 100000);
+    ASSERT_EQ(::pwrite(fd, content.data(), 200000, hole), 200000);
+    ASSERT_EQ(::ftruncate(fd, size), 0);
+    ::close(fd);
+  }
+  int in = ::open(source.c_str(), O_RDONLY);
+  if (!CopyEngine::isSparse(in)) {
+    ::close(in);
+    GTEST_SKIP() << "the filesystem does not support holes";
+  }
+  std::string expected(static_cast<size_t>(size), '\0');
+  expected.replace(0, 100000, content, 0, 100000);
+  expected.replace(static_cast<size_t>(hole), 200000, content, 0, 200000);
+
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  std::vector<long long> progress;
+  std::error_code ec;
+  CopyEngine::Result result = CopyEngine().copy(
+      in, out, static_cast<std::uintmax_t>(size),
+      [&progress](long long bytes) { progress.push_back(bytes); }, ec);
+  struct stat st;
+  ASSERT_EQ(::fstat(out, &st), 0);
+  ::close(in);
+  ::close(out);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.bytes, static_cast<std::uintmax_t>(size));
+  // The bar counts the holes too.
+  ASSERT_EQ(progress.back(), static_cast<long long>(size));
+  ASSERT_TRUE(readTarget() == expected);
+  ASSERT_LT(st.st_blocks * 512, static_cast<off_t>(4 * 1024 * 1024));
+}
+
+TEST_F(CopyEngineTest, HashesTheBytesItCopiesOnEveryPath) {
+  ContentHash expected;
+  expected.update(content.data(), content.size());
+  ThreadPool pool(3);
+
+  std::vector<CopyEngine::Options> variants(3);
+  // Would split the file over the pool without the hash.
+  variants[1].pool = &pool;
+  variants[1].parallelThreshold = 0;
+  variants[1].rangeSize = 1024 * 1024;
+  variants[2].directIo = true;
+  variants[2].directIoThreshold = 0;
+  for (auto &options : variants) {
+    options.hash = true;
+    std::vector<long long> progress;
+    std::error_code ec;
+    CopyEngine::Result result = copyWith(options, progress, ec);
+    ASSERT_FALSE(ec) << ec.message();
+    ASSERT_EQ(result.hash, expected.digest());
+    ASSERT_TRUE(readTarget() == content);
+  }
+}
+
+TEST_F(CopyEngineTest, HashesTheHolesOfSparseFilesAsZeros) {
+  const off_t size = 8 * 1024 * 1024;
+  {
+    int fd = ::open(source.c_str(), O_WRONLY | O_TRUNC);
+    ASSERT_EQ(::pwrite(fd, content.data(), 100000, 1024 * 1024), 100000);
+    ASSERT_EQ(::ftruncate(fd, size), 0);
+    ::close(fd);
+  }
+  std::string expected(static_cast<size_t>(size), '\0');
+  expected.replace(1024 * 1024, 100000, content, 0, 100000);
+  ContentHash hash;
+  hash.update(expected.data(), expected.size());
+
+  int in = ::open(source.c_str(), O_RDONLY);
+  int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CopyEngine::Options options;
+  options.hash = true;
+  std::error_code ec;
+  CopyEngine::Result result = CopyEngine(options).copy(
+      in, out, static_cast<std::uintmax_t>(size), [](long long) {}, ec);
+  ::close(in);
+  ::close(out);
+
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_EQ(result.hash, hash.digest());
+  ASSERT_TRUE(readTarget() == expected);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include "../src/DeviceScheduler/DeviceScheduler.h"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+// Device ids far from real ones, so nothing is found in sysfs.
+constexpr std::uint64_t kDiskA = 0xA0000001;
+constexpr std::uint64_t kDiskB = 0xA0000002;
+constexpr std::uint64_t kTarget = 0xA0000003;
+
+// Counts how many tasks use each device at once.
+class Tracker {
+public:
+  void enter(std::uint64_t device) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned now = ++m_active[device];
+    m_peak[device] = std::max(m_peak[device], now);
+  }
+  void leave(std::uint64_t device) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    --m_active[device];
+  }
+  unsigned peak(std::uint64_t device) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_peak[device];
+  }
+
+private:
+  std::mutex m_mutex;
+  std::map<std::uint64_t, unsigned> m_active;
+  std::map<std::uint64_t, unsigned> m_peak;
+};
+} // namespace
+
+TEST(DeviceSchedulerTest, UnknownDevicesAreNotRotational) {
+  ASSERT_FALSE(DeviceScheduler::isRotational(0));
+  ThreadPool pool(2);
+  DeviceScheduler scheduler(pool, 16);
+  ASSERT_FALSE(scheduler.rotational(kDiskA));
+}
+
+TEST(DeviceSchedulerTest, KeepsEveryDeviceWithinItsLimit) {
+  ThreadPool pool(8);
+  DeviceScheduler scheduler(pool, 1000);
+  scheduler.setLimit(kDiskA, 1);
+  scheduler.setLimit(kDiskB, 3);
+  scheduler.setLimit(kTarget, 4);
+  Tracker tracker;
+  std::atomic<int> done{0};
+  for (int i = 0; i < 40; ++i) {
+    std::uint64_t source = i % 2 == 0 ? kDiskA : kDiskB;
+    scheduler.submit(source, kTarget, [&, source] {
+      tracker.enter(source);
+      tracker.enter(kTarget);
+      std::this_thread::sleep_for(2ms);
+      tracker.leave(kTarget);
+      tracker.leave(source);
+      ++done;
+    });
+  }
+  scheduler.wait();
+
+  ASSERT_EQ(done.load(), 40);
+  ASSERT_EQ(tracker.peak(kDiskA), 1u);
+  ASSERT_LE(tracker.peak(kDiskB), 3u);
+  ASSERT_LE(tracker.peak(kTarget), 4u);
+  ASSERT_EQ(scheduler.peakConcurrency(kDiskA), 1u);
+  // Both disks were read at the same time.
+  ASSERT_GE(tracker.peak(kTarget), 2u);
+}
+
+TEST(DeviceSchedulerTest, ASlowDiskDoesNotHoldUpTheOthers) {
+  ThreadPool pool(4);
+  DeviceScheduler scheduler(pool, 1000);
+  scheduler.setLimit(kDiskA, 1);
+  std::mutex mutex;
+  std::vector<std::uint64_t> finished;
+  auto task = [&](std::uint64_t source, std::chrono::milliseconds time) {
+    return [&, source, time] {
+      std::this_thread::sleep_for(time);
+      std::lock_guard<std::mutex> lock(mutex);
+      finished.push_back(source);
+    };
+  };
+  // Disk A's files come first in scan order and take long.
+  for (int i = 0; i < 5; ++i) {
+    scheduler.submit(kDiskA, kTarget, task(kDiskA, 20ms));
+  }
+  for (int i = 0; i < 5; ++i) {
+    scheduler.submit(kDiskB, kTarget, task(kDiskB, 1ms));
+  }
+  scheduler.wait();
+
+  ASSERT_EQ(finished.size(), 10u);
+  // Disk B was done long before disk A.
+  ASSERT_EQ(finished.back(), kDiskA);
+  ASSERT_EQ(finished[5], kDiskA);
+}
+
+TEST(DeviceSchedulerTest, WaitRethrowsWhatATaskThrew) {
+  ThreadPool pool(2);
+  DeviceScheduler scheduler(pool, 4);
+  std::atomic<int> done{0};
+  scheduler.submit(kDiskA, kTarget,
+                   [] { throw std::runtime_error("copy failed"); });
+  for (int i = 0; i < 10; ++i) {
+    scheduler.submit(kDiskA, kTarget, [&done] { ++done; });
+  }
+  ASSERT_THROW(scheduler.wait(), std::runtime_error);
+  // The devices were freed for the tasks behind it.
+  ASSERT_EQ(done.load(), 10);
+}
@@ -0,0 +1,82 @@
+#include "../src/DirHandle/DirHandle.h"
+#include "gtest/gtest.h"
+#include <fstream>
+
+class DirHandleTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    baseDir = fs::path(testing::TempDir()) / "EkatraDirHandleTest";
+    fs::remove_all(baseDir);
+    fs::create_directories(baseDir);
+  }
+
+  void TearDown() override {
+    std::error_code ec;
+    fs::remove_all(baseDir, ec);
+  }
+
+  fs::path baseDir;
+};
+
+TEST_F(DirHandleTest, CacheCreatesMissingFoldersAndReusesHandles) {
+  DirHandleCache cache;
+  auto images = cache.get(baseDir / "Media" / "Images", true);
+  ASSERT_TRUE(fs::is_directory(baseDir / "Media" / "Images"));
+  ASSERT_EQ(images->path(), baseDir / "Media" / "Images");
+
+  // Same folder, spelled differently.
+  ASSERT_EQ(cache.get(baseDir / "Media" / "Images" / "", false), images);
+  ASSERT_EQ(cache.get(baseDir / "Media" / "." / "Images", false), images);
+}
+
+TEST_F(DirHandleTest, MissingFolderThrowsWithoutCreate) {
+  DirHandleCache cache;
+  ASSERT_THROW(cache.get(baseDir / "missing", false), fs::filesystem_error);
+  ASSERT_FALSE(fs::exists(baseDir / "missing"));
+}
+
+TEST_F(DirHandleTest, EvictsLeastRecentlyUsedFolders) {
+  DirHandleCache cache(2);
+  auto first = cache.get(baseDir / "a", true);
+  cache.get(baseDir / "b", true);
+  cache.get(baseDir / "c", true);
+  // 'a' was evicted, so a new handle is opened; the old one stays usable.
+  ASSERT_NE(cache.get(baseDir / "a", false), first);
+  ASSERT_EQ(first->path(), baseDir / "a");
+}
+
+TEST_F(DirHandleTest, RenamesAndRemovesRelativeToHandles) {
+  DirHandleCache cache;
+  auto from = cache.get(baseDir / "from", true);
+  auto to = cache.get(baseDir / "to", true);
+  std::ofstream(baseDir / "from" / "file.txt") << "data";
+
+  std::error_code ec;
+  from->rename("file.txt", *to, "renamed.txt", ec);
+  ASSERT_FALSE(ec);
+  ASSERT_TRUE(fs::exists(baseDir / "to" / "renamed.txt"));
+  ASSERT_FALSE(fs::exists(baseDir / "from" / "file.txt"));
+
+  to->remove("renamed.txt", ec);
+  ASSERT_FALSE(ec);
+  ASSERT_FALSE(fs::exists(baseDir / "to" / "renamed.txt"));
+
+  to->remove("renamed.txt", ec);
+  ASSERT_TRUE(ec);
+}
+
+TEST_F(DirHandleTest, LinksRelativeToHandles) {
+  DirHandleCache cache;
+  auto from = cache.get(baseDir / "from", true);
+  auto to = cache.get(baseDir / "to", true);
+  std::ofstream(baseDir / "from" / "file.txt") << "data";
+
+  std::error_code ec;
+  from->link("file.txt", *to, "linked.txt", ec);
+  ASSERT_FALSE(ec) << ec.message();
+  ASSERT_TRUE(fs::equivalent(baseDir / "from" / "file.txt",
+                             baseDir / "to" / "linked.txt"));
+
+  from->link("file.txt", *to, "linked.txt", ec);
+  ASSERT_EQ(ec, std::errc::file_exists);
+}
@@ -0,0 +1,410 @@
+#include "../src/DirectoryScanner/DirectoryScanner.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// Test fixture for DirectoryScanner tests.
+// Builds a small tree with nested folders, dotfiles and symlinks.
+class DirectoryScannerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    baseDir = fs::path(testing::TempDir()) / "EkatraScannerTest";
+    fs::remove_all(baseDir);
+    rootA = baseDir / "a";
+    rootB = baseDir / "b";
+
+    createFile(rootA / "top.txt");
+    createFile(rootA / ".hidden");
+    createFile(rootA / ".git" / "config");
+    createFile(rootA / ".git" / "objects" / "pack.idx");
+    createFile(rootA / "one" / "two" / "three" / "deep.py");
+    createFile(rootA / "one" / "sibling.jpg");
+    for (int i = 0; i < 50; ++i) {
+      createFile(rootA / "wide" / ("dir" + std::to_string(i)) / "f.bin");
+    }
+    createFile(rootB / "other.pdf");
+  }
+
+  void TearDown() override {
+    std::error_code ec;
+    fs::remove_all(baseDir, ec);
+  }
+
+  void createFile(const fs::path &path) {
+    fs::create_directories(path.parent_path());
+    std::ofstream ofs(path);
+    ofs << "test";
+  }
+
+  // A single-threaded recursive walk with the expected filtering.
+  std::vector<std::string> referenceWalk(const fs::path &root,
+                                         bool includeHidden) {
+    std::vector<std::string> files;
+    for (auto it = fs::recursive_directory_iterator(root);
+         it != fs::recursive_directory_iterator(); ++it) {
+      bool hidden = it->path().filename().string()[0] == '.';
+      if (!includeHidden && hidden) {
+        if (fs::is_directory(it->symlink_status())) {
+          it.disable_recursion_pending();
+        }
+        continue;
+      }
+      if (fs::is_regular_file(it->symlink_status())) {
+        files.push_back(it->path().string());
+      }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  std::vector<std::string> scanSorted(const std::vector<fs::path> &roots,
+                                      DirectoryScanner::Options options) {
+    FileList found;
+    DirectoryScanner(options).scan(roots, found);
+    std::vector<std::string> files;
+    for (size_t i = 0; i < found.size(); ++i) {
+      files.push_back(found.path(i).string());
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  fs::path baseDir;
+  fs::path rootA;
+  fs::path rootB;
+};
+
+TEST_F(DirectoryScannerTest, MatchesRecursiveWalk) {
+  DirectoryScanner::Options options;
+  options.threads = 4;
+  ASSERT_EQ(scanSorted({rootA}, options), referenceWalk(rootA, false));
+
+  options.includeHidden = true;
+  ASSERT_EQ(scanSorted({rootA}, options), referenceWalk(rootA, true));
+}
+
+TEST_F(DirectoryScannerTest, BackendsAgree) {
+  DirectoryScanner::Options fast;
+  DirectoryScanner::Options portable;
+  portable.backend = DirectoryScanner::Backend::Portable;
+  ASSERT_EQ(scanSorted({rootA, rootB}, fast),
+            scanSorted({rootA, rootB}, portable));
+
+  fast.includeHidden = true;
+  portable.includeHidden = true;
+  ASSERT_EQ(scanSorted({rootA, rootB}, fast),
+            scanSorted({rootA, rootB}, portable));
+}
+
+TEST_F(DirectoryScannerTest, IoUringBackendMatchesSynchronousStat) {
+  // More entries than one ring holds, so the batch takes several rounds.
+  for (int i = 0; i < 300; ++i) {
+    std::ofstream ofs(rootA / "wide" / ("many" + std::to_string(i) + ".txt"));
+    ofs << std::string(i, 'x');
+  }
+
+  DirectoryScanner::Options sync;
+  DirectoryScanner::Options batched;
+  batched.backend = DirectoryScanner::Backend::IoUring;
+  FileList expected;
+  FileList actual;
+  DirectoryScanner(sync).scan({rootA, rootB}, expected);
+  DirectoryScanner(batched).scan({rootA, rootB}, actual);
+
+  ASSERT_EQ(actual.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    FileRecord a = expected.record(i);
+    FileRecord b = actual.record(i);
+    ASSERT_EQ(a.path, b.path);
+    ASSERT_EQ(a.size, b.size);
+    ASSERT_EQ(a.mtime, b.mtime);
+    ASSERT_EQ(a.device, b.device);
+    ASSERT_EQ(a.inode, b.inode);
+    ASSERT_EQ(a.mode, b.mode);
+  }
+}
+
+TEST_F(DirectoryScannerTest, PrunesExcludedFoldersBeforeDescending) {
+  createFile(rootA / "node_modules" / "pkg" / "index.js");
+  createFile(rootA / "one" / "node_modules" / "x.js");
+  createFile(rootA / "one" / "cache.tmp");
+  ExcludeMatcher excludes;
+  excludes.add("node_modules");
+  excludes.add("wide/");
+  excludes.add("one/*.tmp");
+
+  for (auto backend : {DirectoryScanner::Backend::Auto,
+                       DirectoryScanner::Backend::Portable,
+                       DirectoryScanner::Backend::IoUring}) {
+    DirectoryScanner::Options options;
+    options.backend = backend;
+    options.exclude = &excludes;
+    DirectoryScanner scanner(options);
+    FileList found;
+    scanner.scan({rootA}, found);
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < found.size(); ++i) {
+      files.push_back(found.path(i).string());
+    }
+    std::sort(files.begin(), files.end());
+    std::vector<std::string> expected = {
+        (rootA / "one" / "sibling.jpg").string(),
+        (rootA / "one" / "two" / "three" / "deep.py").string(),
+        (rootA / "top.txt").string()};
+    std::sort(expected.begin(), expected.end());
+    ASSERT_EQ(files, expected);
+    // Two node_modules folders, wide/ and one/cache.tmp; nothing below a
+    // pruned folder is counted.
+    ASSERT_EQ(scanner.prunedEntries(), 4u);
+  }
+}
+
+TEST_F(DirectoryScannerTest, DoesNotDescendIntoHiddenDirectories) {
+  DirectoryScanner::Options options;
+  std::vector<std::string> files = scanSorted({rootA}, options);
+  ASSERT_EQ(std::count(files.begin(), files.end(),
+                       (rootA / ".git" / "config").string()),
+            0);
+
+  options.includeHidden = true;
+  files = scanSorted({rootA}, options);
+  ASSERT_EQ(std::count(files.begin(), files.end(),
+                       (rootA / ".git" / "config").string()),
+            1);
+  ASSERT_EQ(std::count(files.begin(), files.end(),
+                       (rootA / ".git" / "objects" / "pack.idx").string()),
+            1);
+}
+
+#ifndef _WIN32
+TEST_F(DirectoryScannerTest, SkipsSymbolicLinks) {
+  fs::create_symlink(rootA / "top.txt", rootA / "link.txt");
+  fs::create_directory_symlink(rootB, rootA / "linked_dir");
+
+  DirectoryScanner::Options options;
+  std::vector<std::string> files = scanSorted({rootA}, options);
+
+  ASSERT_EQ(files, referenceWalk(rootA, false));
+  ASSERT_EQ(std::count(files.begin(), files.end(),
+                       (rootA / "linked_dir" / "other.pdf").string()),
+            0);
+}
+#endif
+
+TEST_F(DirectoryScannerTest, GroupsOutputByRootDeterministically) {
+  DirectoryScanner::Options options;
+  options.threads = 8;
+
+  FileList first;
+  DirectoryScanner(options).scan({rootB, rootA}, first);
+  FileList second;
+  DirectoryScanner(options).scan({rootB, rootA}, second);
+
+  ASSERT_EQ(first.size(), 54u);
+  ASSERT_EQ(second.size(), first.size());
+  for (size_t i = 0; i < first.size(); ++i) {
+    ASSERT_EQ(first.path(i), second.path(i));
+  }
+  // rootB was listed first, so its single file comes first.
+  ASSERT_EQ(first.path(0), rootB / "other.pdf");
+  ASSERT_EQ(first.record(0).sourceIndex, 0u);
+  ASSERT_EQ(first.record(first.size() - 1).sourceIndex, 1u);
+}
+
+TEST_F(DirectoryScannerTest, CollectsMetadataFromOneStat) {
+  {
+    std::ofstream ofs(rootB / "other.pdf");
+    ofs << std::string(1234, 'x');
+  }
+
+  for (auto backend : {DirectoryScanner::Backend::Auto,
+                       DirectoryScanner::Backend::Portable,
+                       DirectoryScanner::Backend::IoUring}) {
+    DirectoryScanner::Options options;
+    options.backend = backend;
+    FileList found;
+    DirectoryScanner(options).scan({rootB}, found);
+
+    ASSERT_EQ(found.size(), 1u);
+    FileRecord record = found.record(0);
+    ASSERT_EQ(record.path, rootB / "other.pdf");
+    ASSERT_EQ(record.size, 1234u);
+#ifndef _WIN32
+    ASSERT_NE(record.inode, 0u);
+    ASSERT_NE(record.mtime, 0);
+#endif
+  }
+}
+
+#ifndef _WIN32
+TEST_F(DirectoryScannerTest, ScanIndexReusesUnchangedDirectories) {
+  // Listings of directories modified in the last moments are never cached,
+  // so age the whole tree first.
+  auto past = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  fs::last_write_time(rootA, past);
+  for (const auto &entry : fs::recursive_directory_iterator(rootA)) {
+    if (entry.is_directory()) {
+      fs::last_write_time(entry.path(), past);
+    }
+  }
+
+  fs::path indexFile = baseDir / "scan.ekatra-index";
+  DirectoryScanner::Options options;
+
+  ScanIndex first;
+  options.index = &first;
+  FileList firstFiles;
+  DirectoryScanner firstScanner(options);
+  ASSERT_FALSE(first.load(indexFile, firstScanner.filterKey()));
+  firstScanner.scan({rootA}, firstFiles);
+  ASSERT_TRUE(first.save(indexFile, firstScanner.filterKey()));
+  ASSERT_EQ(first.reusedDirectories(), 0u);
+
+  ScanIndex second;
+  options.index = &second;
+  FileList secondFiles;
+  DirectoryScanner secondScanner(options);
+  ASSERT_TRUE(second.load(indexFile, secondScanner.filterKey()));
+  secondScanner.scan({rootA}, secondFiles);
+  ASSERT_EQ(second.reusedDirectories(), first.scannedDirectories());
+  ASSERT_EQ(second.scannedDirectories(), 0u);
+  ASSERT_EQ(firstFiles.size(), secondFiles.size());
+  for (size_t i = 0; i < firstFiles.size(); ++i) {
+    ASSERT_EQ(firstFiles.path(i), secondFiles.path(i));
+    ASSERT_EQ(firstFiles.record(i).size, secondFiles.record(i).size);
+    ASSERT_EQ(firstFiles.record(i).inode, secondFiles.record(i).inode);
+  }
+  ASSERT_TRUE(second.save(indexFile, secondScanner.filterKey()));
+
+  // Adding a file bumps its directory's mtime, so that directory is re-read.
+  createFile(rootA / "one" / "new.txt");
+  ScanIndex third;
+  options.index = &third;
+  std::vector<std::string> files = [&] {
+    FileList found;
+    DirectoryScanner scanner(options);
+    third.load(indexFile, scanner.filterKey());
+    scanner.scan({rootA}, found);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < found.size(); ++i) {
+      names.push_back(found.path(i).string());
+    }
+    return names;
+  }();
+  ASSERT_EQ(third.scannedDirectories(), 1u);
+  ASSERT_EQ(std::count(files.begin(), files.end(),
+                       (rootA / "one" / "new.txt").string()),
+            1);
+}
+
+TEST_F(DirectoryScannerTest, ScanIndexTreatsDamagedFilesAsMisses) {
+  auto past = fs::file_time_type::clock::now() - std::chrono::hours(1);
+  fs::last_write_time(rootA, past);
+  for (const auto &entry : fs::recursive_directory_iterator(rootA)) {
+    if (entry.is_directory()) {
+      fs::last_write_time(entry.path(), past);
+    }
+  }
+  fs::path indexFile = baseDir / "scan.ekatra-index";
+  DirectoryScanner::Options options;
+  ScanIndex original;
+  options.index = &original;
+  FileList expected;
+  DirectoryScanner(options).scan({rootA}, expected);
+  ASSERT_TRUE(original.save(indexFile, DirectoryScanner(options).filterKey()));
+  std::string intact = [&] {
+    std::ifstream in(indexFile, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+  }();
+
+  // Rewrites the 8 bytes at offset of the saved index with value.
+  auto damage = [&](size_t offset, std::uint64_t value) {
+    std::string bytes = intact;
+    std::memcpy(&bytes[offset], &value, sizeof(value));
+    std::ofstream(indexFile, std::ios::binary | std::ios::trunc) << bytes;
+  };
+  // Scans with whatever index loads and checks nothing was lost.
+  auto scanWith = [&](bool loads) {
+    ScanIndex index;
+    options.index = &index;
+    DirectoryScanner scanner(options);
+    ASSERT_EQ(index.load(indexFile, scanner.filterKey()), loads);
+    FileList found;
+    scanner.scan({rootA}, found);
+    ASSERT_EQ(found.size(), expected.size());
+    if (!loads) {
+      ASSERT_EQ(index.reusedDirectories(), 0u);
+    }
+  };
+
+  // The header's directory count (offset 24), inflated by 2^61: times the
+  // 56-byte record that wraps back to the same file size.
+  std::uint64_t directories = 0;
+  std::memcpy(&directories, &intact[24], sizeof(directories));
+  damage(24, directories + (1ull << 61));
+  scanWith(false);
+
+  std::ofstream(indexFile, std::ios::binary | std::ios::trunc)
+      << intact.substr(0, intact.size() - 8);
+  scanWith(false);
+
+  // The first directory's path offset (right after the 48-byte header),
+  // so large that adding its length wraps around.
+  damage(48, ~0ull);
+  scanWith(true);
+}
+
+TEST_F(DirectoryScannerTest, ScanIndexIgnoresOtherExcludePatterns) {
+  ExcludeMatcher first;
+  ExcludeMatcher second;
+  first.add("*.jpg");
+  second.add("*.py");
+  DirectoryScanner::Options a;
+  DirectoryScanner::Options b;
+  a.exclude = &first;
+  b.exclude = &second;
+  ASSERT_NE(DirectoryScanner(a).filterKey(), DirectoryScanner(b).filterKey());
+  ASSERT_NE(DirectoryScanner(a).filterKey(),
+            DirectoryScanner(DirectoryScanner::Options()).filterKey());
+}
+
+TEST_F(DirectoryScannerTest, ScanIndexIgnoresOtherFilterSettings) {
+  fs::path indexFile = baseDir / "scan.ekatra-index";
+  DirectoryScanner::Options options;
+  ScanIndex index;
+  options.index = &index;
+  DirectoryScanner scanner(options);
+  FileList found;
+  scanner.scan({rootB}, found);
+  ASSERT_TRUE(index.save(indexFile, scanner.filterKey()));
+
+  options.includeHidden = true;
+  ScanIndex other;
+  ASSERT_FALSE(other.load(indexFile, DirectoryScanner(options).filterKey()));
+}
+#endif
+
+TEST_F(DirectoryScannerTest, FileListIsSmallerThanOnePathPerFile) {
+  for (int i = 0; i < 200; ++i) {
+    createFile(rootB / "photos" / "2024" / "holiday" /
+               ("IMG_" + std::to_string(1000 + i) + ".jpg"));
+  }
+
+  DirectoryScanner::Options options;
+  FileList found;
+  DirectoryScanner(options).scan({rootB}, found);
+
+  ASSERT_EQ(found.size(), 201u);
+  ASSERT_EQ(found.name(found.size() - 1), "IMG_1199.jpg");
+  ASSERT_EQ(found.path(found.size() - 1),
+            rootB / "photos" / "2024" / "holiday" / "IMG_1199.jpg");
+  ASSERT_LT(found.memoryUsage(), found.pathPerFileMemoryUsage());
+}
@@ -0,0 +1,75 @@
+#include "../src/ExcludeMatcher/ExcludeMatcher.h"
+#include "gtest/gtest.h"
+#include <fstream>
+
+TEST(ExcludeMatcherTest, PlainNamesMatchAtAnyDepth) {
+  ExcludeMatcher matcher;
+  matcher.add("node_modules");
+  ASSERT_TRUE(matcher.excludes("node_modules", "", true));
+  ASSERT_TRUE(matcher.excludes("node_modules", "", false));
+  ASSERT_FALSE(matcher.excludes("node_modules2", "", true));
+  ASSERT_FALSE(matcher.needsRelativePath());
+}
+
+TEST(ExcludeMatcherTest, NameGlobs) {
+  ExcludeMatcher matcher;
+  matcher.add("*.pyc");
+  matcher.add("build-?");
+  matcher.add("[Tt]emp*");
+  ASSERT_TRUE(matcher.excludes("module.pyc", "", false));
+  ASSERT_FALSE(matcher.excludes("module.py", "", false));
+  ASSERT_TRUE(matcher.excludes("build-1", "", true));
+  ASSERT_FALSE(matcher.excludes("build-10", "", true));
+  ASSERT_TRUE(matcher.excludes("Temporary", "", false));
+  ASSERT_TRUE(matcher.excludes("temp", "", false));
+  ASSERT_FALSE(matcher.excludes("attempt", "", false));
+}
+
+TEST(ExcludeMatcherTest, TrailingSlashOnlyMatchesFolders) {
+  ExcludeMatcher matcher;
+  matcher.add("build/");
+  ASSERT_TRUE(matcher.excludes("build", "", true));
+  ASSERT_FALSE(matcher.excludes("build", "", false));
+}
+
+TEST(ExcludeMatcherTest, PathPatternsAreAnchoredAtTheSource) {
+  ExcludeMatcher matcher;
+  matcher.add("docs/*.tmp");
+  matcher.add("/cache");
+  matcher.add("src/**/generated");
+  ASSERT_TRUE(matcher.needsRelativePath());
+
+  ASSERT_TRUE(matcher.excludes("a.tmp", "docs/a.tmp", false));
+  ASSERT_FALSE(matcher.excludes("a.tmp", "docs/sub/a.tmp", false));
+  ASSERT_FALSE(matcher.excludes("a.tmp", "other/docs/a.tmp", false));
+  ASSERT_TRUE(matcher.excludes("cache", "cache", true));
+  ASSERT_FALSE(matcher.excludes("cache", "sub/cache", true));
+  ASSERT_TRUE(matcher.excludes("generated", "src/generated", true));
+  ASSERT_TRUE(matcher.excludes("generated", "src/a/b/generated", true));
+}
+
+TEST(ExcludeMatcherTest, ReadsPatternFilesAndIgnoresComments) {
+  fs::path file = fs::path(testing::TempDir()) / "ekatra_excludes.txt";
+  {
+    std::ofstream out(file);
+    out << "# build output\n\n__pycache__\r\n*.o\n";
+  }
+  ExcludeMatcher matcher;
+  ASSERT_TRUE(matcher.addFile(file));
+  ASSERT_TRUE(matcher.excludes("__pycache__", "", true));
+  ASSERT_TRUE(matcher.excludes("main.o", "", false));
+  ASSERT_FALSE(matcher.excludes("# build output", "", false));
+  ASSERT_FALSE(matcher.addFile(file.string() + ".missing"));
+  fs::remove(file);
+}
+
+TEST(ExcludeMatcherTest, FingerprintDependsOnPatterns) {
+  ExcludeMatcher none;
+  ExcludeMatcher a;
+  ExcludeMatcher b;
+  a.add("*.log");
+  b.add("*.tmp");
+  ASSERT_EQ(none.fingerprint(), 0u);
+  ASSERT_NE(a.fingerprint(), 0u);
+  ASSERT_NE(a.fingerprint(), b.fingerprint());
+}
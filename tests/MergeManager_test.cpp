@@ -1,9 +1,14 @@
 #include "../src/MergeManager.h"
+#include "../src/Manifest/Manifest.h"
 #include "gtest/gtest.h"
 #include <filesystem>
 #include <fstream>
 #include <string>
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
 namespace fs = std::filesystem;
 
 // Test fixture for MergeManager tests.
@@ -16,16 +21,17 @@ protected:
     fs::create_directories(baseDir);
 
     // Set up our standard source and destination folders inside the temp dir.
-    options.sourceA = baseDir / "src_a";
-    options.sourceB = baseDir / "src_b";
+    sourceA = baseDir / "src_a";
+    sourceB = baseDir / "src_b";
+    options.sources = {sourceA, sourceB};
     options.destination = baseDir / "dest";
     options.skipDuplicates = false;
     options.operation = MergeManager::Operation::Copy;
     options.verbose = false;
     options.includeHidden = false;
 
-    fs::create_directories(options.sourceA);
-    fs::create_directories(options.sourceB);
+    fs::create_directories(sourceA);
+    fs::create_directories(sourceB);
     fs::create_directories(options.destination);
   }
 
@@ -61,6 +67,8 @@ protected:
 
   MergeManager manager;
   fs::path baseDir;
+  fs::path sourceA;
+  fs::path sourceB;
   ProcessOptions options;
 };
 
@@ -94,8 +102,8 @@ TEST_F(MergeManagerTest, GetDestinationForFile_DotFile) {
 // --- Tests for the main 'process' logic ---
 
 TEST_F(MergeManagerTest, Process_BasicCopy) {
-  createFile(options.sourceA / "report.pdf");
-  createFile(options.sourceB / "image.png");
+  createFile(sourceA / "report.pdf");
+  createFile(sourceB / "image.png");
 
   options.operation = MergeManager::Operation::Copy;
   manager.process(options);
@@ -105,13 +113,13 @@ TEST_F(MergeManagerTest, Process_BasicCopy) {
   ASSERT_TRUE(fs::exists(options.destination / "Media/Images/image.png"));
 
   // Verify original files still exist
-  ASSERT_TRUE(fs::exists(options.sourceA / "report.pdf"));
-  ASSERT_TRUE(fs::exists(options.sourceB / "image.png"));
+  ASSERT_TRUE(fs::exists(sourceA / "report.pdf"));
+  ASSERT_TRUE(fs::exists(sourceB / "image.png"));
 }
 
 TEST_F(MergeManagerTest, Process_BasicMove) {
-  createFile(options.sourceA / "archive.zip");
-  createFile(options.sourceB / "video.mp4");
+  createFile(sourceA / "archive.zip");
+  createFile(sourceB / "video.mp4");
 
   options.operation = MergeManager::Operation::Move;
   manager.process(options);
@@ -121,13 +129,13 @@ TEST_F(MergeManagerTest, Process_BasicMove) {
   ASSERT_TRUE(fs::exists(options.destination / "Media/Videos/video.mp4"));
 
   // Verify original files are gone
-  ASSERT_FALSE(fs::exists(options.sourceA / "archive.zip"));
-  ASSERT_FALSE(fs::exists(options.sourceB / "video.mp4"));
+  ASSERT_FALSE(fs::exists(sourceA / "archive.zip"));
+  ASSERT_FALSE(fs::exists(sourceB / "video.mp4"));
 }
 
 TEST_F(MergeManagerTest, Process_DuplicateFilenameRenaming) {
-  createFile(options.sourceA / "duplicate.txt");
-  createFile(options.sourceB / "duplicate.txt");
+  createFile(sourceA / "duplicate.txt");
+  createFile(sourceB / "duplicate.txt");
 
   options.skipDuplicates = false;
   manager.process(options);
@@ -139,8 +147,8 @@ TEST_F(MergeManagerTest, Process_DuplicateFilenameRenaming) {
 }
 
 TEST_F(MergeManagerTest, Process_DuplicateFilenameSkipping) {
-  createFile(options.sourceA / "duplicate.txt");
-  createFile(options.sourceB / "duplicate.txt");
+  createFile(sourceA / "duplicate.txt");
+  createFile(sourceB / "duplicate.txt");
 
   options.skipDuplicates = true;
   manager.process(options);
@@ -153,8 +161,39 @@ TEST_F(MergeManagerTest, Process_DuplicateFilenameSkipping) {
       fs::exists(options.destination / "Documents/Text/duplicate_1.txt"));
 }
 
+TEST_F(MergeManagerTest, Process_LinkModeLinksAndRenamesDuplicates) {
+  createFile(sourceA / "duplicate.txt");
+  createFile(sourceB / "duplicate.txt");
+  createFile(sourceB / "image.png");
+
+  options.operation = MergeManager::Operation::Link;
+  manager.process(options);
+
+  fs::path text = options.destination / "Documents/Text";
+  ASSERT_TRUE(fs::equivalent(sourceA / "duplicate.txt", text / "duplicate.txt"));
+  ASSERT_TRUE(
+      fs::equivalent(sourceB / "duplicate.txt", text / "duplicate_1.txt"));
+  ASSERT_TRUE(fs::equivalent(sourceB / "image.png",
+                             options.destination / "Media/Images/image.png"));
+  ASSERT_EQ(fs::hard_link_count(sourceA / "duplicate.txt"), 2u);
+}
+
+TEST_F(MergeManagerTest, Process_LinkModeSkipsDuplicates) {
+  createFile(sourceA / "duplicate.txt");
+  createFile(sourceB / "duplicate.txt");
+
+  options.operation = MergeManager::Operation::Link;
+  options.skipDuplicates = true;
+  manager.process(options);
+
+  fs::path text = options.destination / "Documents/Text";
+  ASSERT_TRUE(fs::equivalent(sourceA / "duplicate.txt", text / "duplicate.txt"));
+  ASSERT_FALSE(fs::exists(text / "duplicate_1.txt"));
+  ASSERT_EQ(fs::hard_link_count(sourceB / "duplicate.txt"), 1u);
+}
+
 TEST_F(MergeManagerTest, Process_HandlesNestedDirectories) {
-  createFile(options.sourceA / "deep" / "nested" / "folder" / "code.py");
+  createFile(sourceA / "deep" / "nested" / "folder" / "code.py");
 
   manager.process(options);
 
@@ -165,12 +204,12 @@ TEST_F(MergeManagerTest, Process_HandlesNestedDirectories) {
 }
 
 TEST_F(MergeManagerTest, Process_HandlesEmptySourceDirectory) {
-  createFile(options.sourceB / "audio.mp3");
+  createFile(sourceB / "audio.mp3");
 
-  // options.sourceA is empty
+  // sourceA is empty
   manager.process(options);
 
-  // Verify the file from options.sourceB was processed correctly and no errors
+  // Verify the file from sourceB was processed correctly and no errors
   // occurred
   ASSERT_TRUE(fs::exists(options.destination / "Audio/audio.mp3"));
   ASSERT_FALSE(fs::exists(options.destination /
@@ -178,7 +217,7 @@ TEST_F(MergeManagerTest, Process_HandlesEmptySourceDirectory) {
 }
 
 TEST_F(MergeManagerTest, Process_HandlesFilenamesWithSpaces) {
-  createFile(options.sourceA / "My Important Presentation.pptx");
+  createFile(sourceA / "My Important Presentation.pptx");
 
   manager.process(options);
 
@@ -188,9 +227,9 @@ TEST_F(MergeManagerTest, Process_HandlesFilenamesWithSpaces) {
 }
 
 TEST_F(MergeManagerTest, Process_HandlesSourceAndDestinationOverlap) {
-  createFile(options.sourceA / "presentation.key");
+  createFile(sourceA / "presentation.key");
   // Here, one of the source folders IS the destination.
-  options.destination = options.sourceA;
+  options.destination = sourceA;
   options.operation = MergeManager::Operation::Move;
   manager.process(options);
 
@@ -198,22 +237,22 @@ TEST_F(MergeManagerTest, Process_HandlesSourceAndDestinationOverlap) {
   // folder. This ensures the tool doesn't enter an infinite loop or corrupt
   // data.
   ASSERT_TRUE(
-      fs::exists(options.sourceA / "Documents/Presentations/presentation.key"));
+      fs::exists(sourceA / "Documents/Presentations/presentation.key"));
 
   // The original file at the root of the source folder should be gone.
-  ASSERT_FALSE(fs::exists(options.sourceA / "presentation.key"));
+  ASSERT_FALSE(fs::exists(sourceA / "presentation.key"));
 }
 
 TEST_F(MergeManagerTest, Process_HandlesSpecialCharactersInFilenames) {
   std::string specialName = "file-with-!@#$&-éà-你好.txt";
-  createFile(options.sourceA / specialName);
+  createFile(sourceA / specialName);
 
   manager.process(options);
   ASSERT_TRUE(fs::exists(options.destination / "Documents/Text" / specialName));
 }
 
 TEST_F(MergeManagerTest, Process_HandlesEmptyFiles) {
-  createFile(options.sourceA / "empty.txt", true); // Create a zero-byte file
+  createFile(sourceA / "empty.txt", true); // Create a zero-byte file
 
   manager.process(options);
   ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/empty.txt"));
@@ -221,7 +260,7 @@ TEST_F(MergeManagerTest, Process_HandlesEmptyFiles) {
 }
 
 TEST_F(MergeManagerTest, Process_HandlesSubdirectoriesNamedLikeCategories) {
-  createFile(options.sourceA / "Media" / "my-song.mp3");
+  createFile(sourceA / "Media" / "my-song.mp3");
 
   manager.process(options);
   // Should not create options.destination /Media/Media/my-song.mp3
@@ -229,8 +268,8 @@ TEST_F(MergeManagerTest, Process_HandlesSubdirectoriesNamedLikeCategories) {
 }
 
 TEST_F(MergeManagerTest, Process_HandlesCaseVariantDuplicateFilenames) {
-  createFile(options.sourceA / "report.pdf");
-  createFile(options.sourceB / "REPORT.PDF");
+  createFile(sourceA / "report.pdf");
+  createFile(sourceB / "REPORT.PDF");
 
   manager.process(options);
 
@@ -254,9 +293,9 @@ TEST_F(MergeManagerTest, Process_HandlesCaseVariantDuplicateFilenames) {
 
 #ifndef _WIN32
 TEST_F(MergeManagerTest, Process_SkipsSymbolicLinks) {
-  fs::path targetFile = options.sourceA / "target.txt";
+  fs::path targetFile = sourceA / "target.txt";
   createFile(targetFile);
-  fs::path symlink = options.sourceA / "link.txt";
+  fs::path symlink = sourceA / "link.txt";
   fs::create_symlink(targetFile, symlink);
 
   manager.process(options);
@@ -269,10 +308,10 @@ TEST_F(MergeManagerTest, Process_SkipsSymbolicLinks) {
 #endif
 
 TEST_F(MergeManagerTest, Process_HandlesIdenticalSourceFolders) {
-  createFile(options.sourceA / "unique.txt");
-  // Both options.sourceA and options.sourceB point to the same directory
+  createFile(sourceA / "unique.txt");
+  // Both sources point to the same directory
 
-  options.sourceB = options.sourceA;
+  options.sources = {sourceA, sourceA};
   manager.process(options);
 
   // The directory is processed twice, so we expect the original and a renamed
@@ -282,8 +321,8 @@ TEST_F(MergeManagerTest, Process_HandlesIdenticalSourceFolders) {
 }
 
 TEST_F(MergeManagerTest, Process_IgnoresHiddenFilesByDefault) {
-  createFile(options.sourceA / "normal.txt");
-  createFile(options.sourceB / ".hidden_file");
+  createFile(sourceA / "normal.txt");
+  createFile(sourceB / ".hidden_file");
 
   // Default options have includeHidden = false
   manager.process(options);
@@ -295,8 +334,8 @@ TEST_F(MergeManagerTest, Process_IgnoresHiddenFilesByDefault) {
 }
 
 TEST_F(MergeManagerTest, Process_IncludesHiddenFilesWhenFlagged) {
-  createFile(options.sourceA / "normal.txt");
-  createFile(options.sourceB / ".hidden_file");
+  createFile(sourceA / "normal.txt");
+  createFile(sourceB / ".hidden_file");
 
   // Enable the option to include hidden files
   options.includeHidden = true;
@@ -318,8 +357,8 @@ TEST_F(MergeManagerTest, Process_IncludesHiddenFilesWhenFlagged) {
 }
 
 TEST_F(MergeManagerTest, Process_IncludesHiddenFilesWhenFlaggedPutInNewFolder) {
-  createFile(options.sourceA / "normal.txt");
-  createFile(options.sourceB / ".hidden_file");
+  createFile(sourceA / "normal.txt");
+  createFile(sourceB / ".hidden_file");
 
   // Enable the option to include hidden files
   options.includeHidden = true;
@@ -342,8 +381,8 @@ TEST_F(MergeManagerTest, Process_IncludesHiddenFilesWhenFlaggedPutInNewFolder) {
 
 TEST_F(MergeManagerTest,
        Process_IncludesRegexHiddenFilesWhenFlaggedPutInNewFolder) {
-  createFile(options.sourceA / "normal.txt");
-  createFile(options.sourceB / ".hidden_file-2025.log");
+  createFile(sourceA / "normal.txt");
+  createFile(sourceB / ".hidden_file-2025.log");
 
   // Enable the option to include hidden files
   options.includeHidden = true;
@@ -375,9 +414,9 @@ TEST_F(MergeManagerTest, Process_SortsFilesWithCustomRegexRules) {
   rulesFile.close();
 
   // 2. Create files that match the rules, and one that doesn't
-  createFile(options.sourceA / "invoice-2025-01.pdf");
-  createFile(options.sourceB / "store-receipt.jpg");
-  createFile(options.sourceA / "regular-photo.png");
+  createFile(sourceA / "invoice-2025-01.pdf");
+  createFile(sourceB / "store-receipt.jpg");
+  createFile(sourceA / "regular-photo.png");
 
   // 3. Set the rules file option and run the process
   options.rulesFile = rulesFilePath.string();
@@ -396,7 +435,7 @@ TEST_F(MergeManagerTest, Process_SortsFilesWithCustomRegexRules) {
 TEST_F(MergeManagerTest, Process_InteractiveRegexRuleCreation) {
   // 1. SETUP: Create a file with an unknown extension that will trigger the
   // prompt.
-  createFile(options.sourceA / "project-alpha-report.dat");
+  createFile(sourceA / "project-alpha-report.dat");
 
   // 2. PREPARE INPUT: This string simulates exactly what a user would type.
   //    - "3" to select the regex option.
@@ -427,9 +466,9 @@ TEST_F(MergeManagerTest, Process_InteractiveRegexRuleCreation) {
 
 TEST_F(MergeManagerTest, ScanOnly_IdentifiesUncategorizedFiles) {
   // 1. SETUP: Create a mix of known and unknown files.
-  fs::path knownFile = options.sourceA / "known.txt";
-  fs::path unknownFile1 = options.sourceB / "unknown.dat";
-  fs::path unknownFile2 = options.sourceA / "archive.special";
+  fs::path knownFile = sourceA / "known.txt";
+  fs::path unknownFile1 = sourceB / "unknown.dat";
+  fs::path unknownFile2 = sourceA / "archive.special";
   createFile(knownFile);
   createFile(unknownFile1);
   createFile(unknownFile2);
@@ -464,8 +503,8 @@ TEST_F(MergeManagerTest, ScanOnly_IdentifiesUncategorizedFiles) {
 
 TEST_F(MergeManagerTest, ScanOnly_HandlesNoUncategorizedFiles) {
   // 1. SETUP: Create only files with known extensions.
-  createFile(options.sourceA / "document.pdf");
-  createFile(options.sourceB / "photo.jpg");
+  createFile(sourceA / "document.pdf");
+  createFile(sourceB / "photo.jpg");
 
   // 2. ACTION: Run the scan.
   fs::path scanOutputPath = baseDir / "scan_results.txt";
@@ -483,15 +522,15 @@ TEST_F(MergeManagerTest, ScanOnly_HandlesNoUncategorizedFiles) {
 
 TEST_F(MergeManagerTest, Process_SimpleMergeNoSort) {
   // 1. SETUP: Create some files, including a duplicate.
-  createFile(options.sourceA / "file1.txt");
-  createFile(options.sourceA / "duplicate.log");
-  createFile(options.sourceA / "docs/document.pdf");
-  createFile(options.sourceA / "media/picture1.png");
-  createFile(options.sourceA / "media/5.png");
-  createFile(options.sourceB / "file2.jpg");
-  createFile(options.sourceB / "duplicate.log");
-  createFile(options.sourceB / "media/picture2.png");
-  createFile(options.sourceB / "media/5.png");
+  createFile(sourceA / "file1.txt");
+  createFile(sourceA / "duplicate.log");
+  createFile(sourceA / "docs/document.pdf");
+  createFile(sourceA / "media/picture1.png");
+  createFile(sourceA / "media/5.png");
+  createFile(sourceB / "file2.jpg");
+  createFile(sourceB / "duplicate.log");
+  createFile(sourceB / "media/picture2.png");
+  createFile(sourceB / "media/5.png");
 
   // 2. ACTION: Run the process with the no-sort flag enabled.
   options.noSort = true;
@@ -509,4 +548,342 @@ TEST_F(MergeManagerTest, Process_SimpleMergeNoSort) {
   ASSERT_TRUE(fs::exists(options.destination / "duplicate.log"));
   ASSERT_FALSE(fs::exists(options.destination / "duplicate_1.log"));
   ASSERT_FALSE(fs::exists(options.destination / "media/5_1.png"));
-}
\ No newline at end of file
+}
+TEST_F(MergeManagerTest, Process_NoSortWithTrailingSeparatorInSource) {
+  createFile(sourceA / "nested/inner.txt");
+  createFile(sourceB / "top.txt");
+
+  options.noSort = true;
+  options.sources[0] = sourceA.string() + "/";
+  manager.process(options);
+
+  ASSERT_TRUE(fs::exists(options.destination / "nested/inner.txt"));
+  ASSERT_TRUE(fs::exists(options.destination / "top.txt"));
+}
+
+TEST_F(MergeManagerTest, Process_StreamingMatchesBatchMode) {
+  for (int i = 0; i < 200; ++i) {
+    createFile(sourceA / ("dir" + std::to_string(i % 7)) /
+               ("photo" + std::to_string(i) + ".jpg"));
+    createFile(sourceB / ("notes" + std::to_string(i) + ".txt"));
+  }
+  createFile(sourceB / "nested/deeper/song.mp3");
+
+  options.streaming = true;
+  manager.process(options);
+
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_TRUE(fs::exists(options.destination / "Media/Images" /
+                           ("photo" + std::to_string(i) + ".jpg")));
+    ASSERT_TRUE(fs::exists(options.destination / "Documents/Text" /
+                           ("notes" + std::to_string(i) + ".txt")));
+  }
+  ASSERT_TRUE(fs::exists(options.destination / "Audio/song.mp3"));
+  // Sources are untouched in copy mode.
+  ASSERT_TRUE(fs::exists(sourceA / "dir0/photo0.jpg"));
+}
+
+TEST_F(MergeManagerTest, Process_StreamingRenamesDuplicates) {
+  createFile(sourceA / "duplicate.txt");
+  createFile(sourceB / "duplicate.txt");
+
+  options.streaming = true;
+  manager.process(options);
+
+  ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/duplicate.txt"));
+  ASSERT_TRUE(
+      fs::exists(options.destination / "Documents/Text/duplicate_1.txt"));
+}
+
+TEST_F(MergeManagerTest, Process_WritesAndReusesScanIndex) {
+  createFile(sourceA / "old/report.pdf");
+  createFile(sourceB / "photo.png");
+  options.scanIndexFile = baseDir / "dest.ekatra-index";
+  options.skipDuplicates = true;
+
+  manager.process(options);
+  ASSERT_TRUE(fs::exists(options.scanIndexFile));
+  ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/report.pdf"));
+
+  createFile(sourceB / "song.mp3");
+  manager.process(options);
+  ASSERT_TRUE(fs::exists(options.destination / "Audio/song.mp3"));
+  ASSERT_FALSE(fs::exists(options.destination / "Media/Images/photo_1.png"));
+}
+
+TEST_F(MergeManagerTest, Process_MergesMoreThanTwoSources) {
+  fs::path sourceC = baseDir / "src_c";
+  fs::path sourceD = baseDir / "src_d";
+  createFile(sourceA / "shared.txt");
+  createFile(sourceB / "shared.txt");
+  createFile(sourceC / "shared.txt");
+  createFile(sourceD / "nested/song.mp3");
+  options.sources = {sourceA, sourceB, sourceC, sourceD};
+
+  manager.process(options);
+
+  // Duplicates are numbered in the order the sources were given.
+  ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/shared.txt"));
+  ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/shared_1.txt"));
+  ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/shared_2.txt"));
+  ASSERT_TRUE(fs::exists(options.destination / "Audio/song.mp3"));
+}
+
+TEST_F(MergeManagerTest, Process_NoSortMergesMoreThanTwoSources) {
+  fs::path sourceC = baseDir / "src_c";
+  createFile(sourceA / "a/one.txt");
+  createFile(sourceB / "b/two.txt");
+  createFile(sourceC / "a/three.txt");
+  options.sources = {sourceA, sourceB, sourceC};
+  options.noSort = true;
+
+  manager.process(options);
+
+  ASSERT_TRUE(fs::exists(options.destination / "a/one.txt"));
+  ASSERT_TRUE(fs::exists(options.destination / "b/two.txt"));
+  ASSERT_TRUE(fs::exists(options.destination / "a/three.txt"));
+}
+
+TEST_F(MergeManagerTest, Process_SkipsExcludedFilesAndFolders) {
+  createFile(sourceA / "app.js");
+  createFile(sourceA / "node_modules/lib/index.js");
+  createFile(sourceB / "__pycache__/mod.cpython-311.pyc");
+  createFile(sourceB / "notes.txt");
+  createFile(sourceB / "debug.log");
+  fs::path excludeFile = baseDir / "excludes.txt";
+  {
+    std::ofstream out(excludeFile);
+    out << "# Python\n__pycache__/\n";
+  }
+  options.excludePatterns = {"node_modules", "*.log"};
+  options.excludeFile = excludeFile;
+
+  manager.process(options);
+
+  ASSERT_TRUE(fs::exists(options.destination / "Code/app.js"));
+  ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/notes.txt"));
+  size_t copied = 0;
+  for (const auto &entry :
+       fs::recursive_directory_iterator(options.destination)) {
+    copied += entry.is_regular_file() ? 1 : 0;
+  }
+  ASSERT_EQ(copied, 2u);
+}
+
+TEST_F(MergeManagerTest, Process_CopiesWithEveryReflinkMode) {
+  createFile(sourceA / "report.pdf");
+  for (auto reflink : {CopyEngine::Reflink::Never, CopyEngine::Reflink::Auto}) {
+    fs::remove_all(options.destination);
+    options.reflink = reflink;
+
+    manager.process(options);
+
+    std::ifstream in(options.destination / "Documents/Text/report.pdf");
+    std::string text;
+    in >> text;
+    ASSERT_EQ(text, "test");
+  }
+}
+
+TEST_F(MergeManagerTest, Process_IoUringCopyMatchesRegularCopy) {
+  createFile(sourceA / "report.pdf");
+  createFile(sourceA / "deep/notes.txt");
+  createFile(sourceB / "image.png");
+  createFile(sourceB / "empty.txt", true);
+  options.ioUringCopy = true;
+  options.filesInFlight = 2;
+
+  manager.process(options);
+
+  // Without io_uring the regular copy runs; the result is the same.
+  for (const char *file : {"Documents/Text/notes.txt", "Media/Images/image.png",
+                           "Documents/Text/report.pdf"}) {
+    std::ifstream in(options.destination / file);
+    std::string text;
+    in >> text;
+    ASSERT_EQ(text, "test") << file;
+  }
+  ASSERT_EQ(fs::file_size(options.destination / "Documents/Text/empty.txt"),
+            0u);
+}
+
+TEST_F(MergeManagerTest, Process_IoUringCopyOfASparseFileFitsATightBudget) {
+  // The sparse file falls back to CopyEngine, which borrows a buffer from
+  // the budget the copier's slots draw on.
+  createFile(sourceA / "clip.mp4");
+  fs::resize_file(sourceA / "clip.mp4", 8 * 1024 * 1024);
+  createFile(sourceB / "image.png");
+  options.ioUringCopy = true;
+  options.filesInFlight = 16;
+  options.bufferMemory = 4 * 1024 * 1024;
+
+  manager.process(options);
+
+  ASSERT_EQ(fs::file_size(options.destination / "Media/Videos/clip.mp4"),
+            8u * 1024 * 1024);
+  std::ifstream in(options.destination / "Media/Images/image.png");
+  std::string text;
+  in >> text;
+  ASSERT_EQ(text, "test");
+}
+
+TEST_F(MergeManagerTest, Process_JobsRenameDuplicatesInSourceOrder) {
+  // Same name in many folders: the _N suffixes must follow the scan order,
+  // exactly as without workers.
+  const int kFolders = 40;
+  for (int i = 0; i < kFolders; ++i) {
+    fs::path folder = sourceA / ("d" + std::to_string(100 + i));
+    fs::create_directories(folder);
+    std::ofstream(folder / "photo.jpg") << i;
+  }
+  ProcessOptions sequential = options;
+  sequential.destination = baseDir / "sequential";
+  manager.process(sequential);
+
+  options.jobs = 4;
+  manager.process(options);
+
+  fs::path images = options.destination / "Media/Images";
+  size_t count = 0;
+  for (const auto &entry : fs::directory_iterator(images)) {
+    std::ifstream parallelCopy(entry.path());
+    std::ifstream sequentialCopy(sequential.destination / "Media/Images" /
+                                 entry.path().filename());
+    int parallelValue = -1;
+    int sequentialValue = -2;
+    parallelCopy >> parallelValue;
+    sequentialCopy >> sequentialValue;
+    ASSERT_EQ(parallelValue, sequentialValue) << entry.path();
+    ++count;
+  }
+  ASSERT_EQ(count, static_cast<size_t>(kFolders));
+}
+
+TEST_F(MergeManagerTest, Process_JobsMoveAndStreamEveryFile) {
+  for (int i = 0; i < 30; ++i) {
+    createFile(sourceA / ("a" + std::to_string(i) + ".txt"));
+    createFile(sourceB / ("nested/b" + std::to_string(i) + ".pdf"));
+  }
+  options.jobs = 3;
+  options.streaming = true;
+  options.operation = MergeManager::Operation::Move;
+
+  manager.process(options);
+
+  for (int i = 0; i < 30; ++i) {
+    ASSERT_TRUE(fs::exists(options.destination / "Documents/Text" /
+                           ("a" + std::to_string(i) + ".txt")));
+    ASSERT_TRUE(fs::exists(options.destination / "Documents/Text" /
+                           ("b" + std::to_string(i) + ".pdf")));
+    ASSERT_FALSE(fs::exists(sourceA / ("a" + std::to_string(i) + ".txt")));
+  }
+}
+
+#ifndef _WIN32
+TEST_F(MergeManagerTest, Process_MovesAcrossFilesystems) {
+  // tmpfs is usually another filesystem than the test's temp folder.
+  fs::path other = "/dev/shm";
+  struct stat here, there;
+  if (::stat(baseDir.c_str(), &here) != 0 ||
+      ::stat(other.c_str(), &there) != 0 || here.st_dev == there.st_dev) {
+    GTEST_SKIP() << "no second filesystem to move to";
+  }
+  for (unsigned jobs : {1u, 3u}) {
+    options.destination = other / ("EkatraMoveTest" + std::to_string(jobs));
+    fs::remove_all(options.destination);
+    for (int i = 0; i < 20; ++i) {
+      createFile(sourceA / ("a" + std::to_string(i) + ".txt"));
+    }
+    options.jobs = jobs;
+    options.operation = MergeManager::Operation::Move;
+
+    manager.process(options);
+
+    fs::path text = options.destination / "Documents/Text";
+    size_t entries = 0;
+    for (const auto &entry : fs::directory_iterator(text)) {
+      // No partial copies left behind.
+      ASSERT_EQ(entry.path().filename().string().find(".ekatra-part"),
+                std::string::npos);
+      ++entries;
+    }
+    ASSERT_EQ(entries, 20u);
+    for (int i = 0; i < 20; ++i) {
+      fs::path moved = text / ("a" + std::to_string(i) + ".txt");
+      std::ifstream in(moved);
+      std::string content;
+      in >> content;
+      ASSERT_EQ(content, "test");
+      ASSERT_FALSE(fs::exists(sourceA / ("a" + std::to_string(i) + ".txt")));
+    }
+    fs::remove_all(options.destination);
+  }
+}
+#endif
+
+TEST_F(MergeManagerTest, Process_EveryDurabilityPolicyCopiesTheSameFiles) {
+  createFile(sourceA / "report.pdf");
+  createFile(sourceB / "image.png");
+  createFile(sourceB / "nested/notes.txt");
+  for (auto policy :
+       {SyncTracker::Policy::None, SyncTracker::Policy::Batch,
+        SyncTracker::Policy::File}) {
+    fs::remove_all(options.destination);
+    options.durability = policy;
+    manager.process(options);
+
+    ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/report.pdf"));
+    ASSERT_TRUE(fs::exists(options.destination / "Media/Images/image.png"));
+    ASSERT_TRUE(fs::exists(options.destination / "Documents/Text/notes.txt"));
+  }
+}
+
+TEST_F(MergeManagerTest, Process_ManifestLetsVerifyFindChangedCopies) {
+  createFile(sourceA / "report.pdf");
+  createFile(sourceB / "image.png");
+  createFile(sourceB / "empty.txt", true);
+  options.manifestFile = baseDir / "copies.manifest";
+  for (bool ioUringCopy : {false, true}) {
+    fs::remove_all(options.destination);
+    options.ioUringCopy = ioUringCopy;
+    manager.process(options);
+
+    std::vector<Manifest::Entry> entries;
+    size_t badLines = 0;
+    ASSERT_TRUE(Manifest::read(options.manifestFile, entries, badLines));
+    ASSERT_EQ(entries.size(), 3u);
+    ASSERT_EQ(badLines, 0u);
+    ASSERT_TRUE(manager.verify(options));
+  }
+
+  // Same size, different bytes.
+  std::ofstream(options.destination / "Media/Images/image.png") << "TEST";
+  ASSERT_FALSE(manager.verify(options));
+  std::ofstream(options.destination / "Media/Images/image.png") << "test";
+  ASSERT_TRUE(manager.verify(options));
+  fs::remove(options.destination / "Documents/Text/report.pdf");
+  ASSERT_FALSE(manager.verify(options));
+}
+
+TEST_F(MergeManagerTest, Process_DeviceQueuesCopyAndMoveEveryFile) {
+  for (int i = 0; i < 20; ++i) {
+    createFile(sourceA / ("a" + std::to_string(i) + ".txt"));
+    createFile(sourceB / ("b" + std::to_string(i) + ".png"));
+  }
+  options.deviceQueues = true;
+  for (auto operation :
+       {MergeManager::Operation::Copy, MergeManager::Operation::Move}) {
+    fs::remove_all(options.destination);
+    options.operation = operation;
+    manager.process(options);
+
+    for (int i = 0; i < 20; ++i) {
+      ASSERT_TRUE(fs::exists(options.destination / "Documents/Text" /
+                             ("a" + std::to_string(i) + ".txt")));
+      ASSERT_TRUE(fs::exists(options.destination / "Media/Images" /
+                             ("b" + std::to_string(i) + ".png")));
+    }
+  }
+  ASSERT_TRUE(fs::is_empty(sourceA));
+  ASSERT_TRUE(fs::is_empty(sourceB));
+}
@@ -0,0 +1,84 @@
+#include "../src/DirHandle/DirHandle.h"
+#include "../src/SyncTracker/SyncTracker.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+class SyncTrackerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    baseDir = fs::path(testing::TempDir()) / "EkatraSyncTrackerTest";
+    fs::remove_all(baseDir);
+    fs::create_directories(baseDir);
+    folder = DirHandle::open(baseDir);
+  }
+
+  void TearDown() override {
+    std::error_code ec;
+    fs::remove_all(baseDir, ec);
+  }
+
+  void writeFiles(SyncTracker &tracker, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      std::string name = "file" + std::to_string(i);
+      std::ofstream(baseDir / name) << "data";
+      std::error_code ec;
+      tracker.fileWritten(*folder, name, 4, ec);
+      ASSERT_FALSE(ec) << ec.message();
+    }
+  }
+
+  std::vector<std::string> flush(SyncTracker &tracker) {
+    std::vector<std::string> errors;
+    tracker.flush([&errors](const fs::path &path, const std::error_code &) {
+      errors.push_back(path.string());
+    });
+    return errors;
+  }
+
+  fs::path baseDir;
+  std::shared_ptr<DirHandle> folder;
+};
+
+TEST_F(SyncTrackerTest, NoneSyncsNothing) {
+  SyncTracker tracker(SyncTracker::Policy::None);
+  writeFiles(tracker, 3);
+  ASSERT_TRUE(flush(tracker).empty());
+  ASSERT_EQ(tracker.filesSynced(), 0u);
+}
+
+TEST_F(SyncTrackerTest, FileSyncsEveryFileRightAway) {
+  SyncTracker tracker(SyncTracker::Policy::File);
+  writeFiles(tracker, 3);
+  ASSERT_EQ(tracker.filesSynced(), 3u);
+  ASSERT_TRUE(flush(tracker).empty());
+  ASSERT_EQ(tracker.filesSynced(), 3u);
+}
+
+TEST_F(SyncTrackerTest, BatchSyncsOnceTheBatchIsFullAndAtTheEnd) {
+  SyncTracker tracker(SyncTracker::Policy::Batch);
+  writeFiles(tracker, SyncTracker::kBatchFiles - 1);
+  ASSERT_EQ(tracker.filesSynced(), 0u);
+  writeFiles(tracker, 2);
+  ASSERT_EQ(tracker.filesSynced(), SyncTracker::kBatchFiles);
+
+  ASSERT_TRUE(flush(tracker).empty());
+  ASSERT_EQ(tracker.filesSynced(), SyncTracker::kBatchFiles + 1);
+  // Nothing left for a second flush.
+  ASSERT_TRUE(flush(tracker).empty());
+  ASSERT_EQ(tracker.filesSynced(), SyncTracker::kBatchFiles + 1);
+}
+
+TEST_F(SyncTrackerTest, ReportsFoldersThatCannotBeSynced) {
+  fs::create_directories(baseDir / "gone");
+  auto gone = DirHandle::open(baseDir / "gone");
+  SyncTracker tracker(SyncTracker::Policy::Batch);
+  tracker.entryChanged(*gone);
+  tracker.entryChanged(*folder);
+  fs::remove(baseDir / "gone");
+
+  std::vector<std::string> errors = flush(tracker);
+  ASSERT_EQ(errors.size(), 1u);
+  ASSERT_EQ(errors[0], (baseDir / "gone").string());
+}
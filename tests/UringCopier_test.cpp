@@ -0,0 +1,172 @@
+#include "../src/UringCopier/UringCopier.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/resource.h>
+
+namespace fs = std::filesystem;
+
+class UringCopierTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    baseDir = fs::path(testing::TempDir()) / "EkatraUringCopierTest";
+    fs::remove_all(baseDir);
+    fs::create_directories(baseDir);
+  }
+
+  void TearDown() override {
+    std::error_code ec;
+    fs::remove_all(baseDir, ec);
+  }
+
+  std::string makeContent(size_t size, unsigned seed) {
+    std::string content(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+      content[i] = static_cast<char>((i * 131 + seed) ^ (i >> 7));
+    }
+    return content;
+  }
+
+  std::string readFile(const fs::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+  }
+
+  fs::path baseDir;
+};
+
+TEST_F(UringCopierTest, CopiesManyFilesInFlight) {
+  UringCopier::Options options;
+  options.filesInFlight = 3;
+  options.chunkSize = 4096;
+  UringCopier copier(options);
+  if (!copier.valid()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+
+  // Empty, partial chunk, exact chunks, and many chunks with a tail.
+  std::vector<size_t> sizes = {0, 100, 4096, 8192, 50000, 1, 12345, 4097};
+  std::vector<std::string> contents;
+  std::vector<std::uintmax_t> copied(sizes.size(), 0);
+  std::vector<long long> lastProgress(sizes.size(), 0);
+  size_t done = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    contents.push_back(makeContent(sizes[i], static_cast<unsigned>(i)));
+    fs::path source = baseDir / ("in" + std::to_string(i));
+    std::ofstream(source, std::ios::binary) << contents[i];
+
+    UringCopier::Callbacks callbacks;
+    callbacks.onProgress = [&, i](long long bytes) {
+      ASSERT_GE(bytes, lastProgress[i]);
+      lastProgress[i] = bytes;
+    };
+    callbacks.onDone = [&, i](std::uintmax_t bytes, std::error_code ec) {
+      ASSERT_FALSE(ec) << ec.message();
+      copied[i] = bytes;
+      ++done;
+    };
+    UniqueFd in(::open(source.c_str(), O_RDONLY));
+    UniqueFd out(::open((baseDir / ("out" + std::to_string(i))).c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    copier.submit(std::move(in), std::move(out), sizes[i],
+                  std::move(callbacks));
+  }
+  copier.drain();
+
+  ASSERT_EQ(done, sizes.size());
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    ASSERT_EQ(copied[i], sizes[i]);
+    ASSERT_EQ(lastProgress[i], static_cast<long long>(sizes[i]));
+    ASSERT_TRUE(readFile(baseDir / ("out" + std::to_string(i))) ==
+                contents[i])
+        << "file " << i;
+  }
+}
+
+TEST_F(UringCopierTest, CopiesToTheRealEndOfFile) {
+  UringCopier::Options options;
+  options.chunkSize = 4096;
+  UringCopier copier(options);
+  if (!copier.valid()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+
+  // The scan saw other sizes than the files have now: one grew, one shrank.
+  std::string grown = makeContent(10000, 1);
+  std::string shrunk = makeContent(5000, 2);
+  std::ofstream(baseDir / "grown", std::ios::binary) << grown;
+  std::ofstream(baseDir / "shrunk", std::ios::binary) << shrunk;
+  std::vector<std::pair<std::string, std::uintmax_t>> files = {
+      {"grown", 6000}, {"shrunk", 9000}};
+
+  std::vector<std::uintmax_t> copied;
+  for (const auto &file : files) {
+    UringCopier::Callbacks callbacks;
+    callbacks.onProgress = [](long long) {};
+    callbacks.onDone = [&copied](std::uintmax_t bytes, std::error_code ec) {
+      ASSERT_FALSE(ec) << ec.message();
+      copied.push_back(bytes);
+    };
+    copier.submit(
+        UniqueFd(::open((baseDir / file.first).c_str(), O_RDONLY)),
+        UniqueFd(::open((baseDir / (file.first + ".copy")).c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+        file.second, std::move(callbacks));
+  }
+  copier.drain();
+
+  ASSERT_EQ(copied.size(), 2u);
+  ASSERT_TRUE(readFile(baseDir / "grown.copy") == grown);
+  ASSERT_TRUE(readFile(baseDir / "shrunk.copy") == shrunk);
+}
+
+TEST_F(UringCopierTest, ReportsErrorsPerFile) {
+  UringCopier copier(UringCopier::Options{});
+  if (!copier.valid()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  std::ofstream(baseDir / "source") << "data";
+
+  std::error_code result;
+  bool finished = false;
+  UringCopier::Callbacks callbacks;
+  callbacks.onProgress = [](long long) {};
+  callbacks.onDone = [&](std::uintmax_t, std::error_code ec) {
+    result = ec;
+    finished = true;
+  };
+  // The target is opened read-only, so the write fails.
+  copier.submit(UniqueFd(::open((baseDir / "source").c_str(), O_RDONLY)),
+                UniqueFd(::open((baseDir / "source").c_str(), O_RDONLY)), 4,
+                std::move(callbacks));
+  copier.drain();
+
+  ASSERT_TRUE(finished);
+  ASSERT_TRUE(result);
+}
+
+TEST_F(UringCopierTest, StaysWithinTheOpenFileLimit) {
+  UringCopier::Options options;
+  options.filesInFlight = 1u << 20;
+  options.chunkSize = 4096;
+  UringCopier copier(options);
+  if (!copier.valid()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  struct rlimit limit;
+  ASSERT_EQ(::getrlimit(RLIMIT_NOFILE, &limit), 0);
+  if (limit.rlim_cur != RLIM_INFINITY) {
+    ASSERT_LE(copier.filesInFlight() * 2 + UringCopier::kReservedDescriptors,
+              std::max<rlim_t>(limit.rlim_cur,
+                               2 + UringCopier::kReservedDescriptors));
+  }
+  ASSERT_GE(copier.filesInFlight(), 1u);
+  ASSERT_LE(copier.filesInFlight(), UringCopier::kMaxFilesInFlight);
+}
+#endif